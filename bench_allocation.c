@@ -0,0 +1,440 @@
+#include "block_allocation.h"
+#include "run_search.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BLOCKS (4 * 1024 * 1024)
+#define OPS_PER_THREAD 200000
+#define MAX_THREADS 64
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Every thread keeps a small window of live allocations and frees the
+ * oldest one before each new allocation, so the disk never fills up.
+ */
+#define WINDOW 64
+
+static void *alloc_free_loop(void *arg) {
+  long *failures = arg;
+  int live[WINDOW];
+  int next = 0;
+
+  for (int i = 0; i < WINDOW; i++)
+    live[i] = -1;
+
+  for (int i = 0; i < OPS_PER_THREAD; i++) {
+    if (live[next] != -1 && free_block(live[next]) != 0)
+      (*failures)++;
+    live[next] = allocate_block(1);
+    if (live[next] == -1)
+      (*failures)++;
+    next = (next + 1) % WINDOW;
+  }
+
+  for (int i = 0; i < WINDOW; i++)
+    if (live[i] != -1)
+      free_block(live[i]);
+  return NULL;
+}
+
+/* Runs the allocate/free loop with 1, 2, 4, ... MAX_THREADS threads
+ * and prints the throughput of each run.
+ */
+static int bench_threads() {
+  if (format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) != 0)
+    return -1;
+
+  printf("%8s %14s %10s\n", "threads", "ops/s", "failures");
+  for (int n = 1; n <= MAX_THREADS; n *= 2) {
+    pthread_t threads[MAX_THREADS];
+    long failures[MAX_THREADS];
+
+    memset(failures, 0, sizeof(failures));
+    double start = now();
+    for (int t = 0; t < n; t++)
+      pthread_create(&threads[t], NULL, alloc_free_loop, &failures[t]);
+    long total_failures = 0;
+    for (int t = 0; t < n; t++) {
+      pthread_join(threads[t], NULL);
+      total_failures += failures[t];
+    }
+    double elapsed = now() - start;
+
+    /* every iteration is one allocation and one release */
+    double ops = 2.0 * n * OPS_PER_THREAD / elapsed;
+    printf("%8d %14.0f %10ld\n", n, ops, total_failures);
+  }
+  return 0;
+}
+
+#define SEARCH_BLOCKS (10 * 1000 * 1000)
+#define SEARCH_REPEAT 5
+
+/* Fills the tables with an aged disk: runs of 1 to 1024 used blocks
+ * and runs of 1 to 3 free blocks, with one run of 256 free blocks
+ * near the end that the searches have to get to.
+ */
+static void make_fragmented(uint64_t *words, unsigned char *bytes) {
+  unsigned seed = 1;
+  uint64_t b = 0;
+
+  memset(words, 0, (SEARCH_BLOCKS + 63) / 64 * sizeof(uint64_t));
+  while (b < SEARCH_BLOCKS) {
+    uint64_t used = 1 + rand_r(&seed) % 1024;
+    uint64_t unused = 1 + rand_r(&seed) % 3;
+    if (b < SEARCH_BLOCKS * 95 / 100 && b + used >= SEARCH_BLOCKS * 95 / 100)
+      unused = 256;
+
+    for (uint64_t i = 0; i < used && b < SEARCH_BLOCKS; i++, b++) {
+      words[b / 64] |= (uint64_t)1 << (b % 64);
+      bytes[b] = 1;
+    }
+    for (uint64_t i = 0; i < unused && b < SEARCH_BLOCKS; i++, b++)
+      bytes[b] = 0;
+  }
+}
+
+/* The search before the bitmap: try every start block and check the
+ * blocks after it one by one.
+ */
+static uint64_t naive_find_run(const unsigned char *bytes, uint64_t len) {
+  for (uint64_t start = 0; start + len <= SEARCH_BLOCKS; start++) {
+    uint64_t i = 0;
+    while (i < len && bytes[start + i] == 0)
+      i++;
+    if (i == len)
+      return start;
+  }
+  return SEARCH_BLOCKS;
+}
+
+/* Times one search in ms, and checks that it finds the same run as
+ * the naive search.
+ */
+static double time_search(const uint64_t *words, const unsigned char *bytes,
+                          uint64_t len, uint64_t expected) {
+  double start = now();
+  for (int r = 0; r < SEARCH_REPEAT; r++) {
+    uint64_t found = words ? bitmap_find_run(words, NULL, SEARCH_BLOCKS, 0, len)
+                           : bytes_find_run(bytes, SEARCH_BLOCKS, 0, len);
+    if (found != expected)
+      fprintf(stderr, "%s search for %" PRIu64 " blocks found %" PRIu64
+                      " instead of %" PRIu64 "\n",
+              run_search_kernel_name(), len, found, expected);
+  }
+  return (now() - start) * 1000 / SEARCH_REPEAT;
+}
+
+/* Compares the search kernels on a fragmented table of SEARCH_BLOCKS
+ * blocks, in both table layouts.
+ */
+static int bench_search() {
+  static const enum run_search_kernel kernels[] = {
+      RUN_SEARCH_SCALAR, RUN_SEARCH_SSE42, RUN_SEARCH_AVX2};
+  static const uint64_t lengths[] = {4, 16, 64, 256};
+  uint64_t *words = malloc((SEARCH_BLOCKS + 63) / 64 * sizeof(uint64_t));
+  unsigned char *bytes = malloc(SEARCH_BLOCKS);
+
+  if (words == NULL || bytes == NULL) {
+    fprintf(stderr, "Failed to allocate the tables\n");
+    free(words);
+    free(bytes);
+    return -1;
+  }
+  make_fragmented(words, bytes);
+
+  printf("%6s %8s %10s %10s %10s\n", "blocks", "kernel", "naive ms",
+         "bytes ms", "bitmap ms");
+  for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    double start = now();
+    uint64_t expected = naive_find_run(bytes, lengths[l]);
+    double naive = (now() - start) * 1000;
+
+    for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+      if (run_search_select(kernels[k]) != 0)
+        continue;
+      double in_bytes = time_search(NULL, bytes, lengths[l], expected);
+      double in_bitmap = time_search(words, NULL, lengths[l], expected);
+      printf("%6" PRIu64 " %8s %10.2f %10.2f %10.2f\n", lengths[l],
+             run_search_kernel_name(), naive, in_bytes, in_bitmap);
+    }
+  }
+  run_search_select(RUN_SEARCH_AUTO);
+
+  free(words);
+  free(bytes);
+  return 0;
+}
+
+#define FILL_OPS 100000
+
+/* Fills the disk from the start up to a growing share of its blocks,
+ * so that the free space is all at the end, and measures how long an
+ * allocate_block() and free_block() pair takes at each level.
+ */
+static int bench_fill() {
+  static const double levels[] = {0.5, 0.9, 0.99, 0.999};
+  uint64_t used = 0;
+
+  if (format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) != 0)
+    return -1;
+
+  printf("%8s %12s\n", "used", "ns/op");
+  for (unsigned l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+    uint64_t target = BENCH_BLOCKS * levels[l];
+    for (; used < target; used++) {
+      if (allocate_block(1) == -1) {
+        fprintf(stderr, "Failed to fill the disk\n");
+        return -1;
+      }
+    }
+
+    double start = now();
+    for (int i = 0; i < FILL_OPS; i++)
+      free_block(allocate_block(1));
+    double elapsed = now() - start;
+
+    printf("%7.1f%% %12.1f\n", levels[l] * 100, elapsed * 1e9 / FILL_OPS);
+  }
+  return 0;
+}
+
+#define LOCALITY_DIRS 32
+#define LOCALITY_FILES 100
+#define LOCALITY_WORKERS 4
+#define LOCALITY_MAX_EXTENTS 16
+
+/* The seek model: reading the next extent costs nothing if it starts
+ * where the last one ended, and otherwise 1 ms plus up to 9 ms more
+ * for a seek across the whole disk.
+ */
+static double seek_ms(uint64_t from, uint64_t to) {
+  if (from == to)
+    return 0;
+  uint64_t distance = (from < to) ? to - from : from - to;
+  return 1.0 + 9.0 * distance / BENCH_BLOCKS;
+}
+
+static struct Extent locality_files[LOCALITY_DIRS][LOCALITY_FILES]
+                                   [LOCALITY_MAX_EXTENTS];
+static int locality_extents[LOCALITY_DIRS][LOCALITY_FILES];
+static int locality_goals = 0;
+static int locality_round = 0;
+
+/* Worker w creates file locality_round in every LOCALITY_WORKERS-th
+ * directory. Which worker writes to a directory changes every round.
+ */
+static void *locality_worker(void *arg) {
+  int w = (int)(long)arg;
+  int f = locality_round;
+  unsigned seed = f * LOCALITY_WORKERS + w + 1;
+
+  for (int d = (w + f) % LOCALITY_WORKERS; d < LOCALITY_DIRS;
+       d += LOCALITY_WORKERS) {
+    uint64_t goal = NO_GOAL;
+    if (locality_goals && f > 0) {
+      struct Extent *last =
+          &locality_files[d][f - 1][locality_extents[d][f - 1] - 1];
+      goal = (uint64_t)last->blockno + last->extent;
+    }
+    locality_extents[d][f] =
+        allocate_extents_near(goal, 1 + rand_r(&seed) % 16,
+                              locality_files[d][f], LOCALITY_MAX_EXTENTS);
+  }
+  return NULL;
+}
+
+/* Creates LOCALITY_FILES files of 1 to 16 blocks in each of
+ * LOCALITY_DIRS directories, one file per directory and round, from a
+ * pool of worker threads that start their searches in different
+ * allocation groups. With goals, every file is placed after the last
+ * block of the previous file in its directory, like create_file()
+ * does. Prints the modelled time to read every directory from start
+ * to end.
+ */
+static int bench_locality(int use_goals) {
+  if (format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) != 0)
+    return -1;
+
+  locality_goals = use_goals;
+  for (locality_round = 0; locality_round < LOCALITY_FILES;
+       locality_round++) {
+    pthread_t threads[LOCALITY_WORKERS];
+    for (long w = 0; w < LOCALITY_WORKERS; w++)
+      pthread_create(&threads[w], NULL, locality_worker, (void *)w);
+    for (int w = 0; w < LOCALITY_WORKERS; w++)
+      pthread_join(threads[w], NULL);
+  }
+
+  uint64_t seeks = 0;
+  double ms = 0;
+  for (int d = 0; d < LOCALITY_DIRS; d++) {
+    uint64_t head = locality_files[d][0][0].blockno;
+    for (int f = 0; f < LOCALITY_FILES; f++) {
+      if (locality_extents[d][f] < 0) {
+        fprintf(stderr, "Failed to allocate file %d of directory %d\n", f, d);
+        return -1;
+      }
+      for (int e = 0; e < locality_extents[d][f]; e++) {
+        struct Extent *x = &locality_files[d][f][e];
+        seeks += head != x->blockno;
+        ms += seek_ms(head, x->blockno);
+        head = x->blockno + x->extent;
+      }
+    }
+  }
+
+  printf("%8s %10s %12s\n", "goals", "seeks", "scan ms");
+  printf("%8s %10" PRIu64 " %12.1f\n", use_goals ? "yes" : "no", seeks, ms);
+  return 0;
+}
+
+#define CHURN_OPS 2000000
+#define CHURN_MAX_LIVE (BENCH_BLOCKS / 4)
+
+/* Allocates and frees objects of 1 to 64 blocks in random order with
+ * the disk kept about 85% full, like create_and_delete on a larger
+ * scale. The lengths are powers of two if pow2 is set. Returns the
+ * time per operation in ns, or -1 if the disk cannot be formatted.
+ */
+static double churn(enum bat_backend backend, int pow2) {
+  static struct Extent live[CHURN_MAX_LIVE];
+  uint64_t target = BENCH_BLOCKS * 85 / 100;
+  uint64_t used = 0;
+  int num_live = 0;
+  unsigned seed = 1;
+
+  if (format_disk_with_backend(BENCH_BLOCKS, BLOCKSIZE, backend) != 0)
+    return -1;
+
+  double start = now();
+  for (int i = 0; i < CHURN_OPS; i++) {
+    int r = rand_r(&seed);
+    if (used < target && num_live < CHURN_MAX_LIVE) {
+      int len = pow2 ? 1 << (r % 7) : 1 + r % 64;
+      int block = allocate_block(len);
+      if (block != -1) {
+        live[num_live++] = (struct Extent){.blockno = block, .extent = len};
+        used += len;
+      }
+    } else {
+      int k = r % num_live;
+      free_extent(live[k].blockno, live[k].extent);
+      used -= live[k].extent;
+      live[k] = live[--num_live];
+    }
+  }
+  return (now() - start) * 1e9 / CHURN_OPS;
+}
+
+static void print_churn(double ns) {
+  struct disk_stats stats;
+  disk_stats(&stats);
+  printf("%8s %10.1f %10" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+         stats.policy, ns, stats.failed_allocations, stats.free_extents,
+         stats.largest_free_extent);
+}
+
+/* Runs churn() with objects of 2^k blocks and prints the time per
+ * operation, the allocations that failed and the free runs at the end.
+ */
+static int bench_churn(enum bat_backend backend) {
+  double ns = churn(backend, 1);
+  if (ns < 0)
+    return -1;
+
+  printf("%8s %10s %10s %12s %12s\n", "policy", "ns/op", "failures",
+         "free runs", "largest run");
+  print_churn(ns);
+  return 0;
+}
+
+/* Runs churn() with objects of any length once for every built-in
+ * allocation policy.
+ */
+static int bench_policies() {
+  static const char *names[] = {"first", "next", "best", "worst"};
+
+  printf("%8s %10s %10s %12s %12s\n", "policy", "ns/op", "failures",
+         "free runs", "largest run");
+  for (int i = 0; i < 4; i++) {
+    set_alloc_policy(names[i]);
+    double ns = churn(BAT_BACKEND_BITMAP, 0);
+    if (ns < 0)
+      return -1;
+    print_churn(ns);
+  }
+  set_alloc_policy("first");
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr,
+            "Usage: %s BAT TEST\n"
+            "       where\n"
+            "       BAT is the name of the block allocation table\n"
+            "       TEST is the benchmark to run:\n"
+            "         threads - allocate and free from 1 to %d threads\n"
+            "         threads-lock-free - the same with BAT_LOCK_FREE\n"
+            "         search - compare the free run search kernels\n"
+            "         fill - allocation time on a disk that fills up\n"
+            "         fill-lock-free - the same with BAT_LOCK_FREE\n"
+            "         locality - directory scan cost without goals\n"
+            "         locality-goals - the same with allocation goals\n"
+            "         churn - allocate and free objects on a full disk\n"
+            "         churn-buddy - the same with BAT_BACKEND_BUDDY\n"
+            "         policies - churn with each allocation policy\n",
+            argv[0], MAX_THREADS);
+    exit(-1);
+  }
+
+  char *bat_name = argv[1];
+  char *test = argv[2];
+  int retval;
+
+  if (strcmp(test, "threads") == 0) {
+    set_block_allocation_table_name(bat_name);
+    retval = bench_threads();
+  } else if (strcmp(test, "threads-lock-free") == 0) {
+    set_block_allocation_table_name_with_flags(bat_name, BAT_LOCK_FREE);
+    retval = bench_threads();
+  } else if (strcmp(test, "fill") == 0) {
+    set_block_allocation_table_name(bat_name);
+    retval = bench_fill();
+  } else if (strcmp(test, "fill-lock-free") == 0) {
+    set_block_allocation_table_name_with_flags(bat_name, BAT_LOCK_FREE);
+    retval = bench_fill();
+  } else if (strcmp(test, "locality") == 0) {
+    set_block_allocation_table_name(bat_name);
+    retval = bench_locality(0);
+  } else if (strcmp(test, "locality-goals") == 0) {
+    set_block_allocation_table_name(bat_name);
+    retval = bench_locality(1);
+  } else if (strcmp(test, "churn") == 0) {
+    set_block_allocation_table_name(bat_name);
+    retval = bench_churn(BAT_BACKEND_BITMAP);
+  } else if (strcmp(test, "churn-buddy") == 0) {
+    set_block_allocation_table_name(bat_name);
+    retval = bench_churn(BAT_BACKEND_BUDDY);
+  } else if (strcmp(test, "policies") == 0) {
+    set_block_allocation_table_name(bat_name);
+    retval = bench_policies();
+  } else if (strcmp(test, "search") == 0) {
+    retval = bench_search();
+  } else {
+    fprintf(stderr, "Unknown test %s\n", test);
+    retval = -1;
+  }
+
+  return retval == 0 ? 0 : 1;
+}
@@ -0,0 +1,962 @@
+#include "block_allocation.h"
+#include "disk_data.h"
+#include "inode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BLOCKS (1024 * 1024)
+#define FILES_PER_DIR 100
+#define AGE_FILES 40000
+#define BENCH_FILES 20000
+#define DEFRAG_FILES 8000
+#define DEFRAG_STEP_BLOCKS 4096
+#define IO_FILES 4000
+#define SMALL_FILES 20000
+#define SMALL_BATCH 64
+#define CACHE_FILES 20000
+#define CACHE_READS 200000
+#define STREAM_BLOCKS (64 * 1024)
+#define STREAM_CHUNK (128 * 1024)
+#define WRITE_FILES 1000
+#define WRITE_COUNT 200000
+#define WRITE_SIZE 1024
+#define WRITE_BACK_LIMIT (32 * 1024 * 1024)
+#define SPARSE_FILES 1000
+#define SPARSE_SIZE (2 * 1024 * 1024)
+#define SPARSE_WRITES 8
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Creates num_files files of 1 to max_blocks blocks below root, in
+ * directories of FILES_PER_DIR files, and stores them in files.
+ * Returns 0 on success and -1 if a file cannot be created.
+ */
+static int create_files(struct inode *root, const char *prefix, int num_files,
+                        int max_blocks, unsigned *seed,
+                        struct inode **files) {
+  struct inode *dir = NULL;
+  char name[32];
+
+  for (int i = 0; i < num_files; i++) {
+    if (i % FILES_PER_DIR == 0) {
+      snprintf(name, sizeof(name), "%s%d", prefix, i / FILES_PER_DIR);
+      if ((dir = create_dir(root, name)) == NULL)
+        return -1;
+    }
+    snprintf(name, sizeof(name), "%d", i);
+    int size = 1 + rand_r(seed) % (max_blocks * BLOCKSIZE);
+    if ((files[i] = create_file(dir, name, 0, size)) == NULL)
+      return -1;
+  }
+  return 0;
+}
+
+/* Ages the disk by filling most of it with small files and deleting
+ * every second one, so that the free space is spread over many holes.
+ */
+static int age_disk(struct inode *root, unsigned *seed) {
+  struct inode **files = malloc(AGE_FILES * sizeof(struct inode *));
+
+  if (files == NULL || create_files(root, "age", AGE_FILES, 32, seed, files)) {
+    free(files);
+    return -1;
+  }
+
+  for (int i = 0; i < AGE_FILES; i += 2) {
+    char name[32];
+    snprintf(name, sizeof(name), "age%d", i / FILES_PER_DIR);
+    delete_file(find_inode_by_name(root, name), files[i]);
+  }
+  free(files);
+  return 0;
+}
+
+/* Creates BENCH_FILES files on an aged disk, with or without delayed
+ * allocation, and prints the time it took, the number of extents per
+ * file and how often a file does not start right after the one that
+ * was created before it.
+ */
+static int bench(int delayed) {
+  struct inode **files = malloc(BENCH_FILES * sizeof(struct inode *));
+  unsigned seed = 1;
+
+  if (files == NULL || format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE)) {
+    free(files);
+    return -1;
+  }
+
+  struct inode *root = create_dir(NULL, "/");
+  if (root == NULL || age_disk(root, &seed) != 0) {
+    fprintf(stderr, "Failed to age the disk\n");
+    free(files);
+    return -1;
+  }
+
+  set_delayed_allocation(delayed);
+  double start = now();
+  int error = create_files(root, "new", BENCH_FILES, 16, &seed, files);
+  double created = now();
+  if (!error)
+    error = flush_files();
+  double flushed = now();
+  set_delayed_allocation(0);
+
+  if (error) {
+    fprintf(stderr, "Failed to create the files\n");
+    fs_shutdown(root);
+    free(files);
+    return -1;
+  }
+
+  uint64_t extents = 0;
+  uint64_t gaps = 0;
+  uint64_t prev_end = 0;
+  for (int i = 0; i < BENCH_FILES; i++) {
+    uint32_t *entries = (uint32_t *)files[i]->entries;
+    extents += files[i]->num_entries;
+    if (i > 0 && entries[0] != prev_end)
+      gaps++;
+    uint32_t last = files[i]->num_entries - 1;
+    prev_end = entries[2 * last] + entries[2 * last + 1];
+  }
+
+  printf("%10s %10s %10s %12s %14s %8s\n", "mode", "create ms", "flush ms",
+         "files/s", "extents/file", "gaps");
+  printf("%10s %10.1f %10.1f %12.0f %14.3f %8lu\n",
+         delayed ? "delayed" : "immediate", (created - start) * 1000,
+         (flushed - created) * 1000, BENCH_FILES / (flushed - start),
+         (double)extents / BENCH_FILES, (unsigned long)gaps);
+
+  fs_shutdown(root);
+  free(files);
+  return 0;
+}
+
+/* Fills the disk with files of 1 to 32 blocks and deletes every
+ * second one, so that the free space is only short holes. Stores the
+ * files that are left in *files and their number in *num_files.
+ * Returns 0 on success and -1 on failure.
+ */
+static int fill_and_punch(struct inode *root, unsigned *seed,
+                          struct inode ***files, int *num_files) {
+  int max_files = BENCH_BLOCKS / 16 * 2;
+  struct inode **all = malloc(max_files * sizeof(struct inode *));
+  struct inode *dir = NULL;
+  int count = 0;
+  char name[32];
+
+  if (all == NULL)
+    return -1;
+  while (count < max_files) {
+    if (count % FILES_PER_DIR == 0) {
+      snprintf(name, sizeof(name), "fill%d", count / FILES_PER_DIR);
+      if ((dir = create_dir(root, name)) == NULL)
+        break;
+    }
+    snprintf(name, sizeof(name), "%d", count);
+    int size = 1 + rand_r(seed) % (32 * BLOCKSIZE);
+    if ((all[count] = create_file(dir, name, 0, size)) == NULL)
+      break;
+    count++;
+  }
+
+  *num_files = 0;
+  for (int i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "fill%d", i / FILES_PER_DIR);
+    if (i % 2 == 0)
+      delete_file(find_inode_by_name(root, name), all[i]);
+    else
+      all[(*num_files)++] = all[i];
+  }
+  *files = all;
+  return 0;
+}
+
+/* Deletes the first half of the files that fill_and_punch() left.
+ * They were created in order, so this frees the first half of the
+ * disk apart from the files that were created after them.
+ */
+static void delete_first_half(struct inode *root, struct inode **files,
+                              int num_files) {
+  char name[32];
+
+  for (int i = 0; i < num_files / 2; i++) {
+    snprintf(name, sizeof(name), "fill%d", (2 * i + 1) / FILES_PER_DIR);
+    delete_file(find_inode_by_name(root, name), files[i]);
+  }
+}
+
+/* Counts the entries of the files below node. */
+static uint64_t count_entries(struct inode *node, uint64_t *num_files) {
+  if (!node->is_directory) {
+    (*num_files)++;
+    return node->num_entries;
+  }
+
+  uint64_t entries = 0;
+  for (uint32_t i = 0; i < node->num_entries; i++)
+    entries += count_entries((struct inode *)node->entries[i], num_files);
+  return entries;
+}
+
+/* Fragments DEFRAG_FILES files of 16 to 64 blocks over the holes of a
+ * full disk, deletes the short files around the first half of them to
+ * make room, and defragments the disk DEFRAG_STEP_BLOCKS blocks at a
+ * time. Prints the entries per file before and after, the files that
+ * were moved and skipped, and the total and longest time of a step.
+ */
+static int bench_defrag() {
+  struct inode **files = NULL;
+  struct inode **new_files = malloc(DEFRAG_FILES * sizeof(struct inode *));
+  unsigned seed = 1;
+  int num_files;
+
+  if (new_files == NULL || format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE)) {
+    free(new_files);
+    return -1;
+  }
+
+  struct inode *root = create_dir(NULL, "/");
+  if (root == NULL || fill_and_punch(root, &seed, &files, &num_files) != 0 ||
+      create_files(root, "new", DEFRAG_FILES, 64, &seed, new_files) != 0) {
+    fprintf(stderr, "Failed to fragment the disk\n");
+    free(files);
+    free(new_files);
+    return -1;
+  }
+
+  delete_first_half(root, files, num_files);
+  free(files);
+  free(new_files);
+
+  uint64_t num_before = 0;
+  uint64_t before = count_entries(root, &num_before);
+
+  int steps = 0;
+  double longest = 0;
+  double start = now();
+  int result = defrag_start(root) < 0 ? -1 : 1;
+  while (result == 1) {
+    double step_start = now();
+    result = defrag_step(DEFRAG_STEP_BLOCKS);
+    double step = now() - step_start;
+    if (step > longest)
+      longest = step;
+    steps++;
+  }
+  double elapsed = now() - start;
+
+  if (result < 0) {
+    fprintf(stderr, "Failed to defragment the disk\n");
+    fs_shutdown(root);
+    return -1;
+  }
+
+  struct defrag_progress progress;
+  defrag_progress(&progress);
+  uint64_t num_after = 0;
+  uint64_t after = count_entries(root, &num_after);
+
+  printf("%14s %14s %8s %8s %8s %10s %12s\n", "entries before",
+         "entries after", "moved", "skipped", "steps", "total ms",
+         "max step ms");
+  printf("%14.3f %14.3f %8u %8u %8d %10.1f %12.3f\n",
+         (double)before / num_before, (double)after / num_after,
+         progress.files_moved, progress.files_skipped, steps, elapsed * 1000,
+         longest * 1000);
+
+  fs_shutdown(root);
+  return 0;
+}
+
+/* Writes (write != 0) every byte of file i with i, or reads the files
+ * back with one call per file and checks them. Returns the seconds it
+ * took, or -1 on failure.
+ */
+static double file_io(struct inode **files, int num_files, char *buffer,
+                      char *expected, int write) {
+  double start = now();
+
+  for (int i = 0; i < num_files; i++) {
+    uint32_t size = files[i]->filesize;
+    memset(expected, i & 0xff, size);
+    ssize_t n = write ? write_file(files[i], 0, expected, size)
+                      : read_file(files[i], 0, buffer, size);
+    if (n != size || (!write && memcmp(buffer, expected, size) != 0))
+      return -1;
+  }
+  return now() - start;
+}
+
+/* Writes and reads IO_FILES files of up to 64 blocks that are spread
+ * over the holes of an aged disk, then defragments them and reads
+ * them again. Prints the throughput and the extents per file, which is
+ * the number of pread() or pwrite() calls per file.
+ */
+static int bench_io(const char *data_name) {
+  struct inode **files = malloc(IO_FILES * sizeof(struct inode *));
+  char *buffer = malloc(64 * BLOCKSIZE);
+  char *expected = malloc(64 * BLOCKSIZE);
+  unsigned seed = 1;
+
+  if (files == NULL || buffer == NULL || expected == NULL ||
+      format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) ||
+      open_disk_data(data_name)) {
+    free(files);
+    free(buffer);
+    free(expected);
+    return -1;
+  }
+
+  struct inode *root = create_dir(NULL, "/");
+  struct inode **fill = NULL;
+  int num_fill;
+  if (root == NULL || fill_and_punch(root, &seed, &fill, &num_fill) != 0 ||
+      create_files(root, "io", IO_FILES, 64, &seed, files) != 0) {
+    fprintf(stderr, "Failed to create the files\n");
+    free(fill);
+    free(files);
+    free(buffer);
+    free(expected);
+    return -1;
+  }
+
+  uint64_t bytes = 0;
+  for (int i = 0; i < IO_FILES; i++)
+    bytes += files[i]->filesize;
+
+  printf("%8s %10s %10s %14s\n", "pass", "ms", "MB/s", "extents/file");
+  const char *passes[] = {"write", "read", "defrag", "read"};
+  for (int pass = 0; pass < 4; pass++) {
+    double seconds;
+    if (pass == 2) {
+      /* Make room and move the files. */
+      delete_first_half(root, fill, num_fill);
+      double start = now();
+      int result = defrag_start(root) < 0 ? -1 : 1;
+      while (result == 1)
+        result = defrag_step(DEFRAG_STEP_BLOCKS);
+      seconds = (result == 0) ? now() - start : -1;
+    } else {
+      seconds = file_io(files, IO_FILES, buffer, expected, pass == 0);
+    }
+    if (seconds < 0) {
+      fprintf(stderr, "The %s pass failed\n", passes[pass]);
+      fs_shutdown(root);
+      close_disk_data();
+      free(fill);
+      free(files);
+      free(buffer);
+      free(expected);
+      return -1;
+    }
+
+    uint64_t extents = 0;
+    for (int i = 0; i < IO_FILES; i++)
+      extents += files[i]->num_entries;
+    printf("%8s %10.1f %10.1f %14.3f\n", passes[pass], seconds * 1000,
+           bytes / seconds / 1e6, (double)extents / IO_FILES);
+  }
+
+  fs_shutdown(root);
+  close_disk_data();
+  free(fill);
+  free(files);
+  free(buffer);
+  free(expected);
+  return 0;
+}
+
+/* Reads files[first], ..., files[first+n-1] with read_files() if batch
+ * is set and one read_file() each otherwise, and checks them against
+ * the byte the write pass gave them. Returns 0 if they match.
+ */
+static int read_small_files(struct inode **files, int first, int n,
+                            char **bufs, int batch) {
+  if (batch) {
+    if (read_files(files + first, n, (void **)bufs) != 0)
+      return -1;
+  } else {
+    for (int i = 0; i < n; i++) {
+      uint32_t size = files[first + i]->filesize;
+      if (read_file(files[first + i], 0, bufs[i], size) != size)
+        return -1;
+    }
+  }
+
+  for (int i = 0; i < n; i++)
+    for (uint32_t j = 0; j < files[first + i]->filesize; j += BLOCKSIZE)
+      if (bufs[i][j] != (char)((first + i) & 0xff))
+        return -1;
+  return 0;
+}
+
+/* Writes SMALL_FILES files of up to 4 blocks that are spread over the
+ * holes of an aged disk, and reads them back SMALL_BATCH files at a
+ * time, one read_file() per file and with read_files(), with the sync
+ * and the io_uring engine.
+ */
+static int bench_small(const char *data_name) {
+  struct inode **files = malloc(SMALL_FILES * sizeof(struct inode *));
+  char *data = malloc((size_t)SMALL_BATCH * 4 * BLOCKSIZE);
+  char *bufs[SMALL_BATCH];
+  unsigned seed = 1;
+  int result = 0;
+
+  if (files == NULL || data == NULL ||
+      format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) ||
+      open_disk_data(data_name)) {
+    free(files);
+    free(data);
+    return -1;
+  }
+  for (int i = 0; i < SMALL_BATCH; i++)
+    bufs[i] = data + (size_t)i * 4 * BLOCKSIZE;
+
+  struct inode *root = create_dir(NULL, "/");
+  struct inode **fill = NULL;
+  int num_fill;
+  if (root == NULL || fill_and_punch(root, &seed, &fill, &num_fill) != 0 ||
+      create_files(root, "small", SMALL_FILES, 4, &seed, files) != 0) {
+    fprintf(stderr, "Failed to create the files\n");
+    free(fill);
+    free(files);
+    free(data);
+    return -1;
+  }
+
+  uint64_t bytes = 0;
+  uint64_t extents = 0;
+  for (int i = 0; i < SMALL_FILES && result == 0; i++) {
+    memset(data, i & 0xff, files[i]->filesize);
+    if (write_file(files[i], 0, data, files[i]->filesize) !=
+        files[i]->filesize)
+      result = -1;
+    bytes += files[i]->filesize;
+    extents += files[i]->num_entries;
+  }
+
+  printf("%10s %12s %10s %10s   (%.3f extents/file)\n", "engine", "call",
+         "ms", "MB/s", (double)extents / SMALL_FILES);
+  const enum disk_io_engine engines[] = {DISK_IO_SYNC, DISK_IO_URING};
+  for (int e = 0; e < 2 && result == 0; e++) {
+    if (disk_io_select(engines[e]) != 0) {
+      printf("%10s %12s\n", e ? "io_uring" : "sync", "unsupported");
+      continue;
+    }
+    for (int batch = 0; batch < 2 && result == 0; batch++) {
+      double start = now();
+      for (int i = 0; i < SMALL_FILES && result == 0; i += SMALL_BATCH) {
+        int n = (SMALL_FILES - i < SMALL_BATCH) ? SMALL_FILES - i : SMALL_BATCH;
+        result = read_small_files(files, i, n, bufs, batch);
+      }
+      double seconds = now() - start;
+      printf("%10s %12s %10.1f %10.1f\n", disk_io_engine_name(),
+             batch ? "read_files" : "read_file", seconds * 1000,
+             bytes / seconds / 1e6);
+    }
+  }
+  if (result != 0)
+    fprintf(stderr, "Reading the files failed\n");
+
+  disk_io_select(DISK_IO_AUTO);
+  fs_shutdown(root);
+  close_disk_data();
+  free(fill);
+  free(files);
+  free(data);
+  return result;
+}
+
+/* Returns a file number below num_files from the Zipf distribution
+ * whose cumulative weights are in cdf, so that file 0 is the most
+ * popular one.
+ */
+static int zipf_next(const double *cdf, int num_files, unsigned *seed) {
+  double u = (double)rand_r(seed) / ((double)RAND_MAX + 1) * cdf[num_files - 1];
+  int lo = 0;
+  int hi = num_files - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cdf[mid] <= u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Reads num_reads Zipfian picks of files and checks them. Returns the
+ * share of the block reads that hit the cache, or -1 on failure.
+ */
+static double zipf_reads(struct inode **files, const double *cdf,
+                         int num_reads, char *buffer, unsigned *seed) {
+  struct block_cache_stats before;
+  struct block_cache_stats after;
+
+  disk_cache_stats(&before);
+  for (int r = 0; r < num_reads; r++) {
+    int i = zipf_next(cdf, CACHE_FILES, seed);
+    uint32_t size = files[i]->filesize;
+    if (read_file(files[i], 0, buffer, size) != size || buffer[0] != (char)i)
+      return -1;
+  }
+  disk_cache_stats(&after);
+
+  uint64_t hits = after.hits - before.hits;
+  uint64_t misses = after.misses - before.misses;
+  return (double)hits / (hits + misses);
+}
+
+/* Reads every file once, in order, like a backup or a debug_fs()
+ * traversal that looks at the contents. Returns 0 on success.
+ */
+static int scan_reads(struct inode **files, char *buffer) {
+  for (int i = 0; i < CACHE_FILES; i++) {
+    uint32_t size = files[i]->filesize;
+    if (read_file(files[i], 0, buffer, size) != size || buffer[0] != (char)i)
+      return -1;
+  }
+  return 0;
+}
+
+/* Writes CACHE_FILES files of up to 4 blocks and replays CACHE_READS
+ * Zipfian reads of them through a block cache that holds a tenth of
+ * their blocks, with LRU and with ARC. Between two rounds of reads
+ * every file is read once, and the hit ratio of the second round shows
+ * how much of the hot set the scan evicted.
+ */
+static int bench_cache(const char *data_name) {
+  struct inode **files = malloc(CACHE_FILES * sizeof(struct inode *));
+  double *cdf = malloc(CACHE_FILES * sizeof(double));
+  char *buffer = malloc(4 * BLOCKSIZE);
+  unsigned seed = 1;
+  int result = 0;
+
+  if (files == NULL || cdf == NULL || buffer == NULL ||
+      format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) ||
+      open_disk_data(data_name)) {
+    free(files);
+    free(cdf);
+    free(buffer);
+    return -1;
+  }
+
+  struct inode *root = create_dir(NULL, "/");
+  if (root == NULL ||
+      create_files(root, "cache", CACHE_FILES, 4, &seed, files) != 0) {
+    fprintf(stderr, "Failed to create the files\n");
+    free(files);
+    free(cdf);
+    free(buffer);
+    return -1;
+  }
+
+  uint64_t blocks = 0;
+  double sum = 0;
+  for (int i = 0; i < CACHE_FILES && result == 0; i++) {
+    uint32_t size = files[i]->filesize;
+    memset(buffer, i & 0xff, size);
+    if (write_file(files[i], 0, buffer, size) != size)
+      result = -1;
+    blocks += (size + BLOCKSIZE - 1) / BLOCKSIZE;
+    sum += 1.0 / (i + 1);
+    cdf[i] = sum;
+  }
+
+  printf("%8s %10s %10s %10s %10s %12s\n", "policy", "warm hit", "hit",
+         "after scan", "ms", "evictions");
+  const enum block_cache_policy policies[] = {BLOCK_CACHE_LRU,
+                                              BLOCK_CACHE_ARC};
+  for (int p = 0; p < 2 && result == 0; p++) {
+    if (disk_cache_enable(blocks / 10 * BLOCKSIZE, policies[p]) != 0) {
+      result = -1;
+      break;
+    }
+    unsigned read_seed = 2;
+    double start = now();
+    double warm = zipf_reads(files, cdf, CACHE_READS, buffer, &read_seed);
+    double hit = zipf_reads(files, cdf, CACHE_READS, buffer, &read_seed);
+    int scanned = scan_reads(files, buffer);
+    double after = zipf_reads(files, cdf, CACHE_READS / 100, buffer,
+                              &read_seed);
+    double seconds = now() - start;
+
+    struct block_cache_stats stats;
+    disk_cache_stats(&stats);
+    if (warm < 0 || hit < 0 || scanned != 0 || after < 0) {
+      result = -1;
+      break;
+    }
+    printf("%8s %10.3f %10.3f %10.3f %10.1f %12lu\n", p ? "arc" : "lru",
+           warm, hit, after, seconds * 1000, (unsigned long)stats.evictions);
+  }
+  if (result != 0)
+    fprintf(stderr, "Reading the files failed\n");
+
+  disk_cache_disable();
+  fs_shutdown(root);
+  close_disk_data();
+  free(files);
+  free(cdf);
+  free(buffer);
+  return result;
+}
+
+/* Reads file from the device in STREAM_CHUNK pieces, with readahead
+ * (reader != NULL) or with read_file(), and checks that every block
+ * starts with its number. Returns the seconds it took, or -1 on
+ * failure.
+ */
+static double stream_read(struct inode *file, struct file_reader *reader,
+                          char *buffer) {
+  if (disk_drop_page_cache() != 0)
+    return -1;
+
+  double start = now();
+  for (uint64_t off = 0; off < file->filesize; off += STREAM_CHUNK) {
+    ssize_t n = reader ? file_reader_read(reader, off, buffer, STREAM_CHUNK)
+                       : read_file(file, off, buffer, STREAM_CHUNK);
+    if (n <= 0)
+      return -1;
+    for (ssize_t i = 0; i < n; i += BLOCKSIZE)
+      if (*(uint64_t *)(buffer + i) != (off + i) / BLOCKSIZE)
+        return -1;
+  }
+  return now() - start;
+}
+
+/* Writes a file of STREAM_BLOCKS blocks over the holes of an aged disk
+ * and reads it sequentially from the device, without and with
+ * readahead.
+ */
+static int bench_stream(const char *data_name) {
+  char *buffer = malloc(STREAM_CHUNK);
+  unsigned seed = 1;
+
+  if (buffer == NULL || format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) ||
+      open_disk_data(data_name)) {
+    free(buffer);
+    return -1;
+  }
+
+  struct inode *root = create_dir(NULL, "/");
+  struct inode **fill = NULL;
+  struct inode *file = NULL;
+  int num_fill;
+  if (root == NULL || fill_and_punch(root, &seed, &fill, &num_fill) != 0 ||
+      (file = create_file(root, "stream", 0, STREAM_BLOCKS * BLOCKSIZE)) ==
+          NULL) {
+    fprintf(stderr, "Failed to create the file\n");
+    free(fill);
+    free(buffer);
+    return -1;
+  }
+
+  int result = 0;
+  for (uint64_t off = 0; off < file->filesize && result == 0;
+       off += STREAM_CHUNK) {
+    for (uint64_t i = 0; i < STREAM_CHUNK; i += BLOCKSIZE)
+      *(uint64_t *)(buffer + i) = (off + i) / BLOCKSIZE;
+    if (write_file(file, off, buffer, STREAM_CHUNK) != STREAM_CHUNK)
+      result = -1;
+  }
+
+  printf("%10s %10s %10s   (%u extents)\n", "readahead", "ms", "MB/s",
+         file->num_entries);
+  struct file_reader reader;
+  for (int ra = 0; ra < 2 && result == 0; ra++) {
+    file_reader_open(&reader, file);
+    double seconds = stream_read(file, ra ? &reader : NULL, buffer);
+    if (seconds < 0) {
+      result = -1;
+      break;
+    }
+    printf("%10s %10.1f %10.1f\n", ra ? "extents" : "none", seconds * 1000,
+           file->filesize / seconds / 1e6);
+  }
+  if (result != 0)
+    fprintf(stderr, "Reading the file failed\n");
+
+  fs_shutdown(root);
+  close_disk_data();
+  free(fill);
+  free(buffer);
+  return result;
+}
+
+/* Writes WRITE_COUNT pieces of WRITE_SIZE bytes at random places of
+ * random files, syncs them with fs_sync(), and returns the seconds it
+ * took, or -1 on failure. The same seed gives the same writes.
+ */
+static double random_writes(struct inode **files, unsigned seed) {
+  char data[WRITE_SIZE];
+  double start = now();
+
+  for (int w = 0; w < WRITE_COUNT; w++) {
+    struct inode *file = files[rand_r(&seed) % WRITE_FILES];
+    uint64_t off = rand_r(&seed) % file->filesize;
+    memset(data, w & 0xff, WRITE_SIZE);
+    if (write_file(file, off, data, WRITE_SIZE) < 0)
+      return -1;
+  }
+  if (fs_sync() != 0)
+    return -1;
+  return now() - start;
+}
+
+/* Returns a checksum of the contents of the files, or 0 if they cannot
+ * be read.
+ */
+static uint64_t checksum_files(struct inode **files, char *buffer) {
+  uint64_t sum = 1469598103934665603ull;
+
+  for (int i = 0; i < WRITE_FILES; i++) {
+    uint32_t size = files[i]->filesize;
+    if (read_file(files[i], 0, buffer, size) != size)
+      return 0;
+    for (uint32_t j = 0; j < size; j++)
+      sum = (sum ^ (unsigned char)buffer[j]) * 1099511628211ull;
+  }
+  return sum;
+}
+
+/* Writes WRITE_FILES files of up to 16 blocks, then does the same
+ * random small writes to them with direct writes and with write-back,
+ * each time followed by fs_sync(), and checks that both leave the
+ * files the same. Prints the time and the number of writes that
+ * reached the data file.
+ */
+static int bench_write_back(const char *data_name) {
+  struct inode **files = malloc(WRITE_FILES * sizeof(struct inode *));
+  char *buffer = malloc(16 * BLOCKSIZE);
+  unsigned seed = 1;
+  int result = 0;
+
+  if (files == NULL || buffer == NULL ||
+      format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) ||
+      open_disk_data(data_name)) {
+    free(files);
+    free(buffer);
+    return -1;
+  }
+
+  struct inode *root = create_dir(NULL, "/");
+  if (root == NULL ||
+      create_files(root, "write", WRITE_FILES, 16, &seed, files) != 0) {
+    fprintf(stderr, "Failed to create the files\n");
+    free(files);
+    free(buffer);
+    return -1;
+  }
+
+  printf("%10s %10s %12s %12s %18s\n", "mode", "ms", "writes/s",
+         "disk writes", "checksum");
+  for (int wb = 0; wb < 2 && result == 0; wb++) {
+    for (int i = 0; i < WRITE_FILES && result == 0; i++) {
+      memset(buffer, i & 0xff, files[i]->filesize);
+      if (write_file(files[i], 0, buffer, files[i]->filesize) < 0)
+        result = -1;
+    }
+    if (result != 0 || fs_sync() != 0 ||
+        (wb && disk_write_back_enable(WRITE_BACK_LIMIT) != 0)) {
+      result = -1;
+      break;
+    }
+
+    double seconds = random_writes(files, 2);
+    struct write_back_stats stats;
+    disk_write_back_stats(&stats);
+    if (seconds < 0 || disk_write_back_disable() != 0) {
+      result = -1;
+      break;
+    }
+    uint64_t sum = checksum_files(files, buffer);
+    printf("%10s %10.1f %12.0f %12lu %18lx\n", wb ? "write-back" : "direct",
+           seconds * 1000, WRITE_COUNT / seconds,
+           (unsigned long)(wb ? stats.flush_writes : WRITE_COUNT),
+           (unsigned long)sum);
+  }
+  if (result != 0)
+    fprintf(stderr, "Writing the files failed\n");
+
+  fs_shutdown(root);
+  close_disk_data();
+  free(files);
+  free(buffer);
+  return result;
+}
+
+/* Adds the contents of the files below node to the checksum sum, in
+ * the order of the tree. Returns 0 if a file cannot be read.
+ */
+static uint64_t checksum_tree(struct inode *node, char *buffer, uint64_t sum) {
+  if (node->is_directory) {
+    for (uint32_t i = 0; i < node->num_entries && sum != 0; i++)
+      sum = checksum_tree((struct inode *)node->entries[i], buffer, sum);
+    return sum;
+  }
+
+  if (read_file(node, 0, buffer, node->filesize) != node->filesize)
+    return 0;
+  for (uint32_t j = 0; j < node->filesize; j++)
+    sum = (sum ^ (unsigned char)buffer[j]) * 1099511628211ull;
+  return sum;
+}
+
+/* Creates SPARSE_FILES files of SPARSE_SIZE bytes, sparse or not, and
+ * writes SPARSE_WRITES pieces of a block to random places of each.
+ * Prints the time and the blocks and entries the files use. The
+ * sparse files then get their first half punched, and are saved,
+ * loaded again and compared.
+ */
+static int bench_sparse(const char *bat_name, const char *data_name) {
+  char *buffer = malloc(SPARSE_SIZE);
+  char mft_name[256];
+  int result = 0;
+
+  snprintf(mft_name, sizeof(mft_name), "%s.mft", bat_name);
+  if (buffer == NULL || open_disk_data(data_name)) {
+    free(buffer);
+    return -1;
+  }
+
+  printf("%10s %10s %12s %12s\n", "files", "ms", "blocks used",
+         "entries/file");
+  for (int sparse = 0; sparse < 2 && result == 0; sparse++) {
+    struct inode *root;
+    unsigned seed = 1;
+    if (format_disk_with_geometry(BENCH_BLOCKS, BLOCKSIZE) ||
+        (root = create_dir(NULL, "/")) == NULL) {
+      result = -1;
+      break;
+    }
+
+    double start = now();
+    struct inode *dir = NULL;
+    uint64_t entries = 0;
+    for (int i = 0; i < SPARSE_FILES && result == 0; i++) {
+      char name[32];
+      if (i % FILES_PER_DIR == 0) {
+        snprintf(name, sizeof(name), "sparse%d", i / FILES_PER_DIR);
+        dir = create_dir(root, name);
+      }
+      snprintf(name, sizeof(name), "%d", i);
+      struct inode *file =
+          sparse ? create_sparse_file(dir, name, 0, SPARSE_SIZE)
+                 : create_file(dir, name, 0, SPARSE_SIZE);
+      if (dir == NULL || file == NULL) {
+        result = -1;
+        break;
+      }
+      for (int w = 0; w < SPARSE_WRITES; w++) {
+        memset(buffer, (i + w) & 0xff, BLOCKSIZE);
+        uint64_t off = rand_r(&seed) % (SPARSE_SIZE - BLOCKSIZE);
+        if (write_file(file, off, buffer, BLOCKSIZE) != BLOCKSIZE)
+          result = -1;
+      }
+      entries += file->num_entries;
+    }
+    double seconds = now() - start;
+    if (result != 0) {
+      fs_shutdown(root);
+      break;
+    }
+    printf("%10s %10.1f %12lu %12.3f\n", sparse ? "sparse" : "full",
+           seconds * 1000,
+           (unsigned long)(disk_num_blocks() - disk_free_blocks()),
+           (double)entries / SPARSE_FILES);
+
+    if (sparse) {
+      for (uint32_t d = 0; d < root->num_entries && result == 0; d++) {
+        struct inode *sub = (struct inode *)root->entries[d];
+        for (uint32_t f = 0; f < sub->num_entries && result == 0; f++)
+          result = punch_hole((struct inode *)sub->entries[f], 0,
+                              SPARSE_SIZE / 2);
+      }
+      printf("%10s %10s %12lu\n", "punched", "",
+             (unsigned long)(disk_num_blocks() - disk_free_blocks()));
+
+      uint64_t before = checksum_tree(root, buffer, 1469598103934665603ull);
+      save_inodes(mft_name, root);
+      fs_shutdown(root);
+      root = load_inodes(mft_name);
+      uint64_t after =
+          root ? checksum_tree(root, buffer, 1469598103934665603ull) : 0;
+      if (result != 0 || before == 0 || before != after) {
+        fprintf(stderr, "The files changed on the way through %s\n",
+                mft_name);
+        result = -1;
+      }
+    }
+    if (root != NULL)
+      fs_shutdown(root);
+  }
+
+  close_disk_data();
+  free(buffer);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr,
+            "Usage: %s BAT MODE\n"
+            "       where\n"
+            "       BAT is the name of the block allocation table\n"
+            "       MODE is immediate, delayed, defrag, io, small, cache,\n"
+            "            stream, writeback or sparse\n",
+            argv[0]);
+    exit(-1);
+  }
+
+  char *bat_name = argv[1];
+  char *mode = argv[2];
+  int retval;
+
+  set_block_allocation_table_name(bat_name);
+  if (strcmp(mode, "immediate") == 0) {
+    retval = bench(0);
+  } else if (strcmp(mode, "delayed") == 0) {
+    retval = bench(1);
+  } else if (strcmp(mode, "defrag") == 0) {
+    retval = bench_defrag();
+  } else if (strcmp(mode, "io") == 0) {
+    char data_name[256];
+    snprintf(data_name, sizeof(data_name), "%s.data", bat_name);
+    retval = bench_io(data_name);
+  } else if (strcmp(mode, "small") == 0) {
+    char data_name[256];
+    snprintf(data_name, sizeof(data_name), "%s.data", bat_name);
+    retval = bench_small(data_name);
+  } else if (strcmp(mode, "cache") == 0) {
+    char data_name[256];
+    snprintf(data_name, sizeof(data_name), "%s.data", bat_name);
+    retval = bench_cache(data_name);
+  } else if (strcmp(mode, "stream") == 0) {
+    char data_name[256];
+    snprintf(data_name, sizeof(data_name), "%s.data", bat_name);
+    retval = bench_stream(data_name);
+  } else if (strcmp(mode, "writeback") == 0) {
+    char data_name[256];
+    snprintf(data_name, sizeof(data_name), "%s.data", bat_name);
+    retval = bench_write_back(data_name);
+  } else if (strcmp(mode, "sparse") == 0) {
+    char data_name[256];
+    snprintf(data_name, sizeof(data_name), "%s.data", bat_name);
+    retval = bench_sparse(bat_name, data_name);
+  } else {
+    fprintf(stderr, "Unknown mode %s\n", mode);
+    retval = -1;
+  }
+
+  return retval == 0 ? 0 : 1;
+}
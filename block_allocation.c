@@ -1,24 +1,39 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "block_allocation.h"
+#include "buddy.h"
+#include "extent_index.h"
+#include "run_search.h"
 
 /* Read the block allocation table from file into memory, if such a
- * file exists.
+ * file exists. Tables in the old one-byte-per-block format are
+ * converted to the bitmap while loading.
+ * With BAT_MAPPED, the table is mapped from the file instead.
  */
-static char *read_table();
+static uint64_t *read_table();
 
 /* Write the block allocation from memory into a file, if such a
  * file can be written.
  */
 static int write_table();
 
+/* Flush and remove the mapping of a table opened with BAT_MAPPED. */
+static void unmap_table();
+
 /* Called when the program terminates without error, and writes
- * the block allocation table to its file in that case.
+ * the block allocation table to its file in that case, if it was
+ * changed.
  * The function is not called directly but through atexit().
  */
 void save_and_release_block_allocation_table();
@@ -29,9 +44,1074 @@ void save_and_release_block_allocation_table();
  */
 static char *file_name = NULL;
 
-static char *block_allocation_table = NULL;
+/* The block allocation table is a bitmap with one bit per block.
+ * Block i is bit (i % 64) of word (i / 64), and a set bit means that
+ * the block is in use. The bits after the last block in the final
+ * word are always set, so searches never have to check the end of
+ * the disk separately.
+ */
+static uint64_t *block_allocation_table = NULL;
+
+/* The disk is divided into allocation groups of GROUP_BLOCKS blocks,
+ * the last one may be shorter. Every group has its own lock and its
+ * own index of the runs of free blocks inside it, ordered by start
+ * block and by length, so threads that allocate in different groups
+ * do not wait for each other. GROUP_BLOCKS is a multiple of 64, so
+ * groups never share a word of the table.
+ * free_hint and largest_hint copy the number of free blocks and the
+ * longest free run of the group. They are read without the lock to
+ * skip groups that cannot satisfy a request.
+ * cursor is kept for the allocation policy, see struct alloc_policy.
+ */
+#define GROUP_BLOCKS 32768
+
+struct alloc_group {
+  pthread_mutex_t lock;
+  uint64_t start;
+  uint64_t num_blocks;
+  struct extent_index index;
+  uint64_t free_hint;
+  uint64_t largest_hint;
+  uint64_t cursor;
+};
+
+/* The groups are built from the table before the first allocation or
+ * release after the table is loaded, and updated by every allocation
+ * and release after that, so that allocate_block() does not have to
+ * scan the table.
+ * Loading the table and building the groups is serialised by
+ * table_lock. Formatting, loading and syncing the table must not run
+ * at the same time as allocations in other threads.
+ */
+static struct alloc_group *groups = NULL;
+static uint64_t num_groups = 0;
+static int index_valid = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Every thread starts its searches in its own home group. Threads get
+ * consecutive groups in the order of their first allocation, so a
+ * single-threaded program always searches from group 0.
+ */
+static __thread int64_t home_group = -1;
+static uint64_t next_home_group = 0;
+
+/* The flags given to set_block_allocation_table_name_with_flags(). */
+static int table_flags = 0;
+
+/* With BAT_MAPPED, the table file is mapped at mapping and
+ * block_allocation_table points into it, just after the header.
+ * dirty_pages has one bit per page of the mapping that was changed
+ * since the last sync_disk().
+ */
+static char *mapping = NULL;
+static size_t mapping_size = 0;
+static uint64_t *dirty_pages = NULL;
+static long page_size = 0;
+
+/* With a sync interval, a flusher thread writes the dirty pages of a
+ * mapped table back every sync_interval seconds, so allocations never
+ * wait for msync() and changes reach the file even if no more come.
+ * sync_interval and flusher_stop are protected by flusher_lock, and
+ * flusher_wake tells the thread that one of them changed.
+ */
+static unsigned sync_interval = 0;
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flusher_stop = 0;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake;
+
+/* Set by every change to the table after it was loaded or written, so
+ * that a table that was only read is not written back at exit. This
+ * keeps old format tables in their format unless they are changed.
+ */
+static int table_changed = 0;
+
+#define BITS_PER_WORD 64
+#define WORDS_FOR(blocks) (((blocks) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define ALL_ONES (~(uint64_t)0)
+
+/* The geometry of the simulated disk. It is read from the header of
+ * the table file, or set by format_disk_with_geometry().
+ */
+static uint64_t num_blocks = NUM_BLOCKS;
+static uint32_t block_size = BLOCKSIZE;
+static uint64_t num_words = WORDS_FOR(NUM_BLOCKS);
+
+/* A summary of the table that lets searches skip full regions. Bit
+ * w%64 of free_summary[w/64] is set if word w of the table has a free
+ * block, so every summary word covers a chunk of CHUNK_BLOCKS blocks,
+ * and chunk_free[c] counts the free blocks in chunk c.
+ * Both are built with the allocation groups and updated with every
+ * change to the table. Without locks a summary bit can be set for a
+ * full word for a moment, but it is never clear for a word with free
+ * blocks.
+ */
+#define CHUNK_BLOCKS (BITS_PER_WORD * BITS_PER_WORD)
+
+static uint64_t *free_summary = NULL;
+static uint32_t *chunk_free = NULL;
+static uint64_t num_chunks = 0;
+
+/* The number of free blocks on the disk, kept with the summary, and
+ * the lengths of the free runs in the indexes of all allocation
+ * groups.
+ */
+static uint64_t free_count = 0;
+static struct extent_histogram free_histogram;
+
+/* With BAT_BACKEND_BUDDY the free blocks are kept in a buddy system
+ * under one lock, instead of in the allocation groups. The heads read
+ * from the table file are kept in saved_heads until it is built.
+ */
+static enum bat_backend table_backend = BAT_BACKEND_BITMAP;
+static struct buddy buddy;
+static pthread_mutex_t buddy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct saved_head *saved_heads = NULL;
+static uint64_t num_saved_heads = 0;
+
+/* The number of free blocks that reserve_blocks() has set aside. They
+ * are only taken by allocate_reserved_extents().
+ */
+static uint64_t reserved_count = 0;
+
+/* The counts for struct disk_stats, since the table was loaded. */
+static uint64_t num_allocations = 0;
+static uint64_t num_failed_allocations = 0;
+static uint64_t num_allocated_extents = 0;
+
+/* Every table file starts with this header. Files without the magic
+ * are taken to be in the old format, one byte per block that is
+ * 0 or 1, with a block size of BLOCKSIZE.
+ * backend is the enum bat_backend the disk was formatted with. Buddy
+ * tables are followed by the number of free heads and one struct
+ * saved_head for each of them.
+ */
+#define BAT_MAGIC 0x42544142 /* "BATB" */
+#define BAT_VERSION 1
+
+/* Old format tables are converted in pieces of this many bytes. */
+#define CONVERT_CHUNK 65536
+
+struct bat_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t num_blocks;
+  uint32_t block_size;
+  uint32_t backend;
+};
+
+struct saved_head {
+  uint32_t start;
+  uint32_t order;
+};
+
+/* Reads word w of table. With BAT_LOCK_FREE other threads change
+ * words of the table while we read them, so all reads that can run
+ * concurrently go through here.
+ */
+static uint64_t load_word(const uint64_t *table, uint64_t w) {
+  return __atomic_load_n(&table[w], __ATOMIC_RELAXED);
+}
+
+/* Returns a word with the bits [lo, hi) set, 0 <= lo < hi <= 64. */
+static uint64_t word_mask(unsigned lo, unsigned hi) {
+  uint64_t upper = (hi == BITS_PER_WORD) ? ALL_ONES : (((uint64_t)1 << hi) - 1);
+  return upper & ~(((uint64_t)1 << lo) - 1);
+}
+
+/* Records that the table words [first, last] have changed, so that
+ * sync_disk() writes their pages back to a mapped table file.
+ */
+static void mark_dirty(uint64_t first, uint64_t last) {
+  __atomic_store_n(&table_changed, 1, __ATOMIC_RELAXED);
+  if (dirty_pages == NULL)
+    return;
+
+  uint64_t offset = (char *)block_allocation_table - mapping;
+  uint64_t first_page = (offset + first * sizeof(uint64_t)) / page_size;
+  uint64_t last_page = (offset + last * sizeof(uint64_t)) / page_size;
+
+  for (uint64_t p = first_page; p <= last_page; p++)
+    __atomic_fetch_or(&dirty_pages[p / BITS_PER_WORD],
+                      (uint64_t)1 << (p % BITS_PER_WORD), __ATOMIC_RELAXED);
+}
+
+/* The flusher thread: syncs the mapped table every sync_interval
+ * seconds until flusher_stop is set.
+ */
+static void *flush_periodically(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&flusher_lock);
+  while (!flusher_stop) {
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += sync_interval;
+    if (pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until) !=
+        ETIMEDOUT)
+      continue;
+
+    pthread_mutex_unlock(&flusher_lock);
+    sync_disk();
+    pthread_mutex_lock(&flusher_lock);
+  }
+  pthread_mutex_unlock(&flusher_lock);
+  return NULL;
+}
+
+/* Starts the flusher thread if the table is mapped and there is a sync
+ * interval, and it is not running yet.
+ */
+static void start_flusher() {
+  static int wake_ready = 0;
+
+  if (flusher_running || mapping == NULL || sync_interval == 0)
+    return;
+
+  if (!wake_ready) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&flusher_wake, &attr);
+    pthread_condattr_destroy(&attr);
+    wake_ready = 1;
+  }
+
+  flusher_stop = 0;
+  if (pthread_create(&flusher, NULL, flush_periodically, NULL) != 0) {
+    fprintf(stderr, "Failed to start the flusher thread, changes are "
+                    "only written by sync_disk()\n");
+    return;
+  }
+  flusher_running = 1;
+}
+
+/* Stops the flusher thread, if it runs, and waits for it. */
+static void stop_flusher() {
+  if (!flusher_running)
+    return;
+
+  pthread_mutex_lock(&flusher_lock);
+  flusher_stop = 1;
+  pthread_cond_signal(&flusher_wake);
+  pthread_mutex_unlock(&flusher_lock);
+
+  pthread_join(flusher, NULL);
+  flusher_running = 0;
+}
+
+/* Updates the summary after the blocks in mask of word w were freed
+ * (freed != 0) or taken.
+ */
+static void update_summary(uint64_t w, uint64_t mask, int freed) {
+  uint64_t *summary = &free_summary[w / BITS_PER_WORD];
+  uint64_t bit = (uint64_t)1 << (w % BITS_PER_WORD);
+  uint32_t count = __builtin_popcountll(mask);
+
+  if (freed) {
+    __atomic_add_fetch(&free_count, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&chunk_free[w / BITS_PER_WORD], count,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_or(summary, bit, __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  __atomic_sub_fetch(&free_count, count, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&chunk_free[w / BITS_PER_WORD], count, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&block_allocation_table[w], __ATOMIC_SEQ_CST) != ALL_ONES)
+    return;
+  __atomic_fetch_and(summary, ~bit, __ATOMIC_SEQ_CST);
+
+  /* A block of the word may have been freed before the bit was
+   * cleared, its release then set the bit too early. Look again.
+   */
+  if (__atomic_load_n(&block_allocation_table[w], __ATOMIC_SEQ_CST) != ALL_ONES)
+    __atomic_fetch_or(summary, bit, __ATOMIC_SEQ_CST);
+}
+
+/* Sets or clears the bits for blocks [start, start+len) a word at a
+ * time.
+ */
+static void set_range(uint64_t start, uint64_t len, int used) {
+  if (len > 0)
+    mark_dirty(start / BITS_PER_WORD, (start + len - 1) / BITS_PER_WORD);
+
+  while (len > 0) {
+    uint64_t w = start / BITS_PER_WORD;
+    unsigned lo = start % BITS_PER_WORD;
+    unsigned hi = (len < BITS_PER_WORD - lo) ? lo + len : BITS_PER_WORD;
+    uint64_t mask = word_mask(lo, hi);
+
+    if (used)
+      block_allocation_table[w] |= mask;
+    else
+      block_allocation_table[w] &= ~mask;
+    update_summary(w, mask, !used);
+
+    start += hi - lo;
+    len -= hi - lo;
+  }
+}
+
+/* Returns 1 if all blocks [start, start+len) are in use, checking a
+ * word at a time, and 0 otherwise.
+ */
+static int range_is_used(uint64_t start, uint64_t len) {
+  while (len > 0) {
+    uint64_t w = start / BITS_PER_WORD;
+    unsigned lo = start % BITS_PER_WORD;
+    unsigned hi = (len < BITS_PER_WORD - lo) ? lo + len : BITS_PER_WORD;
+    uint64_t mask = word_mask(lo, hi);
+
+    if ((load_word(block_allocation_table, w) & mask) != mask)
+      return 0;
+
+    start += hi - lo;
+    len -= hi - lo;
+  }
+  return 1;
+}
+
+/* Marks the padding bits after the last block as used. */
+static void set_padding(uint64_t *table) {
+  if (num_blocks % BITS_PER_WORD)
+    table[num_words - 1] |= ~word_mask(0, num_blocks % BITS_PER_WORD);
+}
+
+/* Checks that the geometry is one we can handle.
+ * Returns 0 if it is and -1 if not.
+ */
+static int check_geometry(uint64_t blocks, uint32_t size) {
+  if (blocks == 0 || blocks > MAX_NUM_BLOCKS) {
+    fprintf(stderr, "A disk of %" PRIu64 " blocks is not supported\n", blocks);
+    return -1;
+  }
+  if (size < MIN_BLOCKSIZE || size > MAX_BLOCKSIZE || (size & (size - 1))) {
+    fprintf(stderr, "A block size of %u bytes is not supported\n", size);
+    return -1;
+  }
+  return 0;
+}
+
+static void set_geometry(uint64_t blocks, uint32_t size) {
+  num_blocks = blocks;
+  block_size = size;
+  num_words = WORDS_FOR(blocks);
+}
+
+/* Returns the first block at or after from that is used (used != 0)
+ * or free (used == 0), or num_blocks if there is none.
+ */
+static uint64_t next_block(const uint64_t *table, uint64_t from, int used) {
+  uint64_t flip = used ? 0 : ALL_ONES;
+  uint64_t w = from / BITS_PER_WORD;
+
+  if (w >= num_words)
+    return num_blocks;
+
+  uint64_t word =
+      (load_word(table, w) ^ flip) & (ALL_ONES << (from % BITS_PER_WORD));
+  while (word == 0) {
+    if (!used && table == block_allocation_table && free_summary)
+      w = summary_next_word(free_summary, w + 1, num_words);
+    else
+      w = bitmap_skip_words(table, w + 1, num_words, flip);
+    if (w >= num_words)
+      return num_blocks;
+    word = load_word(table, w) ^ flip;
+  }
+
+  uint64_t block = w * BITS_PER_WORD + __builtin_ctzll(word);
+  return (block < num_blocks) ? block : num_blocks;
+}
+
+static void release_summary() {
+  free(free_summary);
+  free(chunk_free);
+  free_summary = NULL;
+  chunk_free = NULL;
+  num_chunks = 0;
+}
+
+/* Rebuilds the summary of table.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+static int build_summary(const uint64_t *table) {
+  release_summary();
+
+  uint64_t count = WORDS_FOR(num_words);
+  free_summary = calloc(count, sizeof(uint64_t));
+  chunk_free = calloc(count, sizeof(uint32_t));
+  if (free_summary == NULL || chunk_free == NULL) {
+    fprintf(stderr, "Failed to allocate the summary of the table\n");
+    release_summary();
+    return -1;
+  }
+  num_chunks = count;
+  free_count = 0;
+  reserved_count = 0;
+  num_allocations = 0;
+  num_failed_allocations = 0;
+  num_allocated_extents = 0;
+
+  for (uint64_t w = 0; w < num_words; w++) {
+    if (table[w] == ALL_ONES)
+      continue;
+    uint32_t free_in_word = __builtin_popcountll(~table[w]);
+    free_summary[w / BITS_PER_WORD] |= (uint64_t)1 << (w % BITS_PER_WORD);
+    chunk_free[w / BITS_PER_WORD] += free_in_word;
+    free_count += free_in_word;
+  }
+  return 0;
+}
+
+static void release_groups() {
+  for (uint64_t g = 0; g < num_groups; g++) {
+    extent_index_clear(&groups[g].index);
+    pthread_mutex_destroy(&groups[g].lock);
+  }
+  free(groups);
+  groups = NULL;
+  num_groups = 0;
+  buddy_release(&buddy);
+  index_valid = 0;
+}
+
+static void release_saved_heads() {
+  free(saved_heads);
+  saved_heads = NULL;
+  num_saved_heads = 0;
+}
+
+/* Puts the heads from the table file into the buddy system, if they
+ * cover exactly the free blocks of table.
+ * Returns 0 on success and -1 if they do not.
+ */
+static int restore_heads(const uint64_t *table) {
+  uint64_t *covered = calloc(num_words, sizeof(uint64_t));
+  if (covered == NULL)
+    return -1;
+
+  for (uint64_t i = 0; i < num_saved_heads; i++) {
+    uint64_t start = saved_heads[i].start;
+    uint64_t len = (uint64_t)1 << (saved_heads[i].order % BUDDY_ORDERS);
+    if (buddy_add_head(&buddy, start, saved_heads[i].order) != 0 ||
+        next_block(table, start, 1) < start + len) {
+      free(covered);
+      return -1;
+    }
+    for (uint64_t b = start; b < start + len; b++) {
+      uint64_t bit = (uint64_t)1 << (b % BITS_PER_WORD);
+      if (covered[b / BITS_PER_WORD] & bit) {
+        free(covered);
+        return -1;
+      }
+      covered[b / BITS_PER_WORD] |= bit;
+    }
+  }
+  free(covered);
+  return (buddy.free_blocks == free_count) ? 0 : -1;
+}
+
+/* Builds the buddy system from the heads saved in the table file, or
+ * from the runs of free blocks in table if there are none or they do
+ * not match it.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+static int build_buddy(const uint64_t *table) {
+  if (buddy_init(&buddy, num_blocks) != 0) {
+    fprintf(stderr, "Failed to allocate the buddy system\n");
+    return -1;
+  }
+
+  int restored = saved_heads != NULL && restore_heads(table) == 0;
+  release_saved_heads();
+  if (restored)
+    return 0;
+
+  if (buddy.free_blocks > 0) {
+    buddy_release(&buddy);
+    if (buddy_init(&buddy, num_blocks) != 0) {
+      fprintf(stderr, "Failed to allocate the buddy system\n");
+      return -1;
+    }
+  }
+
+  uint64_t start = next_block(table, 0, 0);
+  while (start < num_blocks) {
+    uint64_t end = next_block(table, start, 1);
+    buddy_free(&buddy, start, end - start);
+    start = next_block(table, end, 0);
+  }
+  return 0;
+}
+
+/* Refreshes the unlocked copies of the group's counters. The lock of
+ * the group must be held.
+ */
+static void update_hints(struct alloc_group *g) {
+  uint64_t largest = g->index.by_addr ? g->index.by_addr->max_len : 0;
+
+  __atomic_store_n(&g->free_hint, g->index.free_blocks, __ATOMIC_RELAXED);
+  __atomic_store_n(&g->largest_hint, largest, __ATOMIC_RELAXED);
+}
+
+static struct alloc_group *group_of(uint64_t block) {
+  return &groups[block / GROUP_BLOCKS];
+}
+
+/* Rebuilds the allocation groups and their free extent indexes from
+ * the runs of free blocks in table.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+static int build_index(const uint64_t *table) {
+  release_groups();
+
+  if (build_summary(table) != 0)
+    return -1;
+
+  uint64_t count = (num_blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+  groups = calloc(count, sizeof(struct alloc_group));
+  if (groups == NULL) {
+    fprintf(stderr, "Failed to allocate %" PRIu64 " allocation groups\n",
+            count);
+    return -1;
+  }
+  num_groups = count;
+  memset(&free_histogram, 0, sizeof(free_histogram));
+
+  for (uint64_t g = 0; g < num_groups; g++) {
+    pthread_mutex_init(&groups[g].lock, NULL);
+    groups[g].start = g * GROUP_BLOCKS;
+    groups[g].num_blocks = (num_blocks - groups[g].start < GROUP_BLOCKS)
+                               ? num_blocks - groups[g].start
+                               : GROUP_BLOCKS;
+    extent_index_init(&groups[g].index);
+    groups[g].index.histogram = &free_histogram;
+  }
+
+  /* Runs that cross a group boundary go into both groups. */
+  uint64_t start = next_block(table, 0, 0);
+  while (start < num_blocks) {
+    uint64_t end = next_block(table, start, 1);
+    while (start < end) {
+      struct alloc_group *g = group_of(start);
+      uint64_t piece_end = g->start + g->num_blocks;
+      if (piece_end > end)
+        piece_end = end;
+      if (extent_index_insert(&g->index, start, piece_end - start) != 0) {
+        fprintf(stderr,
+                "Failed to allocate memory for the free extent index\n");
+        release_groups();
+        return -1;
+      }
+      start = piece_end;
+    }
+    start = next_block(table, end, 0);
+  }
+
+  for (uint64_t g = 0; g < num_groups; g++)
+    update_hints(&groups[g]);
+
+  if (table_backend == BAT_BACKEND_BUDDY && build_buddy(table) != 0)
+    return -1;
+
+  __atomic_store_n(&index_valid, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* With BAT_LOCK_FREE and BAT_BACKEND_BUDDY the allocation groups are
+ * not used to allocate, but their indexes still follow the free runs,
+ * so that disk_stats() can count them without walking the table.
+ * track_range() takes [start, start+len) out of the indexes (used !=
+ * 0) or puts it back. With BAT_BACKEND_BUDDY buddy_lock must be held,
+ * with BAT_LOCK_FREE the group locks are taken here.
+ */
+static void track_range(uint64_t start, uint64_t len, int used) {
+  int lock = table_backend != BAT_BACKEND_BUDDY;
+
+  while (len > 0) {
+    struct alloc_group *g = group_of(start);
+    uint64_t piece = g->start + g->num_blocks - start;
+    if (piece > len)
+      piece = len;
+
+    if (lock)
+      pthread_mutex_lock(&g->lock);
+    int error = used ? extent_index_remove(&g->index, start, piece)
+                     : extent_index_insert(&g->index, start, piece);
+    if (error)
+      fprintf(stderr, "Failed to update the free extent index\n");
+    update_hints(g);
+    if (lock)
+      pthread_mutex_unlock(&g->lock);
+
+    start += piece;
+    len -= piece;
+  }
+}
+
+/* Loads the table if that has not happened yet, and builds the
+ * allocation groups if they are not up to date.
+ * Returns 0 on success and -1 on failure.
+ */
+static int prepare_table() {
+  if (__atomic_load_n(&index_valid, __ATOMIC_ACQUIRE))
+    return 0;
+
+  int retval = 0;
+  pthread_mutex_lock(&table_lock);
+  if (block_allocation_table == NULL)
+    block_allocation_table = read_table();
+
+  if (block_allocation_table == NULL)
+    retval = -1;
+  else if (!index_valid)
+    retval = build_index(block_allocation_table);
+  pthread_mutex_unlock(&table_lock);
+  return retval;
+}
+
+/* Returns the group where the calling thread starts its searches. */
+static uint64_t home() {
+  if (home_group < 0)
+    home_group = __atomic_fetch_add(&next_home_group, 1, __ATOMIC_RELAXED);
+  return home_group % ((num_blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS);
+}
+
+/* Returns the block where a search for goal starts: goal itself, or
+ * the start of the home group for NO_GOAL and other blocks past the
+ * end of the disk.
+ */
+static uint64_t search_start(uint64_t goal) {
+  return (goal < num_blocks) ? goal : home() * GROUP_BLOCKS;
+}
+
+/* Returns the number of free blocks on the disk. */
+static uint64_t total_free() {
+  return __atomic_load_n(&free_count, __ATOMIC_RELAXED);
+}
+
+/* Returns the number of free blocks that are not reserved. */
+static uint64_t unreserved_free() {
+  uint64_t free_blocks = total_free();
+  uint64_t reserved = __atomic_load_n(&reserved_count, __ATOMIC_RELAXED);
+  return (free_blocks > reserved) ? free_blocks - reserved : 0;
+}
+
+static uint64_t first_fit(const struct extent_index *index, uint64_t from,
+                          uint64_t len, uint64_t *cursor) {
+  (void)cursor;
+  struct free_extent *run = extent_index_find(index, from);
+  if (run && run->start + run->len - from >= len)
+    return from;
+
+  run = extent_index_first_fit(index, from, len);
+  if (run == NULL)
+    run = extent_index_first_fit(index, 0, len);
+  return run ? run->start : UINT64_MAX;
+}
+
+static uint64_t next_fit(const struct extent_index *index, uint64_t from,
+                         uint64_t len, uint64_t *cursor) {
+  uint64_t start = first_fit(index, (*cursor > from) ? *cursor : from, len,
+                             cursor);
+  if (start != UINT64_MAX)
+    *cursor = start + len;
+  return start;
+}
+
+static uint64_t best_fit(const struct extent_index *index, uint64_t from,
+                         uint64_t len, uint64_t *cursor) {
+  (void)from;
+  (void)cursor;
+  struct free_extent *run = extent_index_best_fit(index, len);
+  return run ? run->start : UINT64_MAX;
+}
+
+static uint64_t worst_fit(const struct extent_index *index, uint64_t from,
+                          uint64_t len, uint64_t *cursor) {
+  (void)from;
+  (void)cursor;
+  struct free_extent *run = extent_index_largest(index);
+  return (run && run->len >= len) ? run->start : UINT64_MAX;
+}
+
+static const struct alloc_policy builtin_policies[] = {
+    {"first", first_fit},
+    {"next", next_fit},
+    {"best", best_fit},
+    {"worst", worst_fit},
+};
+
+/* The registered policies, the built-in ones first, and the one that
+ * allocations use.
+ */
+static const struct alloc_policy *policies[MAX_ALLOC_POLICIES] = {
+    &builtin_policies[0], &builtin_policies[1], &builtin_policies[2],
+    &builtin_policies[3]};
+static int num_policies = 4;
+static const struct alloc_policy *policy = &builtin_policies[0];
+
+static const struct alloc_policy *find_policy(const char *name) {
+  for (int i = 0; i < num_policies; i++)
+    if (strcmp(policies[i]->name, name) == 0)
+      return policies[i];
+  return NULL;
+}
+
+/* Returns the first block b of group g where the blocks [b, b+len)
+ * are free, as chosen by the allocation policy, searching from block
+ * from. Returns num_blocks if there is no such run. The lock of the
+ * group must be held.
+ */
+static uint64_t find_in_group(struct alloc_group *g, uint64_t from,
+                              uint64_t len) {
+  uint64_t start = policy->find(&g->index, from, len, &g->cursor);
+  if (start == UINT64_MAX)
+    return num_blocks;
+
+  /* Do not trust a custom policy to name free blocks. */
+  struct free_extent *run = extent_index_find(&g->index, start);
+  if (run == NULL || run->start + run->len - start < len) {
+    fprintf(stderr, "Allocation policy %s chose blocks that are not free\n",
+            policy->name);
+    return num_blocks;
+  }
+  return start;
+}
+
+/* Marks the free blocks [start, start+len) in group g as used in the
+ * table and the index. The lock of the group must be held.
+ * Returns 0 on success and -1 if the index cannot be updated.
+ */
+static int take_run(struct alloc_group *g, uint64_t start, uint64_t len) {
+  if (extent_index_remove(&g->index, start, len) != 0) {
+    fprintf(stderr, "Failed to allocate memory for the free extent index\n");
+    return -1;
+  }
+  set_range(start, len, 1);
+  update_hints(g);
+  return 0;
+}
+
+/* Marks the used blocks [start, start+len) in group g as free in the
+ * table and the index. The lock of the group must be held.
+ * Returns 0 on success and -1 if the index cannot be updated.
+ */
+static int give_back(struct alloc_group *g, uint64_t start, uint64_t len) {
+  if (extent_index_insert(&g->index, start, len) != 0) {
+    fprintf(stderr, "Failed to allocate memory for the free extent index\n");
+    return -1;
+  }
+  set_range(start, len, 0);
+  update_hints(g);
+  return 0;
+}
+
+/* With BAT_LOCK_FREE there are no groups and no index. Threads
+ * search the table directly and claim runs by setting their bits
+ * with compare-and-swap.
+ * A run that crosses word boundaries is claimed one word at a time,
+ * in ascending order. If a word of the run turns out to be taken by
+ * another thread, the words claimed so far are released again and
+ * the claim fails, so a run is either claimed completely or not at
+ * all. Two threads that race for overlapping runs cannot both win,
+ * since they both have to claim the first word they share.
+ */
+
+/* Clears the bits of the blocks [start, start+len), which the calling
+ * thread owns, in a table that is shared without locks.
+ */
+static void clear_lock_free(uint64_t start, uint64_t len) {
+  if (len > 0)
+    mark_dirty(start / BITS_PER_WORD, (start + len - 1) / BITS_PER_WORD);
+
+  while (len > 0) {
+    uint64_t w = start / BITS_PER_WORD;
+    unsigned lo = start % BITS_PER_WORD;
+    unsigned hi = (len < BITS_PER_WORD - lo) ? lo + len : BITS_PER_WORD;
+
+    uint64_t mask = word_mask(lo, hi);
+    __atomic_fetch_and(&block_allocation_table[w], ~mask, __ATOMIC_SEQ_CST);
+    update_summary(w, mask, 1);
+
+    start += hi - lo;
+    len -= hi - lo;
+  }
+}
+
+/* Releases the blocks [start, start+len), which the calling thread
+ * owns. They go back into the indexes before their bits are cleared,
+ * so a thread that claims them finds them there.
+ */
+static void release_lock_free(uint64_t start, uint64_t len) {
+  track_range(start, len, 0);
+  clear_lock_free(start, len);
+}
+
+/* Claims the blocks [start, start+len) in a table that is shared
+ * without locks. Returns 0 if all of them were free and are now ours,
+ * and -1 if another thread holds some of them, in which case nothing
+ * is claimed.
+ */
+static int claim_lock_free(uint64_t start, uint64_t len) {
+  uint64_t pos = start;
+  uint64_t left = len;
+
+  while (left > 0) {
+    uint64_t w = pos / BITS_PER_WORD;
+    unsigned lo = pos % BITS_PER_WORD;
+    unsigned hi = (left < BITS_PER_WORD - lo) ? lo + left : BITS_PER_WORD;
+    uint64_t mask = word_mask(lo, hi);
+    uint64_t old = load_word(block_allocation_table, w);
+
+    /* Retry as long as only bits outside the run change under us. */
+    do {
+      if (old & mask) {
+        clear_lock_free(start, pos - start);
+        return -1;
+      }
+    } while (!__atomic_compare_exchange_n(&block_allocation_table[w], &old,
+                                          old | mask, 1, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_RELAXED));
+    update_summary(w, mask, 0);
+
+    pos += hi - lo;
+    left -= hi - lo;
+  }
+
+  mark_dirty(start / BITS_PER_WORD, (start + len - 1) / BITS_PER_WORD);
+  track_range(start, len, 1);
+  return 0;
+}
+
+/* Returns the first run of at least len free blocks from block from
+ * to the end of the disk, and then from the start of the disk, or
+ * num_blocks if there is none.
+ * The table can change while we look, so the result is only a
+ * candidate for claim_lock_free().
+ */
+static uint64_t find_from(uint64_t from, uint64_t len) {
+  uint64_t start = bitmap_find_run(block_allocation_table, free_summary,
+                                   num_blocks, from, len);
+
+  if (start == num_blocks && from > 0)
+    start = bitmap_find_run(block_allocation_table, free_summary, num_blocks,
+                            0, len);
+  return start;
+}
+
+/* Returns the length of the longest free run, and its start in
+ * *longest_start, or 0 if there are no free blocks.
+ */
+static uint64_t longest_lock_free(uint64_t *longest_start) {
+  uint64_t longest_len = 0;
+  uint64_t start = next_block(block_allocation_table, 0, 0);
+
+  while (start < num_blocks) {
+    uint64_t end = next_block(block_allocation_table, start, 1);
+    if (end - start > longest_len) {
+      *longest_start = start;
+      longest_len = end - start;
+    }
+    start = next_block(block_allocation_table, end, 0);
+  }
+  return longest_len;
+}
+
+/* allocate_block_near() for BAT_LOCK_FREE, searching from block from. */
+static int allocate_lock_free(uint64_t from, int extent_size) {
+  for (;;) {
+    uint64_t start = find_from(from, extent_size);
+    if (start == num_blocks)
+      return -1;
+
+    if (start > (uint64_t)(INT_MAX - extent_size)) {
+      fprintf(stderr, "Block %" PRIu64 " is out of range for allocate_block\n",
+              start);
+      return -1;
+    }
+
+    if (claim_lock_free(start, extent_size) == 0)
+      return (int)start;
+    /* Another thread got some of the blocks first, look again. */
+  }
+}
+
+/* With BAT_BACKEND_BUDDY every allocation and release goes through
+ * the buddy system under buddy_lock, BAT_LOCK_FREE is not used.
+ */
+
+/* Marks the used blocks [start, start+len) as free in the table and
+ * the buddy system. buddy_lock must be held.
+ */
+static void release_buddy(uint64_t start, uint64_t len) {
+  set_range(start, len, 0);
+  track_range(start, len, 0);
+  buddy_free(&buddy, start, len);
+}
+
+/* allocate_block_near() for BAT_BACKEND_BUDDY. There is no goal, the
+ * free heads are not ordered by address.
+ */
+static int allocate_buddy(int extent_size) {
+  pthread_mutex_lock(&buddy_lock);
+  uint64_t start = buddy_alloc(&buddy, extent_size);
+  if (start == num_blocks) {
+    pthread_mutex_unlock(&buddy_lock);
+    return -1;
+  }
+
+  if (start > (uint64_t)(INT_MAX - extent_size)) {
+    buddy_free(&buddy, start, extent_size);
+    pthread_mutex_unlock(&buddy_lock);
+    fprintf(stderr, "Block %" PRIu64 " is out of range for allocate_block\n",
+            start);
+    return -1;
+  }
+
+  set_range(start, extent_size, 1);
+  track_range(start, extent_size, 1);
+  pthread_mutex_unlock(&buddy_lock);
+  return (int)start;
+}
+
+/* take_next_run() for BAT_BACKEND_BUDDY: the smallest head that holds
+ * all remaining blocks, or else the first half of the longest one.
+ */
+static int take_buddy_run(uint64_t remaining, uint64_t *start,
+                          uint64_t *len) {
+  pthread_mutex_lock(&buddy_lock);
+  int order = buddy_largest_order(&buddy);
+  if (order < 0) {
+    pthread_mutex_unlock(&buddy_lock);
+    return -1;
+  }
+
+  *len = ((uint64_t)1 << order < remaining) ? (uint64_t)1 << order : remaining;
+  *start = buddy_alloc(&buddy, *len);
+  set_range(*start, *len, 1);
+  track_range(*start, *len, 1);
+  pthread_mutex_unlock(&buddy_lock);
+  return 0;
+}
+
+/* Picks the group for the next run of allocate_extents(): the first
+ * group from group first on that can hold len blocks in one run, or
+ * else the group with the longest run. Returns NULL if no group has
+ * free blocks.
+ */
+static struct alloc_group *pick_group(uint64_t first, uint64_t len) {
+  struct alloc_group *longest = NULL;
+  uint64_t longest_len = 0;
+
+  for (uint64_t i = 0; i < num_groups; i++) {
+    struct alloc_group *g = &groups[(first + i) % num_groups];
+    uint64_t largest = __atomic_load_n(&g->largest_hint, __ATOMIC_RELAXED);
+    if (largest >= len)
+      return g;
+    if (largest > longest_len) {
+      longest = g;
+      longest_len = largest;
+    }
+  }
+  return longest;
+}
+
+/* Takes the next run for allocate_extents(): the first run from block
+ * from on that holds all remaining blocks, or else the longest run
+ * there is. The run is stored in *start and *len.
+ * Returns 0 on success and -1 if there are no free blocks left.
+ */
+static int take_next_run(uint64_t from, uint64_t remaining, uint64_t *start,
+                         uint64_t *len) {
+  if (table_backend == BAT_BACKEND_BUDDY)
+    return take_buddy_run(remaining, start, len);
+
+  if (table_flags & BAT_LOCK_FREE) {
+    for (;;) {
+      *start = find_from(from, remaining);
+      *len = remaining;
+      if (*start == num_blocks) {
+        *len = longest_lock_free(start);
+        if (*len == 0)
+          return -1;
+      }
+      if (claim_lock_free(*start, *len) == 0)
+        return 0;
+    }
+  }
+
+  struct alloc_group *goal_group = group_of(from);
+  for (;;) {
+    struct alloc_group *g = pick_group(goal_group - groups, remaining);
+    if (g == NULL)
+      return -1;
+
+    pthread_mutex_lock(&g->lock);
+    *start = find_in_group(g, (g == goal_group) ? from : g->start, remaining);
+    *len = remaining;
+    if (*start == num_blocks) {
+      struct free_extent *run = extent_index_largest(&g->index);
+      if (run == NULL) {
+        /* Another thread got there first. */
+        pthread_mutex_unlock(&g->lock);
+        continue;
+      }
+      *start = run->start;
+      *len = (run->len < remaining) ? run->len : remaining;
+    }
+
+    int error = take_run(g, *start, *len);
+    pthread_mutex_unlock(&g->lock);
+    return error;
+  }
+}
+
+/* Gives back the run [start, start+len) that was just allocated, when
+ * a later part of the same allocation fails. The run can span several
+ * groups, if runs from neighbouring groups were merged.
+ */
+static void release_run(uint64_t start, uint64_t len) {
+  if (table_backend == BAT_BACKEND_BUDDY) {
+    pthread_mutex_lock(&buddy_lock);
+    release_buddy(start, len);
+    pthread_mutex_unlock(&buddy_lock);
+    return;
+  }
+
+  if (table_flags & BAT_LOCK_FREE) {
+    release_lock_free(start, len);
+    return;
+  }
+
+  while (len > 0) {
+    struct alloc_group *g = group_of(start);
+    uint64_t piece = g->start + g->num_blocks - start;
+    if (piece > len)
+      piece = len;
+
+    pthread_mutex_lock(&g->lock);
+    give_back(g, start, piece);
+    pthread_mutex_unlock(&g->lock);
+
+    start += piece;
+    len -= piece;
+  }
+}
+
+static void release_extents(const struct Extent *extents, int num_extents) {
+  for (int i = 0; i < num_extents; i++)
+    release_run(extents[i].blockno, extents[i].extent);
+}
 
 void set_block_allocation_table_name(const char *str) {
+  set_block_allocation_table_name_with_flags(str, 0);
+}
+
+void set_block_allocation_table_name_with_flags(const char *str, int flags) {
   if (file_name != NULL) {
     fprintf(
         stderr,
@@ -41,58 +1121,299 @@ void set_block_allocation_table_name(const char *str) {
     exit(-1);
   }
 
-  file_name = strdup(str);
+  file_name = strdup(str);
+  table_flags = flags;
+
+  block_allocation_table = read_table();
+
+  atexit(&save_and_release_block_allocation_table);
+}
+
+void save_and_release_block_allocation_table() {
+  if (file_name) {
+    if (mapping) {
+      unmap_table();
+    } else if (block_allocation_table) {
+      if (table_changed)
+        write_table();
+      free(block_allocation_table);
+    }
+    release_groups();
+    release_summary();
+    release_saved_heads();
+
+    free(file_name);
+  }
+}
+
+/* Converts a table in the old format, one char per block, into the
+ * bitmap. The number of blocks is the size of the file.
+ */
+static uint64_t *convert_byte_table(FILE *f) {
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+
+  if (size <= 0 || check_geometry(size, BLOCKSIZE) != 0) {
+    fprintf(stderr, "%s is not a block allocation table\n", file_name);
+    return NULL;
+  }
+  set_geometry(size, BLOCKSIZE);
+
+  uint64_t *table = calloc(num_words, sizeof(uint64_t));
+  char *bytes = malloc(CONVERT_CHUNK);
+  if (table == NULL || bytes == NULL) {
+    fprintf(stderr, "Failed to allocate %" PRIu64 " bytes\n",
+            num_words * sizeof(uint64_t));
+    free(table);
+    free(bytes);
+    return NULL;
+  }
+
+  for (uint64_t base = 0; base < num_blocks; base += CONVERT_CHUNK) {
+    size_t want = (num_blocks - base < CONVERT_CHUNK) ? num_blocks - base
+                                                      : CONVERT_CHUNK;
+    if (fread(bytes, 1, want, f) != want) {
+      fprintf(stderr, "Failed to load %" PRIu64 " block entries from disk\n",
+              num_blocks);
+      perror("Reason:");
+      free(table);
+      free(bytes);
+      return NULL;
+    }
+    for (size_t i = 0; i < want; i++)
+      if (bytes[i] != 0)
+        table[(base + i) / BITS_PER_WORD] |= (uint64_t)1
+                                             << ((base + i) % BITS_PER_WORD);
+  }
+  free(bytes);
+  return table;
+}
+
+/* Reads the free heads that follow the bitmap of a buddy table into
+ * saved_heads. If they are missing, the buddy system is built from the
+ * bitmap instead.
+ */
+static void read_saved_heads(FILE *f) {
+  uint64_t count;
+
+  release_saved_heads();
+  if (fread(&count, sizeof(count), 1, f) != 1 || count > num_blocks)
+    return;
+  saved_heads = malloc(count * sizeof(struct saved_head) + 1);
+  if (saved_heads == NULL)
+    return;
+  if (fread(saved_heads, sizeof(struct saved_head), count, f) != count) {
+    release_saved_heads();
+    return;
+  }
+  num_saved_heads = count;
+}
+
+/* Writes the free heads of the buddy system, or the ones that were
+ * read if it has not been built, after the bitmap.
+ * Returns 0 on success and -1 on failure.
+ */
+static int write_saved_heads(FILE *f) {
+  uint64_t count = num_saved_heads;
+
+  if (buddy.order != NULL) {
+    count = 0;
+    for (unsigned k = 0; k < BUDDY_ORDERS; k++)
+      count += buddy.num_heads[k];
+  }
+  if (fwrite(&count, sizeof(count), 1, f) != 1)
+    return -1;
+
+  if (buddy.order == NULL)
+    return (fwrite(saved_heads, sizeof(struct saved_head), count, f) == count)
+               ? 0
+               : -1;
+
+  for (unsigned k = 0; k < BUDDY_ORDERS; k++) {
+    for (uint32_t h = buddy.first[k]; h != BUDDY_NIL; h = buddy.next[h]) {
+      struct saved_head head = {.start = h, .order = k};
+      if (fwrite(&head, sizeof(head), 1, f) != 1)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+static uint64_t *load_table() {
+  if (file_name == NULL) {
+    fprintf(stderr,
+            "Failed to set the name of the block allocation table file.\n");
+    exit(-1);
+  }
+
+  FILE *f = fopen(file_name, "r");
+  if (!f) {
+    fprintf(stderr, "Failed to open file %s for reading\n", file_name);
+    perror("Reason:");
+    return NULL;
+  }
+
+  uint64_t *table;
+  struct bat_header header;
+  int num_read = fread(&header, sizeof(header), 1, f);
+  if (num_read != 1 || header.magic != BAT_MAGIC) {
+    table_backend = BAT_BACKEND_BITMAP;
+    table = convert_byte_table(f);
+    if (table == NULL) {
+      fclose(f);
+      return NULL;
+    }
+  } else {
+    if (header.version != BAT_VERSION || header.backend > BAT_BACKEND_BUDDY ||
+        check_geometry(header.num_blocks, header.block_size) != 0) {
+      fprintf(stderr, "Block allocation table %s has an unknown format\n",
+              file_name);
+      fclose(f);
+      return NULL;
+    }
+    set_geometry(header.num_blocks, header.block_size);
+    table_backend = header.backend;
 
-  block_allocation_table = read_table();
+    table = malloc(num_words * sizeof(uint64_t));
+    if (table == NULL) {
+      fprintf(stderr, "Failed to allocate %" PRIu64 " bytes\n",
+              num_words * sizeof(uint64_t));
+      fclose(f);
+      return NULL;
+    }
+    if (fread(table, sizeof(uint64_t), num_words, f) != num_words) {
+      fprintf(stderr, "Failed to load %" PRIu64 " block entries from disk\n",
+              num_blocks);
+      perror("Reason:");
+      fclose(f);
+      free(table);
+      return NULL;
+    }
+    if (table_backend == BAT_BACKEND_BUDDY)
+      read_saved_heads(f);
+  }
+  fclose(f);
 
-  atexit(&save_and_release_block_allocation_table);
+  set_padding(table);
+
+  return table;
 }
 
-void save_and_release_block_allocation_table() {
-  if (file_name) {
-    if (block_allocation_table) {
-      write_table();
-      free(block_allocation_table);
-    }
+/* Flushes the dirty pages of a mapped table and removes the mapping. */
+static void unmap_table() {
+  stop_flusher();
+  sync_disk();
 
-    free(file_name);
+  /* The free heads of a buddy table are not part of the mapping. */
+  if (table_backend == BAT_BACKEND_BUDDY) {
+    FILE *f = fopen(file_name, "r+");
+    if (f == NULL || fseek(f, mapping_size, SEEK_SET) != 0 ||
+        write_saved_heads(f) != 0)
+      fprintf(stderr, "Failed to write the free heads to %s\n", file_name);
+    if (f)
+      fclose(f);
   }
+  munmap(mapping, mapping_size);
+  free(dirty_pages);
+  mapping = NULL;
+  mapping_size = 0;
+  dirty_pages = NULL;
+  block_allocation_table = NULL;
 }
 
-static char *read_table() {
-  if (file_name == NULL) {
-    fprintf(stderr,
-            "Failed to set the name of the block allocation table file.\n");
-    exit(-1);
+/* Maps the table file, which must be in the current format and have
+ * the given geometry, and points block_allocation_table into it.
+ * Returns the table or NULL on failure.
+ */
+static uint64_t *map_file(int fd, uint64_t blocks, uint32_t size) {
+  set_geometry(blocks, size);
+
+  size_t length = sizeof(struct bat_header) + num_words * sizeof(uint64_t);
+  char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s (%s)\n", file_name, strerror(errno));
+    return NULL;
   }
 
-  char *table = malloc(NUM_BLOCKS);
-  if (table == NULL) {
-    fprintf(stderr, "Failed to allocate %d bytes\n", NUM_BLOCKS);
+  if (page_size == 0)
+    page_size = sysconf(_SC_PAGESIZE);
+  uint64_t pages = (length + page_size - 1) / page_size;
+  uint64_t *dirty = calloc(WORDS_FOR(pages), sizeof(uint64_t));
+  if (dirty == NULL) {
+    fprintf(stderr, "Failed to allocate %" PRIu64 " bytes\n",
+            WORDS_FOR(pages) * sizeof(uint64_t));
+    munmap(base, length);
     return NULL;
   }
 
-  FILE *f = fopen(file_name, "r");
-  if (!f) {
+  mapping = base;
+  mapping_size = length;
+  dirty_pages = dirty;
+  start_flusher();
+  return (uint64_t *)(base + sizeof(struct bat_header));
+}
+
+/* Maps an existing table file. Files in the old format are converted
+ * and rewritten first. Only the header is read here; the blocks are
+ * paged in when they are used.
+ */
+static uint64_t *map_table() {
+  struct bat_header header;
+  int fd = open(file_name, O_RDWR);
+  if (fd < 0) {
     fprintf(stderr, "Failed to open file %s for reading\n", file_name);
     perror("Reason:");
-    free(table);
     return NULL;
   }
 
-  int num_read = fread(table, 1, NUM_BLOCKS, f);
-  if (num_read != NUM_BLOCKS) {
-    fprintf(stderr, "Failed to load %d block entries from disk\n", NUM_BLOCKS);
-    perror("Reason:");
-    fclose(f);
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != BAT_MAGIC) {
+    close(fd);
+
+    uint64_t *table = load_table();
+    if (table == NULL)
+      return NULL;
+    block_allocation_table = table;
+    int error = write_table();
+    block_allocation_table = NULL;
     free(table);
+    if (error)
+      return NULL;
+
+    fd = open(file_name, O_RDWR);
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      fprintf(stderr, "Failed to reopen converted file %s\n", file_name);
+      if (fd >= 0)
+        close(fd);
+      return NULL;
+    }
+  }
+
+  if (header.version != BAT_VERSION || header.backend > BAT_BACKEND_BUDDY ||
+      check_geometry(header.num_blocks, header.block_size) != 0) {
+    fprintf(stderr, "Block allocation table %s has an unknown format\n",
+            file_name);
+    close(fd);
     return NULL;
   }
-  fclose(f);
+  table_backend = header.backend;
 
+  uint64_t *table = map_file(fd, header.num_blocks, header.block_size);
+  close(fd);
   return table;
 }
 
+static uint64_t *read_table() {
+  table_changed = 0;
+  release_groups();
+  release_summary();
+  release_saved_heads();
+  if (table_flags & BAT_MAPPED)
+    return map_table();
+  return load_table();
+}
+
 static int write_table() {
   if (file_name == NULL) {
     fprintf(stderr,
@@ -112,18 +1433,97 @@ static int write_table() {
     perror("Reason:");
     return -1;
   }
-  int num = fwrite(block_allocation_table, 1, NUM_BLOCKS, f);
-  if (num != NUM_BLOCKS) {
-    fprintf(stderr, "Failed to write %d bytes to %s, ", NUM_BLOCKS, file_name);
-    fprintf(stderr, "fwrite returned %d\n", num);
+  struct bat_header header = {.magic = BAT_MAGIC,
+                               .version = BAT_VERSION,
+                               .num_blocks = num_blocks,
+                               .block_size = block_size,
+                               .backend = table_backend};
+  size_t num = fwrite(&header, sizeof(header), 1, f);
+  if (num == 1)
+    num = fwrite(block_allocation_table, sizeof(uint64_t), num_words, f);
+  else
+    num = 0;
+  if (num == num_words && table_backend == BAT_BACKEND_BUDDY &&
+      write_saved_heads(f) != 0) {
+    fprintf(stderr, "Failed to write the free heads to %s\n", file_name);
+    fclose(f);
+    return -1;
+  }
+  if (num != num_words) {
+    fprintf(stderr, "Failed to write %" PRIu64 " bytes to %s, ",
+            sizeof(header) + num_words * sizeof(uint64_t), file_name);
+    fprintf(stderr, "fwrite returned %zu\n", num);
     perror("Reason:");
+    fclose(f);
     return -1;
   }
   fclose(f);
+  table_changed = 0;
   return 0;
 }
 
-int format_disk() {
+int format_disk() { return format_disk_with_geometry(NUM_BLOCKS, BLOCKSIZE); }
+
+/* format_disk_with_geometry() for a mapped table. The new file is
+ * created with ftruncate(), which gives us the zeroed bitmap without
+ * writing it.
+ */
+static int format_mapped(uint64_t blocks, uint32_t size) {
+  if (mapping)
+    unmap_table();
+  else if (block_allocation_table)
+    free(block_allocation_table);
+  block_allocation_table = NULL;
+
+  int fd = open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open file %s for writing\n", file_name);
+    perror("Reason:");
+    return -1;
+  }
+  off_t length =
+      sizeof(struct bat_header) + WORDS_FOR(blocks) * sizeof(uint64_t);
+  if (ftruncate(fd, length) != 0) {
+    fprintf(stderr, "Failed to resize %s (%s)\n", file_name, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  block_allocation_table = map_file(fd, blocks, size);
+  close(fd);
+  if (block_allocation_table == NULL)
+    return -1;
+
+  *(struct bat_header *)mapping =
+      (struct bat_header){.magic = BAT_MAGIC,
+                          .version = BAT_VERSION,
+                          .num_blocks = num_blocks,
+                          .block_size = block_size,
+                          .backend = table_backend};
+  dirty_pages[0] |= 1;
+  set_padding(block_allocation_table);
+  mark_dirty(num_words - 1, num_words - 1);
+
+  if (build_index(block_allocation_table) != 0)
+    return -1;
+
+  return sync_disk();
+}
+
+int format_disk_with_geometry(uint64_t blocks, uint32_t size) {
+  return format_disk_with_backend(blocks, size, BAT_BACKEND_BITMAP);
+}
+
+int format_disk_with_backend(uint64_t blocks, uint32_t size,
+                             enum bat_backend backend) {
+  if (check_geometry(blocks, size) != 0)
+    return -1;
+
+  if (backend != BAT_BACKEND_BITMAP && backend != BAT_BACKEND_BUDDY) {
+    fprintf(stderr, "Unknown allocation backend %d\n", backend);
+    return -1;
+  }
+
   if (file_name == NULL) {
     fprintf(stderr,
             "Failed to set the name of the block allocation table file.\n");
@@ -133,17 +1533,32 @@ int format_disk() {
   int error = unlink(file_name);
 
   if (error == 0 || (error == -1 && errno == ENOENT)) {
-    if (block_allocation_table)
+    table_backend = backend;
+    release_saved_heads();
+
+    if (table_flags & BAT_MAPPED)
+      return format_mapped(blocks, size);
+
+    if (mapping)
+      unmap_table();
+    else if (block_allocation_table)
       free(block_allocation_table);
 
-    /* We want to set all NUM_BLOCK chars to 0, convenient to use
+    set_geometry(blocks, size);
+
+    /* We want to set all num_blocks bits to 0, convenient to use
      * calloc.
      */
-    block_allocation_table = calloc(NUM_BLOCKS, 1);
+    block_allocation_table = calloc(num_words, sizeof(uint64_t));
     if (block_allocation_table == NULL) {
-      fprintf(stderr, "Failed to allocate %d bytes\n", NUM_BLOCKS);
+      fprintf(stderr, "Failed to allocate %" PRIu64 " bytes\n",
+              num_words * sizeof(uint64_t));
       return -1;
     }
+    set_padding(block_allocation_table);
+
+    if (build_index(block_allocation_table) != 0)
+      return -1;
 
     int retval = write_table();
     return retval;
@@ -154,7 +1569,104 @@ int format_disk() {
   return -1;
 }
 
+/* Counts a call to an allocation function that returned num_extents
+ * extents, or failed if num_extents is negative.
+ */
+static void count_allocation(int num_extents) {
+  if (num_extents < 0) {
+    __atomic_add_fetch(&num_failed_allocations, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_add_fetch(&num_allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&num_allocated_extents, num_extents, __ATOMIC_RELAXED);
+}
+
 int allocate_block(int extent_size) {
+  return allocate_block_near(NO_GOAL, extent_size);
+}
+
+/* Takes len free blocks in one run that crosses group boundaries, for
+ * allocate_one() when no group has such a run by itself. The run is
+ * the free run at the end of a group, the completely free groups
+ * after it and the free run at the start of the group after those.
+ * Their locks are taken in ascending order, like free_extent() does.
+ * The lowest such run from group first on, and then from the start of
+ * the disk, is taken.
+ * Returns the first block of the run, or num_blocks if there is none.
+ */
+static uint64_t take_spanning_run(uint64_t first, uint64_t len) {
+  for (uint64_t i = 0; i < num_groups; i++) {
+    uint64_t g = (first + i) % num_groups;
+    if (g + 1 == num_groups ||
+        __atomic_load_n(&groups[g].free_hint, __ATOMIC_RELAXED) == 0)
+      continue;
+
+    pthread_mutex_lock(&groups[g].lock);
+    struct alloc_group *group = &groups[g];
+    struct free_extent *run =
+        extent_index_find(&group->index, group->start + group->num_blocks - 1);
+    if (run == NULL) {
+      pthread_mutex_unlock(&group->lock);
+      continue;
+    }
+
+    uint64_t start = run->start;
+    uint64_t found = run->len;
+    uint64_t last = g;
+    while (found < len && last + 1 < num_groups) {
+      struct alloc_group *next = &groups[++last];
+      pthread_mutex_lock(&next->lock);
+      run = extent_index_find(&next->index, next->start);
+      if (run == NULL)
+        break;
+      found += run->len;
+      if (run->len < next->num_blocks)
+        break;
+    }
+
+    /* The int interface cannot name blocks past INT_MAX. */
+    uint64_t result = num_blocks;
+    if (found >= len && start > (uint64_t)INT_MAX - len)
+      fprintf(stderr, "Block %" PRIu64 " is out of range for allocate_block\n",
+              start);
+    else if (found >= len)
+      result = start;
+
+    uint64_t pos = start;
+    while (result != num_blocks && pos < start + len) {
+      struct alloc_group *h = group_of(pos);
+      uint64_t piece = h->start + h->num_blocks - pos;
+      if (piece > start + len - pos)
+        piece = start + len - pos;
+      if (take_run(h, pos, piece) != 0) {
+        /* Give back the pieces that were taken. */
+        while (pos > start) {
+          struct alloc_group *back = group_of(pos - 1);
+          uint64_t from = (back->start > start) ? back->start : start;
+          give_back(back, from, pos - from);
+          pos = from;
+        }
+        result = num_blocks;
+        break;
+      }
+      pos += piece;
+    }
+
+    for (uint64_t h = last + 1; h-- > g;)
+      pthread_mutex_unlock(&groups[h].lock);
+    if (result != num_blocks)
+      return result;
+
+    /* The groups up to last are part of the run that was too short. */
+    if (last > g)
+      i += last - g - 1;
+  }
+  return num_blocks;
+}
+
+static int take_one(uint64_t goal, int extent_size);
+
+static int allocate_one(uint64_t goal, int extent_size) {
   if (extent_size == 0) {
     // outside the permitted range
     fprintf(stderr, "Programming error: Trying to allocate extent that is 0 "
@@ -169,61 +1681,337 @@ int allocate_block(int extent_size) {
     exit(-1);
   }
 
-  if (extent_size > 4) {
+  if ((uint32_t)extent_size > MAX_EXTENT_LEN) {
     // outside the permitted range
     return -1;
   }
 
-  if (block_allocation_table == NULL)
-    block_allocation_table = read_table();
+  /* Set the blocks aside while we look for them, so that threads that
+   * allocate at the same time cannot take reserved blocks.
+   */
+  if (reserve_blocks(extent_size) != 0)
+    return -1;
 
-  if (block_allocation_table == NULL) {
+  int start = take_one(goal, extent_size);
+  unreserve_blocks(extent_size);
+  return start;
+}
+
+/* Allocates extent_size blocks for allocate_one(), which has set them
+ * aside.
+ */
+static int take_one(uint64_t goal, int extent_size) {
+  if (table_backend == BAT_BACKEND_BUDDY)
+    return allocate_buddy(extent_size);
+
+  uint64_t from = search_start(goal);
+  if (table_flags & BAT_LOCK_FREE)
+    return allocate_lock_free(from, extent_size);
+
+  /* the run the policy chooses, starting in the group of from and
+   * then in the groups after it
+   */
+  struct alloc_group *goal_group = group_of(from);
+  for (uint64_t i = 0; i < num_groups; i++) {
+    struct alloc_group *g = &groups[(goal_group - groups + i) % num_groups];
+    if (__atomic_load_n(&g->largest_hint, __ATOMIC_RELAXED) <
+        (uint64_t)extent_size)
+      continue;
+
+    pthread_mutex_lock(&g->lock);
+    uint64_t start =
+        find_in_group(g, (g == goal_group) ? from : g->start, extent_size);
+    if (start == num_blocks) {
+      pthread_mutex_unlock(&g->lock);
+      continue;
+    }
+
+    /* The int interface cannot name blocks past INT_MAX on very large
+     * disks.
+     */
+    if (start > (uint64_t)(INT_MAX - extent_size)) {
+      pthread_mutex_unlock(&g->lock);
+      fprintf(stderr, "Block %" PRIu64 " is out of range for allocate_block\n",
+              start);
+      return -1;
+    }
+
+    int error = take_run(g, start, extent_size);
+    pthread_mutex_unlock(&g->lock);
+    return error ? -1 : (int)start;
+  }
+
+  uint64_t start = take_spanning_run(goal_group - groups, extent_size);
+  return (start == num_blocks) ? -1 : (int)start;
+}
+
+int allocate_block_near(uint64_t goal, int extent_size) {
+  int block = allocate_one(goal, extent_size);
+  count_allocation(block >= 0 ? 1 : -1);
+  return block;
+}
+
+/* Allocates nblocks blocks for allocate_extents() and
+ * allocate_reserved_extents(), which have checked that they are free.
+ */
+static int allocate_runs(uint64_t from, uint64_t nblocks,
+                         struct Extent *out_extents, int max_extents) {
+  uint64_t remaining = nblocks;
+  int num_extents = 0;
+
+  while (remaining > 0) {
+    /* Take the first run from from on that holds everything that is
+     * left. If there is none, take the longest run there is; this gives
+     * the fewest runs in total.
+     */
+    uint64_t start, len;
+    if (take_next_run(from, remaining, &start, &len) != 0) {
+      release_extents(out_extents, num_extents);
+      return -1;
+    }
+
+    /* A run that continues the previous extent, like the rest of a
+     * free run that crosses into the next group, is added to it.
+     */
+    struct Extent *last = num_extents ? &out_extents[num_extents - 1] : NULL;
+    uint64_t grow = 0;
+    if (last && (uint64_t)last->blockno + last->extent == start) {
+      grow = MAX_EXTENT_LEN - last->extent;
+      if (grow > len)
+        grow = len;
+    }
+
+    /* The rest is recorded in pieces of at most MAX_EXTENT_LEN blocks. */
+    uint64_t pieces = (len - grow + MAX_EXTENT_LEN - 1) / MAX_EXTENT_LEN;
+    if (pieces > (uint64_t)(max_extents - num_extents)) {
+      release_run(start, len);
+      release_extents(out_extents, num_extents);
+      return -1;
+    }
+
+    if (grow > 0)
+      last->extent += grow;
+    for (uint64_t done = grow; done < len; done += MAX_EXTENT_LEN) {
+      uint64_t piece = (len - done < MAX_EXTENT_LEN) ? len - done
+                                                     : MAX_EXTENT_LEN;
+      out_extents[num_extents++] =
+          (struct Extent){.blockno = start + done, .extent = piece};
+    }
+    remaining -= len;
+  }
+  return num_extents;
+}
+
+int allocate_extents(uint64_t nblocks, struct Extent *out_extents,
+                     int max_extents) {
+  return allocate_extents_near(NO_GOAL, nblocks, out_extents, max_extents);
+}
+
+int allocate_extents_near(uint64_t goal, uint64_t nblocks,
+                          struct Extent *out_extents, int max_extents) {
+  if (prepare_table() != 0)
     return -1;
+
+  /* Like allocate_one(), set the blocks aside first. */
+  int num_extents = -1;
+  if (nblocks > 0 && reserve_blocks(nblocks) == 0) {
+    num_extents =
+        allocate_runs(search_start(goal), nblocks, out_extents, max_extents);
+    unreserve_blocks(nblocks);
   }
+  count_allocation(num_extents);
+  return num_extents;
+}
 
-  /* first fit algorithm */
-  for (int i = 0; i < NUM_BLOCKS; i++) {
-    /* extent_size blocks in a row that are free? */
-    int found_blk = 1;
-    for (int j = 0; j < extent_size; j++)
-      if ((i + j >= NUM_BLOCKS) || (block_allocation_table[i + j] != 0)) {
-        found_blk = 0;
-        break;
-      }
-    /* If not, continue to next i */
-    if (found_blk == 0)
-      continue;
+int register_alloc_policy(const struct alloc_policy *new_policy) {
+  if (num_policies == MAX_ALLOC_POLICIES || find_policy(new_policy->name))
+    return -1;
+  policies[num_policies++] = new_policy;
+  return 0;
+}
+
+int set_alloc_policy(const char *name) {
+  const struct alloc_policy *found = find_policy(name);
+  if (found == NULL)
+    return -1;
+  policy = found;
+  return 0;
+}
+
+int reserve_blocks(uint64_t nblocks) {
+  if (prepare_table() != 0)
+    return -1;
 
-    /* Found extent_size unused contiguous blocks.
-     * Allocate them. */
-    for (int j = 0; j < extent_size; j++)
-      block_allocation_table[i + j] = 1;
+  uint64_t reserved = __atomic_load_n(&reserved_count, __ATOMIC_RELAXED);
+  do {
+    uint64_t free_blocks = total_free();
+    if (free_blocks < reserved || free_blocks - reserved < nblocks)
+      return -1;
+  } while (!__atomic_compare_exchange_n(&reserved_count, &reserved,
+                                        reserved + nblocks, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 0;
+}
+
+void unreserve_blocks(uint64_t nblocks) {
+  __atomic_sub_fetch(&reserved_count, nblocks, __ATOMIC_RELAXED);
+}
+
+int allocate_reserved_extents(uint64_t nblocks, struct Extent *out_extents,
+                              int max_extents) {
+  if (prepare_table() != 0)
+    return -1;
+
+  int num_extents = -1;
+  if (nblocks > 0 &&
+      nblocks <= __atomic_load_n(&reserved_count, __ATOMIC_RELAXED))
+    num_extents =
+        allocate_runs(search_start(NO_GOAL), nblocks, out_extents, max_extents);
+  if (num_extents >= 0)
+    unreserve_blocks(nblocks);
+  count_allocation(num_extents);
+  return num_extents;
+}
+
+int free_reserved_extents(const struct Extent *extents, int num_extents) {
+  int retval = 0;
 
-    return i;
+  /* The blocks are reserved before they are freed, so they are never
+   * free without being reserved.
+   */
+  for (int i = 0; i < num_extents; i++) {
+    __atomic_add_fetch(&reserved_count, extents[i].extent, __ATOMIC_RELAXED);
+    if (free_extent(extents[i].blockno, extents[i].extent) != 0) {
+      unreserve_blocks(extents[i].extent);
+      retval = -1;
+    }
   }
-  return -1;
+  return retval;
 }
 
 int free_block(int block) {
-  if (block < 0 || block >= NUM_BLOCKS) {
+  if (prepare_table() != 0)
+    return -1;
+
+  if (block < 0 || (uint64_t)block >= num_blocks) {
     fprintf(stderr, "Block number %d is not in range\n", block);
     return -1;
   }
 
-  if (block_allocation_table == NULL)
-    block_allocation_table = read_table();
+  uint64_t w = block / BITS_PER_WORD;
+  uint64_t bit = (uint64_t)1 << (block % BITS_PER_WORD);
 
-  if (block_allocation_table == NULL)
-    return -1;
+  if (table_backend == BAT_BACKEND_BUDDY) {
+    pthread_mutex_lock(&buddy_lock);
+    int used = (block_allocation_table[w] & bit) != 0;
+    if (used)
+      release_buddy(block, 1);
+    pthread_mutex_unlock(&buddy_lock);
+    if (!used) {
+      fprintf(stderr, "Block %d was not allocated\n", block);
+      return -1;
+    }
+    return 0;
+  }
+
+  /* Only the owner of the block frees it, see free_extent(). */
+  if (table_flags & BAT_LOCK_FREE) {
+    if ((load_word(block_allocation_table, w) & bit) == 0) {
+      fprintf(stderr, "Block %d was not allocated\n", block);
+      return -1;
+    }
+    release_lock_free(block, 1);
+    return 0;
+  }
+
+  struct alloc_group *g = group_of(block);
+  pthread_mutex_lock(&g->lock);
 
-  if (block_allocation_table[block] != 1) {
+  if ((block_allocation_table[w] & bit) == 0) {
+    pthread_mutex_unlock(&g->lock);
     fprintf(stderr, "Block %d was not allocated\n", block);
     return -1;
   }
 
-  block_allocation_table[block] = 0;
+  int error = give_back(g, block, 1);
+  pthread_mutex_unlock(&g->lock);
+  return error;
+}
 
-  return 0;
+int free_extent(uint64_t start, uint64_t len) {
+  if (prepare_table() != 0)
+    return -1;
+
+  if (len == 0 || start >= num_blocks || len > num_blocks - start) {
+    fprintf(stderr, "Blocks %" PRIu64 "-%" PRIu64 " are not in range\n", start,
+            start + len - 1);
+    return -1;
+  }
+
+  if (table_backend == BAT_BACKEND_BUDDY) {
+    pthread_mutex_lock(&buddy_lock);
+    int used = range_is_used(start, len);
+    if (used)
+      release_buddy(start, len);
+    pthread_mutex_unlock(&buddy_lock);
+    if (!used) {
+      fprintf(stderr, "Blocks %" PRIu64 "-%" PRIu64 " were not all allocated\n",
+              start, start + len - 1);
+      return -1;
+    }
+    return 0;
+  }
+
+  /* Only the owner of the blocks frees them, so once they are all
+   * found in use they stay so until we release them.
+   */
+  if (table_flags & BAT_LOCK_FREE) {
+    if (!range_is_used(start, len)) {
+      fprintf(stderr, "Blocks %" PRIu64 "-%" PRIu64 " were not all allocated\n",
+              start, start + len - 1);
+      return -1;
+    }
+    release_lock_free(start, len);
+    return 0;
+  }
+
+  /* An extent can cross group boundaries. The groups are locked in
+   * ascending order, and allocations never hold more than one group
+   * lock, so this cannot deadlock.
+   */
+  uint64_t first = start / GROUP_BLOCKS;
+  uint64_t last = (start + len - 1) / GROUP_BLOCKS;
+  for (uint64_t g = first; g <= last; g++)
+    pthread_mutex_lock(&groups[g].lock);
+
+  int retval = 0;
+  if (!range_is_used(start, len)) {
+    fprintf(stderr, "Blocks %" PRIu64 "-%" PRIu64 " were not all allocated\n",
+            start, start + len - 1);
+    retval = -1;
+  } else {
+    for (uint64_t g = first; g <= last; g++) {
+      uint64_t lo = (start > groups[g].start) ? start : groups[g].start;
+      uint64_t hi = groups[g].start + groups[g].num_blocks;
+      if (hi > start + len)
+        hi = start + len;
+      if (give_back(&groups[g], lo, hi - lo) != 0)
+        retval = -1;
+    }
+  }
+
+  for (uint64_t g = last + 1; g-- > first;)
+    pthread_mutex_unlock(&groups[g].lock);
+  return retval;
+}
+
+int free_extents(const struct Extent *extents, int num_extents) {
+  int retval = 0;
+
+  for (int i = 0; i < num_extents; i++)
+    if (free_extent(extents[i].blockno, extents[i].extent) != 0)
+      retval = -1;
+  return retval;
 }
 
 void debug_disk() {
@@ -236,10 +2024,175 @@ void debug_disk() {
   }
 
   printf("Blocks recorded in the block allocation table:");
-  for (int i = 0; i < NUM_BLOCKS; i++) {
+  for (uint64_t i = 0; i < num_blocks; i++) {
     if (i % 20 == 0)
-      printf("\n%03d: ", i);
-    printf("%d", block_allocation_table[i]);
+      printf("\n%03" PRIu64 ": ", i);
+    printf("%d", (int)((block_allocation_table[i / BITS_PER_WORD] >>
+                        (i % BITS_PER_WORD)) & 1));
   }
   printf("\n\n");
 }
+
+uint64_t disk_num_blocks() {
+  if (block_allocation_table == NULL)
+    block_allocation_table = read_table();
+
+  return num_blocks;
+}
+
+uint32_t disk_block_size() {
+  if (block_allocation_table == NULL)
+    block_allocation_table = read_table();
+
+  return block_size;
+}
+
+uint64_t disk_free_blocks() {
+  if (prepare_table() != 0)
+    return 0;
+
+  return unreserved_free();
+}
+
+int read_disk_bitmap(uint64_t *words) {
+  if (prepare_table() != 0)
+    return -1;
+
+  for (uint64_t w = 0; w < num_words; w++)
+    words[w] = load_word(block_allocation_table, w);
+  if (num_blocks % BITS_PER_WORD)
+    words[num_words - 1] &= ((uint64_t)1 << (num_blocks % BITS_PER_WORD)) - 1;
+  return 0;
+}
+
+int disk_stats(struct disk_stats *stats) {
+  if (prepare_table() != 0)
+    return -1;
+
+  *stats = (struct disk_stats){.num_blocks = num_blocks,
+                               .block_size = block_size,
+                               .free_blocks = total_free(),
+                               .reserved_blocks = __atomic_load_n(
+                                   &reserved_count, __ATOMIC_RELAXED)};
+  stats->policy = (table_backend == BAT_BACKEND_BUDDY) ? "buddy"
+                  : (table_flags & BAT_LOCK_FREE)      ? "first"
+                                                       : policy->name;
+  stats->allocations = __atomic_load_n(&num_allocations, __ATOMIC_RELAXED);
+  stats->failed_allocations =
+      __atomic_load_n(&num_failed_allocations, __ATOMIC_RELAXED);
+  stats->allocated_extents =
+      __atomic_load_n(&num_allocated_extents, __ATOMIC_RELAXED);
+
+  /* The indexes keep runs that cross a group boundary in pieces, one
+   * per group. Hold all group locks, or buddy_lock, while the pieces
+   * that touch at the boundaries are counted as one run.
+   */
+  int buddy_backend = table_backend == BAT_BACKEND_BUDDY;
+  if (buddy_backend)
+    pthread_mutex_lock(&buddy_lock);
+  else
+    for (uint64_t g = 0; g < num_groups; g++)
+      pthread_mutex_lock(&groups[g].lock);
+
+  uint64_t runs[EXTENT_HISTOGRAM_BUCKETS];
+  for (unsigned k = 0; k < EXTENT_HISTOGRAM_BUCKETS; k++)
+    runs[k] = __atomic_load_n(&free_histogram.runs[k], __ATOMIC_RELAXED);
+
+  /* run is the length of the free run that reaches the end of group
+   * g-1, merged with the pieces before it.
+   */
+  uint64_t run = 0;
+  for (uint64_t g = 0; g < num_groups; g++) {
+    struct alloc_group *group = &groups[g];
+    uint64_t end = group->start + group->num_blocks;
+    struct free_extent *first = extent_index_find(&group->index, group->start);
+    struct free_extent *last = extent_index_find(&group->index, end - 1);
+
+    if (group->largest_hint > stats->largest_free_extent)
+      stats->largest_free_extent = group->largest_hint;
+
+    if (run > 0 && first != NULL) {
+      /* The piece at the start of the group continues the run. */
+      runs[extent_histogram_bucket(run)]--;
+      runs[extent_histogram_bucket(first->len)]--;
+      run += first->len;
+      runs[extent_histogram_bucket(run)]++;
+      if (run > stats->largest_free_extent)
+        stats->largest_free_extent = run;
+      if (first == last)
+        continue;
+    }
+    run = last ? last->len : 0;
+  }
+
+  if (buddy_backend)
+    pthread_mutex_unlock(&buddy_lock);
+  else
+    for (uint64_t g = num_groups; g-- > 0;)
+      pthread_mutex_unlock(&groups[g].lock);
+
+  for (unsigned k = 0; k < DISK_STATS_BUCKETS; k++) {
+    stats->extent_histogram[k] = runs[k];
+    stats->free_extents += runs[k];
+  }
+  return 0;
+}
+
+int sync_disk() {
+  if (block_allocation_table == NULL)
+    return 0;
+
+  if (mapping == NULL)
+    return write_table();
+
+  int retval = 0;
+  uint64_t pages = (mapping_size + page_size - 1) / page_size;
+
+  /* Take the dirty bits a word at a time, so that pages dirtied by
+   * other threads meanwhile stay marked, and msync() every run of
+   * consecutive dirty pages with one call.
+   */
+  uint64_t run_start = 0;
+  uint64_t run_len = 0;
+  for (uint64_t w = 0; w <= WORDS_FOR(pages); w++) {
+    uint64_t bits = 0;
+    if (w < WORDS_FOR(pages))
+      bits = __atomic_exchange_n(&dirty_pages[w], 0, __ATOMIC_ACQ_REL);
+
+    for (unsigned b = 0; b < BITS_PER_WORD; b++) {
+      if (bits & ((uint64_t)1 << b)) {
+        if (run_len == 0)
+          run_start = w * BITS_PER_WORD + b;
+        run_len++;
+        continue;
+      }
+      if (run_len == 0)
+        continue;
+
+      uint64_t offset = run_start * page_size;
+      uint64_t length = run_len * page_size;
+      if (offset + length > mapping_size)
+        length = mapping_size - offset;
+      if (msync(mapping + offset, length, MS_SYNC) != 0) {
+        fprintf(stderr, "Failed to sync %s (%s)\n", file_name,
+                strerror(errno));
+        retval = -1;
+      }
+      run_len = 0;
+    }
+  }
+  return retval;
+}
+
+void set_sync_interval(unsigned seconds) {
+  pthread_mutex_lock(&flusher_lock);
+  sync_interval = seconds;
+  if (flusher_running)
+    pthread_cond_signal(&flusher_wake);
+  pthread_mutex_unlock(&flusher_lock);
+
+  if (seconds == 0)
+    stop_flusher();
+  else
+    start_flusher();
+}
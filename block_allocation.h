@@ -1,15 +1,63 @@
 #ifndef ALLOCATION_H
 #define ALLOCATION_H
 
+#include <stdint.h>
+
+/* The geometry that format_disk() gives the simulated disk, and the
+ * block size assumed for table files in the old format.
+ */
 #define NUM_BLOCKS 80
 #define BLOCKSIZE 4096
 
+/* The limits for format_disk_with_geometry(). The block size must
+ * also be a power of two.
+ */
+#define MAX_NUM_BLOCKS 0xffffffffULL
+#define MIN_BLOCKSIZE 512
+#define MAX_BLOCKSIZE (1024 * 1024)
+
+/* The longest extent that can be allocated in one piece, the most
+ * that struct Extent can record.
+ */
+#define MAX_EXTENT_LEN UINT32_MAX
+
+/* A run of extent consecutive blocks starting at block blockno. */
+struct Extent {
+  uint32_t blockno;
+  uint32_t extent;
+};
+
 /* Set the name of block allocation table file.
  * This is necessary to have several examples in the same
  * directory.
+ * The table is written back at exit only if it was changed, so a
+ * table in the old format stays in that format until it is changed.
+ * With BAT_MAPPED it is converted when it is opened.
  */
 void set_block_allocation_table_name(const char *str);
 
+/* Flags for set_block_allocation_table_name_with_flags().
+ * BAT_MAPPED keeps the table in a shared mapping of its file instead
+ * of reading it into memory at start and writing all of it at exit.
+ * Only the pages that changed are written back, by sync_disk(), every
+ * sync interval or at exit.
+ */
+#define BAT_MAPPED 0x1
+
+/* BAT_LOCK_FREE allocates and frees blocks with compare-and-swap on
+ * the words of the table instead of locking allocation groups.
+ * Searches scan the table instead of an index of free runs, so they
+ * are slower on a fragmented disk, but threads never wait for each
+ * other to find and claim blocks. The index is only kept up to date
+ * for disk_stats(), under the lock of each group, after a claim.
+ */
+#define BAT_LOCK_FREE 0x2
+
+/* Like set_block_allocation_table_name(), with a combination of the
+ * BAT_ flags above.
+ */
+void set_block_allocation_table_name_with_flags(const char *str, int flags);
+
 /* Release the memory for the block allocation table file
  * name before exit().
  */
@@ -22,20 +70,260 @@ void release_block_allocation_table_name();
  */
 int format_disk();
 
+/* Like format_disk(), but the simulated disk gets num_blocks blocks
+ * of block_size bytes each. The geometry is stored in the block
+ * allocation table file and used whenever the file is loaded again.
+ * This function returns 0 in case of success and -1 if the geometry
+ * is not supported or the file cannot be written.
+ */
+int format_disk_with_geometry(uint64_t num_blocks, uint32_t block_size);
+
+/* The ways to keep track of the free blocks, chosen when the disk is
+ * formatted and stored in the table file.
+ * BAT_BACKEND_BITMAP finds the first free run that fits, from an index
+ * of the free runs in every allocation group. This is what
+ * format_disk() and format_disk_with_geometry() use.
+ * BAT_BACKEND_BUDDY keeps the free blocks in a buddy system: runs of
+ * 2^k blocks that start at a multiple of 2^k, merged with their
+ * neighbour of the same size when both are free. Allocating and
+ * freeing take O(log n) steps, and a run of 2^k blocks is always found
+ * while one is free. Allocations of other lengths take the next power
+ * of two and free the rest again, which leaves short runs that keep
+ * their neighbours from merging, so it suits disks that mostly hold
+ * objects of 2^k blocks. Goals are not used, and the disk is
+ * shared under a single lock, also with BAT_LOCK_FREE. The free runs
+ * are saved after the bitmap in the table file.
+ */
+enum bat_backend { BAT_BACKEND_BITMAP, BAT_BACKEND_BUDDY };
+
+/* Like format_disk_with_geometry(), with the given backend. */
+int format_disk_with_backend(uint64_t num_blocks, uint32_t block_size,
+                             enum bat_backend backend);
+
+/* Return the number of blocks and the block size of the simulated
+ * disk.
+ */
+uint64_t disk_num_blocks();
+uint32_t disk_block_size();
+
+/* Return the number of free blocks that are not reserved with
+ * reserve_blocks(). It is counted as blocks are allocated and freed,
+ * so this is cheap enough to call before every allocation.
+ */
+uint64_t disk_free_blocks();
+
+/* The histogram in struct disk_stats has one bucket per power of two,
+ * enough for runs of up to MAX_NUM_BLOCKS blocks.
+ */
+#define DISK_STATS_BUCKETS 32
+
+struct disk_stats {
+  uint64_t num_blocks;
+  uint32_t block_size;
+  uint64_t free_blocks;
+
+  /* The free blocks that are set aside by reserve_blocks(). */
+  uint64_t reserved_blocks;
+
+  /* The number of runs of free blocks, and the length of the longest
+   * one.
+   */
+  uint64_t free_extents;
+  uint64_t largest_free_extent;
+
+  /* extent_histogram[k] is the number of runs of 2^k to 2^(k+1)-1
+   * free blocks.
+   */
+  uint64_t extent_histogram[DISK_STATS_BUCKETS];
+
+  /* The allocation policy in use, "buddy" for BAT_BACKEND_BUDDY. */
+  const char *policy;
+
+  /* The calls to the allocation functions since the disk was formatted
+   * or loaded that succeeded and that failed, and the number of
+   * extents the successful ones returned. allocate_block() and
+   * allocate_block_near() return one extent.
+   */
+  uint64_t allocations;
+  uint64_t failed_allocations;
+  uint64_t allocated_extents;
+};
+
+/* Fill stats with the current state of the disk, like statfs().
+ * The counts are kept up to date by every allocation and release in
+ * the indexes of the allocation groups, with every mode and backend.
+ * A run that crosses group boundaries is counted once, so this takes
+ * time in the number of groups, not blocks, and briefly stops
+ * allocations.
+ * This function returns 0 in case of success and -1 if the table
+ * cannot be read.
+ */
+int disk_stats(struct disk_stats *stats);
+
+/* Copy the table into words, which must have room for
+ * (disk_num_blocks() + 63) / 64 words. Block i is bit (i % 64) of word
+ * (i / 64) and set if the block is in use; the bits after the last
+ * block are clear.
+ * This function returns 0 in case of success and -1 if the table
+ * cannot be read.
+ */
+int read_disk_bitmap(uint64_t *words);
+
+/* The allocation and free functions below can be called from several
+ * threads at once. The disk is split into allocation groups with a
+ * lock each, or shared without locks with BAT_LOCK_FREE, and every
+ * thread starts its searches in its own group, the first thread that
+ * allocates in group 0. Formatting, loading and sync_disk() must not
+ * run at the same time as other calls.
+ */
+
 /* Allocate extent_size consecutive blocks from the available
  * free disk blocks. It does not wrap.
  * Disk blocks are counted from 0 to max.
  * The function can return -1 if consecutive blocks like this
- * are available.
+ * are available, or if they lie beyond INT_MAX.
+ * A run longer than what any allocation group has free by itself is
+ * taken across group boundaries, the lowest one from the group of the
+ * calling thread on, without asking the allocation policy.
  */
 int allocate_block(int extent_size);
 
+/* The goal of an allocation that has no preferred place on disk. */
+#define NO_GOAL UINT64_MAX
+
+/* Like allocate_block(), but the blocks are placed as close after
+ * block goal as possible: at goal itself if the blocks from there on
+ * are free, else in the first free run after goal in the allocation
+ * group of goal, and only then in the other groups. A goal of NO_GOAL,
+ * or past the end of the disk, searches like allocate_block(), from
+ * the group of the calling thread.
+ */
+int allocate_block_near(uint64_t goal, int extent_size);
+
+/* Allocate nblocks blocks, in as few and as long runs as the free
+ * disk blocks allow, and store them in out_extents. Runs that follow
+ * each other on disk are stored as one extent, and runs longer than
+ * MAX_EXTENT_LEN blocks as several.
+ * The function returns the number of extents, or -1 if the blocks are
+ * not available or do not fit in max_extents extents. Nothing is
+ * allocated in that case.
+ */
+int allocate_extents(uint64_t nblocks, struct Extent *out_extents,
+                     int max_extents);
+
+/* Like allocate_extents(), with the runs placed near block goal as
+ * allocate_block_near() does.
+ */
+int allocate_extents_near(uint64_t goal, uint64_t nblocks,
+                          struct Extent *out_extents, int max_extents);
+
+struct extent_index;
+
+/* An allocation policy decides where in an allocation group the blocks
+ * of an allocation are taken. Every policy searches the same index of
+ * the free runs of the group, see extent_index.h, and the groups are
+ * visited in the same order for all of them: the group of the goal or
+ * of the calling thread first, then the ones after it.
+ * find() returns the first block of len free blocks in index, or
+ * UINT64_MAX if no run is long enough. from is the goal if it lies in
+ * the group, and the first block of the group otherwise. *cursor
+ * belongs to the policy, one per group, and is 0 when the groups are
+ * built. find() is called with the lock of the group held.
+ * allocate_extents() asks find() for a run that holds all remaining
+ * blocks and takes the longest run of the group if there is none.
+ * Policies are used by the bitmap backend without BAT_LOCK_FREE; the
+ * lock-free table is always searched first fit.
+ */
+struct alloc_policy {
+  const char *name;
+  uint64_t (*find)(const struct extent_index *index, uint64_t from,
+                   uint64_t len, uint64_t *cursor);
+};
+
+/* The built-in policies are
+ * "first": the first run from from on that fits, at from itself if it
+ *          does, and then from the start of the group. The default.
+ * "next":  like "first", but from where the last allocation in the
+ *          group ended if that is after from, so that the free space
+ *          is used in turn.
+ * "best":  the shortest run that fits, which keeps long runs whole.
+ * "worst": the longest run, which leaves rests that are long enough to
+ *          be used again.
+ * register_alloc_policy() adds another one, up to MAX_ALLOC_POLICIES
+ * in total. policy must stay valid until exit.
+ * This function returns 0 in case of success and -1 if a policy of the
+ * same name exists or there is no room for another one.
+ */
+#define MAX_ALLOC_POLICIES 16
+
+int register_alloc_policy(const struct alloc_policy *policy);
+
+/* Use the policy with the given name for the disk. The choice is kept
+ * when the disk is formatted or loaded again, and must not be changed
+ * while other threads allocate.
+ * This function returns 0 in case of success and -1 if there is no
+ * policy of that name.
+ */
+int set_alloc_policy(const char *name);
+
+/* Set nblocks free blocks aside without choosing them yet. Reserved
+ * blocks are not counted by disk_free_blocks() and cannot be taken by
+ * the allocation functions above, only by allocate_reserved_extents().
+ * Formatting or loading a table drops all reservations.
+ * This function returns 0 in case of success and -1 if fewer blocks
+ * are free.
+ */
+int reserve_blocks(uint64_t nblocks);
+
+/* Give back nblocks blocks that were set aside by reserve_blocks(). */
+void unreserve_blocks(uint64_t nblocks);
+
+/* Like allocate_extents(), for nblocks blocks that were set aside by
+ * reserve_blocks() before. The reservation is used up if the blocks
+ * are allocated and kept otherwise.
+ */
+int allocate_reserved_extents(uint64_t nblocks, struct Extent *out_extents,
+                              int max_extents);
+
+/* Undo allocate_reserved_extents(): free the extents and set their
+ * blocks aside again, so that no other allocation can take them in
+ * between.
+ * The function returns 0 if all extents were freed and -1 otherwise,
+ * in which case only the blocks that were freed are set aside.
+ */
+int free_reserved_extents(const struct Extent *extents, int num_extents);
+
 /* Free the block with the given ID.
  * This functions returns 0 if the block was freed
  * or -1 if the block with this ID was not allocated
  */
 int free_block(int block);
 
+/* Free the len blocks starting at block start.
+ * This function returns 0 if the blocks were freed or -1 if they
+ * are out of range or not all allocated. Nothing is freed in that
+ * case.
+ */
+int free_extent(uint64_t start, uint64_t len);
+
+/* Free every extent in the array extents, like free_extent().
+ * Extents that cannot be freed are skipped. The function returns 0
+ * if all extents were freed and -1 otherwise.
+ */
+int free_extents(const struct Extent *extents, int num_extents);
+
+/* Write the changes to the block allocation table to its file. For a
+ * mapped table only the changed pages are written.
+ * This function returns 0 in case of success and -1 otherwise.
+ */
+int sync_disk();
+
+/* Make a thread write the changes to a mapped table back every
+ * seconds seconds. 0, the default, stops it, and only writes them in
+ * sync_disk() and at exit.
+ */
+void set_sync_interval(unsigned seconds);
+
 /* This debug function prints the table to stdout. */
 void debug_disk();
 
@@ -0,0 +1,253 @@
+#include "block_cache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The lists of a cache. */
+enum { T1, T2, B1, B2 };
+
+static uint64_t bucket(const struct block_cache *cache, uint64_t block) {
+  return (block * 0x9e3779b97f4a7c15ull >> 17) & (cache->num_buckets - 1);
+}
+
+static struct cache_entry *find(const struct block_cache *cache,
+                                uint64_t block) {
+  struct cache_entry *e = cache->buckets[bucket(cache, block)];
+  while (e != NULL && e->block != block)
+    e = e->hash_next;
+  return e;
+}
+
+static void list_remove(struct block_cache *cache, struct cache_entry *e) {
+  struct cache_list *list = &cache->lists[e->list];
+
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    list->head = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    list->tail = e->prev;
+  list->len--;
+}
+
+/* Makes e the most recently used entry of list. */
+static void list_append(struct block_cache *cache, struct cache_entry *e,
+                        int list) {
+  struct cache_list *l = &cache->lists[list];
+
+  e->list = list;
+  e->prev = l->tail;
+  e->next = NULL;
+  if (l->tail != NULL)
+    l->tail->next = e;
+  else
+    l->head = e;
+  l->tail = e;
+  l->len++;
+}
+
+static void release_data(struct block_cache *cache, struct cache_entry *e) {
+  if (e->data != NULL)
+    cache->free_data[cache->num_free_data++] = e->data;
+  e->data = NULL;
+}
+
+/* Takes e out of its list and the hash table, and gives back its
+ * entry and buffer.
+ */
+static void release_entry(struct block_cache *cache, struct cache_entry *e) {
+  struct cache_entry **p = &cache->buckets[bucket(cache, e->block)];
+
+  while (*p != e)
+    p = &(*p)->hash_next;
+  *p = e->hash_next;
+
+  list_remove(cache, e);
+  release_data(cache, e);
+  e->next = cache->free_entries;
+  cache->free_entries = e;
+}
+
+/* Returns a new entry for block with a buffer, in the hash table but
+ * in no list.
+ */
+static struct cache_entry *new_entry(struct block_cache *cache,
+                                     uint64_t block) {
+  struct cache_entry *e = cache->free_entries;
+  uint64_t b = bucket(cache, block);
+
+  cache->free_entries = e->next;
+  e->block = block;
+  e->data = cache->free_data[--cache->num_free_data];
+  e->hash_next = cache->buckets[b];
+  cache->buckets[b] = e;
+  return e;
+}
+
+/* Evicts the least recently used block of list from, and remembers
+ * its number in the ghost list to.
+ */
+static void demote(struct block_cache *cache, int from, int to) {
+  struct cache_entry *e = cache->lists[from].head;
+
+  list_remove(cache, e);
+  release_data(cache, e);
+  list_append(cache, e, to);
+  cache->stats.evictions++;
+}
+
+/* The REPLACE step of ARC: evicts a block from T1 if it is longer than
+ * its target, and from T2 otherwise. Only a full cache evicts.
+ */
+static void replace(struct block_cache *cache, int in_b2) {
+  uint64_t t1 = cache->lists[T1].len;
+
+  if (cache->num_free_data > 0)
+    return;
+  if (t1 >= 1 && ((in_b2 && t1 == cache->target) || t1 > cache->target ||
+                  cache->lists[T2].len == 0))
+    demote(cache, T1, B1);
+  else
+    demote(cache, T2, B2);
+}
+
+int block_cache_init(struct block_cache *cache, uint64_t capacity,
+                     uint32_t block_size, enum block_cache_policy policy) {
+  /* ARC remembers as many evicted blocks as it holds. */
+  uint64_t num_entries = (policy == BLOCK_CACHE_ARC) ? 2 * capacity : capacity;
+
+  memset(cache, 0, sizeof(*cache));
+  cache->policy = policy;
+  cache->capacity = capacity;
+  cache->block_size = block_size;
+  cache->num_buckets = 1;
+  while (cache->num_buckets < num_entries)
+    cache->num_buckets *= 2;
+
+  cache->buckets = malloc(cache->num_buckets * sizeof(struct cache_entry *));
+  cache->entries = malloc(num_entries * sizeof(struct cache_entry));
+  cache->free_data = malloc(capacity * sizeof(char *));
+  cache->data = malloc(capacity * block_size);
+  if (capacity == 0 || cache->buckets == NULL || cache->entries == NULL ||
+      cache->free_data == NULL || cache->data == NULL) {
+    block_cache_destroy(cache);
+    return -1;
+  }
+
+  block_cache_clear(cache);
+  return 0;
+}
+
+void block_cache_destroy(struct block_cache *cache) {
+  free(cache->buckets);
+  free(cache->entries);
+  free(cache->free_data);
+  free(cache->data);
+  memset(cache, 0, sizeof(*cache));
+}
+
+void block_cache_clear(struct block_cache *cache) {
+  uint64_t num_entries =
+      (cache->policy == BLOCK_CACHE_ARC) ? 2 * cache->capacity
+                                         : cache->capacity;
+
+  memset(cache->lists, 0, sizeof(cache->lists));
+  memset(cache->buckets, 0, cache->num_buckets * sizeof(struct cache_entry *));
+  cache->target = 0;
+
+  cache->free_entries = NULL;
+  for (uint64_t i = num_entries; i > 0; i--) {
+    cache->entries[i - 1].next = cache->free_entries;
+    cache->free_entries = &cache->entries[i - 1];
+  }
+  for (uint64_t i = 0; i < cache->capacity; i++)
+    cache->free_data[i] = cache->data + i * cache->block_size;
+  cache->num_free_data = cache->capacity;
+
+  memset(&cache->stats, 0, sizeof(cache->stats));
+  cache->stats.capacity = cache->capacity;
+}
+
+char *block_cache_lookup(struct block_cache *cache, uint64_t block) {
+  struct cache_entry *e = find(cache, block);
+
+  if (e == NULL || e->data == NULL)
+    return NULL;
+
+  cache->stats.hits++;
+  list_remove(cache, e);
+  list_append(cache, e, cache->policy == BLOCK_CACHE_ARC ? T2 : T1);
+  return e->data;
+}
+
+char *block_cache_peek(struct block_cache *cache, uint64_t block) {
+  struct cache_entry *e = find(cache, block);
+  return e != NULL ? e->data : NULL;
+}
+
+char *block_cache_insert(struct block_cache *cache, uint64_t block) {
+  struct cache_list *lists = cache->lists;
+  struct cache_entry *e = find(cache, block);
+
+  cache->stats.misses++;
+
+  if (cache->policy == BLOCK_CACHE_LRU) {
+    if (cache->num_free_data == 0) {
+      release_entry(cache, lists[T1].head);
+      cache->stats.evictions++;
+    }
+    e = new_entry(cache, block);
+    list_append(cache, e, T1);
+    cache->stats.blocks = lists[T1].len;
+    return e->data;
+  }
+
+  if (e != NULL) {
+    /* A block that was evicted not long ago: the list it was evicted
+     * from was too short, and it has now been used twice.
+     */
+    if (e->list == B1) {
+      uint64_t delta = lists[B2].len / lists[B1].len;
+      if (delta < 1)
+        delta = 1;
+      cache->target = (cache->target + delta < cache->capacity)
+                          ? cache->target + delta
+                          : cache->capacity;
+      replace(cache, 0);
+    } else {
+      uint64_t delta = lists[B1].len / lists[B2].len;
+      if (delta < 1)
+        delta = 1;
+      cache->target = (cache->target > delta) ? cache->target - delta : 0;
+      replace(cache, 1);
+    }
+    list_remove(cache, e);
+    e->data = cache->free_data[--cache->num_free_data];
+    list_append(cache, e, T2);
+  } else {
+    uint64_t l1 = lists[T1].len + lists[B1].len;
+    uint64_t total = l1 + lists[T2].len + lists[B2].len;
+
+    if (l1 == cache->capacity) {
+      if (lists[T1].len < cache->capacity) {
+        release_entry(cache, lists[B1].head);
+        replace(cache, 0);
+      } else {
+        release_entry(cache, lists[T1].head);
+        cache->stats.evictions++;
+      }
+    } else if (total >= cache->capacity) {
+      if (total == 2 * cache->capacity)
+        release_entry(cache, lists[B2].head);
+      replace(cache, 0);
+    }
+    e = new_entry(cache, block);
+    list_append(cache, e, T1);
+  }
+
+  cache->stats.blocks = lists[T1].len + lists[T2].len;
+  return e->data;
+}
@@ -0,0 +1,114 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+
+/* How a full cache picks the block to evict.
+ * BLOCK_CACHE_ARC is the adaptive replacement cache of Megiddo and
+ * Modha: blocks that were read once and blocks that were read again
+ * are kept in two lists, and the block numbers evicted from each are
+ * remembered for as long again. A hit on a remembered block grows the
+ * share of the list it was evicted from. A scan that reads every block
+ * once only ever replaces blocks of the first list, so the blocks that
+ * are read again stay.
+ * BLOCK_CACHE_LRU evicts the least recently used block, and is only
+ * there to compare with.
+ */
+enum block_cache_policy { BLOCK_CACHE_ARC, BLOCK_CACHE_LRU };
+
+/* A block in the cache, or the block number of one that was evicted
+ * (data is NULL then). Every entry is in one of the four lists of the
+ * cache and in a chain of its hash table.
+ */
+struct cache_entry {
+  uint64_t block;
+  char *data;
+  int list;
+
+  struct cache_entry *prev;
+  struct cache_entry *next;
+  struct cache_entry *hash_next;
+};
+
+/* A list of entries from least (head) to most (tail) recently used. */
+struct cache_list {
+  struct cache_entry *head;
+  struct cache_entry *tail;
+  uint64_t len;
+};
+
+/* The counters of a cache. A hit is a block that was found by
+ * block_cache_lookup(), a miss one that was added by
+ * block_cache_insert(), and an eviction a block that made room for
+ * another one.
+ */
+struct block_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t blocks;
+  uint64_t capacity;
+};
+
+/* A cache of up to capacity blocks of block_size bytes each, keyed by
+ * block number. The block buffers are allocated together when the
+ * cache is set up. A cache is not safe to use from several threads at
+ * once.
+ */
+struct block_cache {
+  enum block_cache_policy policy;
+  uint64_t capacity;
+  uint32_t block_size;
+
+  /* T1, T2, B1 and B2 of ARC: resident blocks seen once and more than
+   * once, and the ghosts evicted from each. LRU only uses T1.
+   */
+  struct cache_list lists[4];
+  /* The target length of T1. */
+  uint64_t target;
+
+  struct cache_entry **buckets;
+  uint64_t num_buckets;
+
+  /* Unused entries and block buffers. */
+  struct cache_entry *free_entries;
+  char **free_data;
+  uint64_t num_free_data;
+
+  struct cache_entry *entries;
+  char *data;
+
+  struct block_cache_stats stats;
+};
+
+/* Set up cache for capacity >= 1 blocks of block_size bytes.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+int block_cache_init(struct block_cache *cache, uint64_t capacity,
+                     uint32_t block_size, enum block_cache_policy policy);
+
+/* Release the memory of cache. */
+void block_cache_destroy(struct block_cache *cache);
+
+/* Drop all blocks and remembered block numbers, and reset the
+ * counters.
+ */
+void block_cache_clear(struct block_cache *cache);
+
+/* Return the data of block and count a hit, or NULL if the block is
+ * not in the cache. A hit makes the block the most recently used.
+ */
+char *block_cache_lookup(struct block_cache *cache, uint64_t block);
+
+/* Return the data of block if it is in the cache, or NULL, without
+ * counting it or changing which block is evicted next.
+ */
+char *block_cache_peek(struct block_cache *cache, uint64_t block);
+
+/* Add block, which is not in the cache, count a miss, and return the
+ * buffer the caller must fill with its data. This may evict the least
+ * valuable block.
+ */
+char *block_cache_insert(struct block_cache *cache, uint64_t block);
+
+#endif // BLOCK_CACHE_H
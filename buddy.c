@@ -0,0 +1,127 @@
+#include "buddy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void link_head(struct buddy *b, uint64_t start, unsigned order) {
+  b->order[start] = order;
+  b->prev[start] = BUDDY_NIL;
+  b->next[start] = b->first[order];
+  if (b->first[order] != BUDDY_NIL)
+    b->prev[b->first[order]] = start;
+  b->first[order] = start;
+  b->num_heads[order]++;
+}
+
+static void unlink_head(struct buddy *b, uint64_t start) {
+  unsigned order = b->order[start];
+
+  if (b->prev[start] != BUDDY_NIL)
+    b->next[b->prev[start]] = b->next[start];
+  else
+    b->first[order] = b->next[start];
+  if (b->next[start] != BUDDY_NIL)
+    b->prev[b->next[start]] = b->prev[start];
+  b->order[start] = BUDDY_NOT_HEAD;
+  b->num_heads[order]--;
+}
+
+int buddy_init(struct buddy *b, uint64_t num_blocks) {
+  *b = (struct buddy){.num_blocks = num_blocks};
+  b->order = malloc(num_blocks);
+  b->next = malloc(num_blocks * sizeof(uint32_t));
+  b->prev = malloc(num_blocks * sizeof(uint32_t));
+  if (b->order == NULL || b->next == NULL || b->prev == NULL) {
+    buddy_release(b);
+    return -1;
+  }
+
+  memset(b->order, BUDDY_NOT_HEAD, num_blocks);
+  for (unsigned k = 0; k < BUDDY_ORDERS; k++)
+    b->first[k] = BUDDY_NIL;
+  return 0;
+}
+
+void buddy_release(struct buddy *b) {
+  free(b->order);
+  free(b->next);
+  free(b->prev);
+  *b = (struct buddy){0};
+}
+
+/* Adds the free head [start, start+2^order) and merges it with its
+ * buddy for as long as the buddy is free.
+ */
+static void free_head(struct buddy *b, uint64_t start, unsigned order) {
+  while (order + 1 < BUDDY_ORDERS) {
+    uint64_t buddy = start ^ ((uint64_t)1 << order);
+    if (buddy >= b->num_blocks || b->order[buddy] != order)
+      break;
+    unlink_head(b, buddy);
+    if (buddy < start)
+      start = buddy;
+    order++;
+  }
+  link_head(b, start, order);
+}
+
+void buddy_free(struct buddy *b, uint64_t start, uint64_t len) {
+  b->free_blocks += len;
+
+  /* Cut the blocks into the longest aligned heads. */
+  while (len > 0) {
+    unsigned order = 63 - __builtin_clzll(len);
+    if (start != 0 && (unsigned)__builtin_ctzll(start) < order)
+      order = __builtin_ctzll(start);
+    if (order >= BUDDY_ORDERS)
+      order = BUDDY_ORDERS - 1;
+
+    free_head(b, start, order);
+    start += (uint64_t)1 << order;
+    len -= (uint64_t)1 << order;
+  }
+}
+
+int buddy_add_head(struct buddy *b, uint64_t start, unsigned order) {
+  if (order >= BUDDY_ORDERS || start % ((uint64_t)1 << order) != 0 ||
+      start + ((uint64_t)1 << order) > b->num_blocks ||
+      b->order[start] != BUDDY_NOT_HEAD)
+    return -1;
+
+  link_head(b, start, order);
+  b->free_blocks += (uint64_t)1 << order;
+  return 0;
+}
+
+uint64_t buddy_alloc(struct buddy *b, uint64_t len) {
+  unsigned need = (len > 1) ? 64 - __builtin_clzll(len - 1) : 0;
+  unsigned order = need;
+
+  while (order < BUDDY_ORDERS && b->first[order] == BUDDY_NIL)
+    order++;
+  if (order >= BUDDY_ORDERS)
+    return b->num_blocks;
+
+  uint64_t start = b->first[order];
+  unlink_head(b, start);
+
+  /* Keep the lower half and free the upper one until the head has the
+   * order that was asked for.
+   */
+  while (order > need) {
+    order--;
+    link_head(b, start + ((uint64_t)1 << order), order);
+  }
+  b->free_blocks -= (uint64_t)1 << order;
+
+  if (len < (uint64_t)1 << order)
+    buddy_free(b, start + len, ((uint64_t)1 << order) - len);
+  return start;
+}
+
+int buddy_largest_order(const struct buddy *b) {
+  for (int k = BUDDY_ORDERS - 1; k >= 0; k--)
+    if (b->first[k] != BUDDY_NIL)
+      return k;
+  return -1;
+}
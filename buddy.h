@@ -0,0 +1,69 @@
+#ifndef BUDDY_H
+#define BUDDY_H
+
+#include <stdint.h>
+
+/* A buddy system over the blocks [0, num_blocks) of a disk.
+ * The free blocks are kept as heads: runs of 2^k blocks that start at
+ * a multiple of 2^k, k is the order of the head. There is one list of
+ * heads per order. The buddy of a head of order k is the head of the
+ * same order whose start differs only in bit k; two free buddies are
+ * always merged into one head of order k+1, so allocating and freeing
+ * take O(log n) steps.
+ * A disk whose size is not a power of two ends in heads that have no
+ * buddy and are never merged.
+ */
+#define BUDDY_ORDERS 32
+
+struct buddy {
+  uint64_t num_blocks;
+  uint64_t free_blocks;
+
+  /* order[b] is the order of the head that starts at block b, or
+   * BUDDY_NOT_HEAD. next[b] and prev[b] link the heads of one order,
+   * first[k] is the first head of order k. BUDDY_NIL ends the lists.
+   */
+  uint8_t *order;
+  uint32_t *next;
+  uint32_t *prev;
+  uint32_t first[BUDDY_ORDERS];
+  uint64_t num_heads[BUDDY_ORDERS];
+};
+
+#define BUDDY_NOT_HEAD 0xff
+#define BUDDY_NIL UINT32_MAX
+
+/* Make b a buddy system for num_blocks blocks that are all in use.
+ * num_blocks must be less than 2^32.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+int buddy_init(struct buddy *b, uint64_t num_blocks);
+
+/* Release the memory of b. */
+void buddy_release(struct buddy *b);
+
+/* Add the blocks [start, start+len) to the free heads, merging them
+ * with their buddies. The blocks must not be free already.
+ */
+void buddy_free(struct buddy *b, uint64_t start, uint64_t len);
+
+/* Add the free head of the given order at block start, without
+ * merging it. This restores heads that were saved with their order.
+ * Returns 0 on success and -1 if start is not aligned to the order,
+ * the head does not fit on the disk or another head starts at start.
+ */
+int buddy_add_head(struct buddy *b, uint64_t start, unsigned order);
+
+/* Take len blocks from the smallest head of at least len blocks,
+ * splitting it in halves as far as possible. The blocks of the last
+ * half that are not used are freed again.
+ * Returns the first block, or num_blocks if no head is long enough.
+ */
+uint64_t buddy_alloc(struct buddy *b, uint64_t len);
+
+/* Return the order of the longest free head, or -1 if there are no
+ * free blocks.
+ */
+int buddy_largest_order(const struct buddy *b);
+
+#endif // BUDDY_H
@@ -0,0 +1,332 @@
+#include "block_allocation.h"
+#include "disk_data.h"
+#include "inode.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* A small disk, and files of a few blocks with ends that are not
+ * block aligned.
+ */
+#define DATA_BLOCKS 1024
+#define FILE_BYTES (4 * BLOCKSIZE)
+
+/* The round trip writes in pieces that do not line up with blocks,
+ * through a cache and write-back that hold less than the largest file.
+ */
+#define ROUND_TRIP_FILES 4
+#define WRITE_PIECE 1000
+#define READ_PIECE 5000
+#define CACHE_BYTES (16 * BLOCKSIZE)
+#define WRITE_BACK_BYTES (8 * BLOCKSIZE)
+
+/* A sparse file that is larger than what is written to it. */
+#define SPARSE_BYTES (64 * BLOCKSIZE + 500)
+
+static int failures = 0;
+
+static void expect(int ok, const char *what) {
+  printf("%-45s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok)
+    failures++;
+}
+
+/* Byte i of the file with the given seed. */
+static void fill_pattern(char *buf, uint64_t len, unsigned seed) {
+  for (uint64_t i = 0; i < len; i++)
+    buf[i] = (char)((i * 31 + seed * 7) % 251 + 1);
+}
+
+/* Reads all of the data file, past the block cache and write-back,
+ * into a new buffer and stores its size in *size.
+ */
+static char *read_data_file(const char *data_name, size_t *size) {
+  struct stat st;
+  int fd = open(data_name, O_RDONLY);
+  char *buf = NULL;
+
+  if (fd >= 0 && fstat(fd, &st) == 0)
+    buf = malloc(st.st_size + 1);
+  if (buf != NULL && pread(fd, buf, st.st_size, 0) != st.st_size) {
+    free(buf);
+    buf = NULL;
+  }
+  if (buf != NULL)
+    *size = st.st_size;
+  if (fd >= 0)
+    close(fd);
+  return buf;
+}
+
+/* A partial-block write with write-back that cannot read the rest of
+ * its block must fail without leaving anything to write back. The
+ * descriptor of the data file is swapped for a write-only one to make
+ * the read fail.
+ */
+static void check_failed_write(struct inode *root, const char *data_name,
+                               int fd) {
+  struct inode *file = create_file(root, "failed-write", 0, FILE_BYTES);
+  char *pattern = malloc(FILE_BYTES);
+  char junk[100];
+  size_t before_size = 0;
+  size_t after_size = 0;
+
+  fill_pattern(pattern, FILE_BYTES, 1);
+  memset(junk, 'x', sizeof(junk));
+  expect(file != NULL && write_file(file, 0, pattern, FILE_BYTES) ==
+                             FILE_BYTES && disk_sync() == 0,
+         "write a file");
+  char *before = read_data_file(data_name, &before_size);
+
+  struct stat opened, named;
+  int write_only = open(data_name, O_WRONLY);
+  int saved = dup(fd);
+  expect(fstat(fd, &opened) == 0 && stat(data_name, &named) == 0 &&
+             opened.st_ino == named.st_ino && write_only >= 0 &&
+             saved >= 0 && dup2(write_only, fd) == fd,
+         "make the data file unreadable");
+  expect(disk_write_back_enable(16 * BLOCKSIZE) == 0, "enable write-back");
+  expect(write_file(file, BLOCKSIZE + 10, junk, sizeof(junk)) == -1,
+         "partial-block write fails");
+  dup2(saved, fd);
+  close(saved);
+  close(write_only);
+
+  expect(disk_sync() == 0 && disk_write_back_disable() == 0,
+         "write back after the failure");
+  char *after = read_data_file(data_name, &after_size);
+  expect(before != NULL && after != NULL && before_size == after_size &&
+             memcmp(before, after, before_size) == 0,
+         "data file is unchanged");
+
+  free(before);
+  free(after);
+  free(pattern);
+}
+
+/* Returns 1 if the len bytes of file from off on are those in want. */
+static int same_contents(struct inode *file, uint64_t off, const char *want,
+                         uint64_t len) {
+  char *buf = malloc(len);
+  int same = buf != NULL && read_file(file, off, buf, len) == (ssize_t)len &&
+             memcmp(buf, want, len) == 0;
+
+  free(buf);
+  return same;
+}
+
+/* Files are written in small pieces and read back with read_file(),
+ * read_files() and file_reader_read(), with the block cache and
+ * write-back on, and then once more from the data file alone.
+ */
+static void check_round_trip(struct inode *root) {
+  const uint64_t sizes[ROUND_TRIP_FILES] = {100, BLOCKSIZE,
+                                            3 * BLOCKSIZE + 17,
+                                            40 * BLOCKSIZE + 1000};
+  struct inode *files[ROUND_TRIP_FILES];
+  char *want[ROUND_TRIP_FILES];
+  void *bufs[ROUND_TRIP_FILES];
+  char name[32];
+  int ok = 1;
+
+  expect(disk_cache_enable(CACHE_BYTES, BLOCK_CACHE_ARC) == 0 &&
+             disk_write_back_enable(WRITE_BACK_BYTES) == 0,
+         "enable the cache and write-back");
+
+  for (int i = 0; i < ROUND_TRIP_FILES; i++) {
+    snprintf(name, sizeof(name), "round-trip-%d", i);
+    files[i] = create_file(root, name, 0, sizes[i]);
+    want[i] = malloc(sizes[i]);
+    bufs[i] = malloc(sizes[i]);
+    fill_pattern(want[i], sizes[i], i + 2);
+    for (uint64_t off = 0; ok && off < sizes[i]; off += WRITE_PIECE) {
+      uint64_t n = sizes[i] - off < WRITE_PIECE ? sizes[i] - off : WRITE_PIECE;
+      ok = files[i] != NULL &&
+           write_file(files[i], off, want[i] + off, n) == (ssize_t)n;
+    }
+  }
+  expect(ok, "write files in pieces");
+
+  ok = 1;
+  for (int i = 0; i < ROUND_TRIP_FILES; i++)
+    ok = ok && same_contents(files[i], 0, want[i], sizes[i]);
+  expect(ok, "read back with read_file");
+
+  ok = read_files(files, ROUND_TRIP_FILES, bufs) == 0;
+  for (int i = 0; i < ROUND_TRIP_FILES; i++)
+    ok = ok && memcmp(bufs[i], want[i], sizes[i]) == 0;
+  expect(ok, "read back with read_files");
+
+  struct file_reader reader;
+  int last = ROUND_TRIP_FILES - 1;
+  ok = 1;
+  file_reader_open(&reader, files[last]);
+  for (uint64_t off = 0; ok && off < sizes[last]; off += READ_PIECE) {
+    uint64_t n = sizes[last] - off < READ_PIECE ? sizes[last] - off
+                                                : READ_PIECE;
+    ok = file_reader_read(&reader, off, (char *)bufs[last] + off, n) ==
+         (ssize_t)n;
+  }
+  expect(ok && memcmp(bufs[last], want[last], sizes[last]) == 0,
+         "read back with readahead");
+
+  fill_pattern(want[last] + 5 * BLOCKSIZE + 300, 3 * BLOCKSIZE, 9);
+  expect(write_file(files[last], 5 * BLOCKSIZE + 300,
+                    want[last] + 5 * BLOCKSIZE + 300,
+                    3 * BLOCKSIZE) == 3 * BLOCKSIZE &&
+             same_contents(files[last], 0, want[last], sizes[last]),
+         "overwrite across blocks");
+
+  struct block_cache_stats cache_stats;
+  struct write_back_stats write_back_stats;
+  disk_cache_stats(&cache_stats);
+  disk_write_back_stats(&write_back_stats);
+  expect(cache_stats.hits > 0 && write_back_stats.blocks_flushed > 0,
+         "cache and write-back were used");
+
+  expect(fs_sync() == 0 && disk_write_back_disable() == 0,
+         "write back and sync");
+  disk_cache_disable();
+  ok = 1;
+  for (int i = 0; i < ROUND_TRIP_FILES; i++)
+    ok = ok && same_contents(files[i], 0, want[i], sizes[i]);
+  expect(ok, "read back from the data file");
+
+  for (int i = 0; i < ROUND_TRIP_FILES; i++) {
+    free(want[i]);
+    free(bufs[i]);
+  }
+}
+
+/* Parts of a sparse file are written and holes punched in it and in a
+ * file that has all its blocks; what is not written reads as zeros.
+ */
+static void check_sparse(struct inode *root) {
+  struct inode *sparse = create_sparse_file(root, "sparse", 0, SPARSE_BYTES);
+  struct inode *file = create_file(root, "punched", 0, FILE_BYTES);
+  char *want = calloc(1, SPARSE_BYTES);
+  char *pattern = malloc(SPARSE_BYTES);
+
+  fill_pattern(pattern, SPARSE_BYTES, 5);
+  expect(sparse != NULL && file != NULL && (*sparse).num_entries == 1,
+         "create a sparse file");
+
+  memcpy(want + 10 * BLOCKSIZE + 100, pattern, 3 * BLOCKSIZE);
+  memcpy(want + 40 * BLOCKSIZE, pattern, 5);
+  expect(write_file(sparse, 10 * BLOCKSIZE + 100, pattern, 3 * BLOCKSIZE) ==
+                 3 * BLOCKSIZE &&
+             write_file(sparse, 40 * BLOCKSIZE, pattern, 5) == 5 &&
+             same_contents(sparse, 0, want, SPARSE_BYTES),
+         "write into the holes");
+
+  memset(want + 11 * BLOCKSIZE + 50, 0, 2 * BLOCKSIZE);
+  expect(punch_hole(sparse, 11 * BLOCKSIZE + 50, 2 * BLOCKSIZE) == 0 &&
+             same_contents(sparse, 0, want, SPARSE_BYTES),
+         "punch a hole in the middle");
+
+  memset(want + 40 * BLOCKSIZE - 10, 0,
+         SPARSE_BYTES - (40 * BLOCKSIZE - 10));
+  expect(punch_hole(sparse, 40 * BLOCKSIZE - 10, SPARSE_BYTES) == 0 &&
+             same_contents(sparse, 0, want, SPARSE_BYTES),
+         "punch a hole to the end");
+
+  fill_pattern(pattern, FILE_BYTES, 6);
+  memset(pattern + BLOCKSIZE / 2, 0, 2 * BLOCKSIZE);
+  expect(write_file(file, 0, pattern, BLOCKSIZE / 2) == BLOCKSIZE / 2 &&
+             write_file(file, 5 * BLOCKSIZE / 2, pattern + 5 * BLOCKSIZE / 2,
+                        FILE_BYTES - 5 * BLOCKSIZE / 2) ==
+                 FILE_BYTES - 5 * BLOCKSIZE / 2 &&
+             punch_hole(file, BLOCKSIZE / 2, 2 * BLOCKSIZE) == 0 &&
+             (*file).num_entries == 3 &&
+             same_contents(file, 0, pattern, FILE_BYTES),
+         "punch a hole in a full file");
+
+  expect(fs_sync() == 0, "sync");
+  free(want);
+  free(pattern);
+}
+
+/* Without a data file, holes can still be punched, and reading them
+ * only fills the buffer with zeros.
+ */
+static void check_no_data_file(struct inode *root) {
+  struct inode *file = create_file(root, "no-data", 0, FILE_BYTES);
+  struct inode *sparse = create_sparse_file(root, "no-data-sparse", 0,
+                                            FILE_BYTES);
+  char *buf = malloc(FILE_BYTES);
+  char *zeros = calloc(1, FILE_BYTES);
+
+  expect(file != NULL && sparse != NULL, "create files");
+  expect(punch_hole(file, BLOCKSIZE / 2, 2 * BLOCKSIZE) == 0,
+         "punch a hole");
+  expect(file != NULL && (*file).num_entries == 3,
+         "middle block is a hole");
+  memset(buf, 'x', FILE_BYTES);
+  expect(read_file(sparse, 0, buf, FILE_BYTES) == FILE_BYTES &&
+             memcmp(buf, zeros, FILE_BYTES) == 0,
+         "sparse file reads as zeros");
+
+  free(buf);
+  free(zeros);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 5) {
+    fprintf(stderr,
+            "Usage: %s MFT BAT DATA MODE\n"
+            "       where\n"
+            "       MFT is the name of the master_file_table\n"
+            "       BAT is the name of the block allocation table\n"
+            "       DATA is the name of the data file\n"
+            "       MODE is round-trip, sparse, failed-write or "
+            "no-data-file\n",
+            argv[0]);
+    exit(-1);
+  }
+
+  char *mft_name = argv[1];
+  char *bat_name = argv[2];
+  char *data_name = argv[3];
+  char *mode = argv[4];
+
+  void (*check)(struct inode *root) = NULL;
+  int data_file = strcmp(mode, "no-data-file") != 0;
+  if (strcmp(mode, "round-trip") == 0) {
+    check = check_round_trip;
+  } else if (strcmp(mode, "sparse") == 0) {
+    check = check_sparse;
+  } else if (strcmp(mode, "no-data-file") == 0) {
+    check = check_no_data_file;
+  } else if (strcmp(mode, "failed-write") != 0) {
+    fprintf(stderr, "Unknown mode %s\n", mode);
+    exit(-1);
+  }
+
+  set_block_allocation_table_name(bat_name);
+  if (format_disk_with_geometry(DATA_BLOCKS, BLOCKSIZE) != 0)
+    exit(-1);
+
+  /* The data file gets the lowest free descriptor, which is found by
+   * taking it once.
+   */
+  int fd = dup(STDIN_FILENO);
+  close(fd);
+  unlink(data_name);
+  if (data_file && open_disk_data(data_name) != 0)
+    exit(-1);
+
+  struct inode *root = create_dir(NULL, "/");
+  if (check != NULL)
+    check(root);
+  else
+    check_failed_write(root, data_name, fd);
+
+  save_inodes(mft_name, root);
+  fs_shutdown(root);
+  close_disk_data();
+  return failures ? 1 : 0;
+}
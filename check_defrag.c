@@ -0,0 +1,198 @@
+#include "block_allocation.h"
+#include "disk_data.h"
+#include "fsck.h"
+#include "inode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A disk that is filled with files of two blocks, every other one of
+ * which is deleted, so that the files created next are split over
+ * the gaps. Deleting the rest of the upper half of the fillers then
+ * gives the defragmenter room to move them.
+ */
+#define DEFRAG_BLOCKS 512
+#define FILLERS (DEFRAG_BLOCKS / 2)
+#define FILLER_BYTES (2 * BLOCKSIZE)
+#define FRAGMENTED_FILES 8
+#define FRAGMENTED_BYTES (6 * BLOCKSIZE + 123)
+
+/* The most blocks that one defrag_step() moves. */
+#define STEP_BLOCKS 16
+
+static int failures = 0;
+
+static void expect(int ok, const char *what) {
+  printf("%-45s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok)
+    failures++;
+}
+
+/* Byte i of the file with the given seed. */
+static void fill_pattern(char *buf, uint64_t len, unsigned seed) {
+  for (uint64_t i = 0; i < len; i++)
+    buf[i] = (char)((i * 31 + seed * 7) % 251 + 1);
+}
+
+/* Returns 1 if every block of every entry of file is found by
+ * find_block_owner() with the id of file and the index of the entry.
+ */
+static int owners_match(struct inode *file) {
+  for (uint32_t i = 0; i < (*file).num_entries; i++) {
+    uintptr_t entry = (*file).entries[i];
+    uint32_t blockno = (uint32_t)entry;
+    uint32_t extent = (uint32_t)(entry >> 32);
+
+    if (blockno == HOLE_BLOCKNO)
+      continue;
+    for (uint32_t b = 0; b < extent; b++) {
+      uint32_t id, index;
+      if (find_block_owner((uint64_t)blockno + b, &id, &index) != 0 ||
+          id != (*file).id || index != i)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+/* Returns 1 if no file owns any block of entry. */
+static int no_owner(uintptr_t entry) {
+  uint32_t blockno = (uint32_t)entry;
+  uint32_t extent = (uint32_t)(entry >> 32);
+
+  for (uint32_t b = 0; b < extent; b++)
+    if (find_block_owner((uint64_t)blockno + b, NULL, NULL) == 0)
+      return 0;
+  return 1;
+}
+
+/* Returns 1 if all files have their owners and the contents of the
+ * fragmented files are those in want.
+ */
+static int files_intact(struct inode **files, int num_files, char **want,
+                        struct inode **fragmented) {
+  char *buf = malloc(FRAGMENTED_BYTES);
+  int ok = buf != NULL;
+
+  for (int i = 0; ok && i < num_files; i++)
+    ok = files[i] == NULL || owners_match(files[i]);
+  for (int i = 0; ok && i < FRAGMENTED_FILES; i++)
+    ok = owners_match(fragmented[i]) &&
+         read_file(fragmented[i], 0, buf, FRAGMENTED_BYTES) ==
+             FRAGMENTED_BYTES &&
+         memcmp(buf, want[i], FRAGMENTED_BYTES) == 0;
+  free(buf);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr,
+            "Usage: %s MFT BAT DATA\n"
+            "       where\n"
+            "       MFT is the name of the master_file_table\n"
+            "       BAT is the name of the block allocation table\n"
+            "       DATA is the name of the data file\n",
+            argv[0]);
+    exit(-1);
+  }
+
+  char *mft_name = argv[1];
+  char *bat_name = argv[2];
+  char *data_name = argv[3];
+
+  set_block_allocation_table_name(bat_name);
+  if (format_disk_with_geometry(DEFRAG_BLOCKS, BLOCKSIZE) != 0)
+    exit(-1);
+  unlink(data_name);
+  if (open_disk_data(data_name) != 0)
+    exit(-1);
+
+  struct inode *root = create_dir(NULL, "/");
+  struct inode *fillers[FILLERS];
+  struct inode *fragmented[FRAGMENTED_FILES];
+  char *want[FRAGMENTED_FILES];
+  char name[32];
+  int ok = 1;
+
+  for (int i = 0; i < FILLERS; i++) {
+    snprintf(name, sizeof(name), "filler-%d", i);
+    fillers[i] = create_file(root, name, 0, FILLER_BYTES);
+    ok = ok && fillers[i] != NULL;
+  }
+  expect(ok && disk_free_blocks() == 0, "fill the disk");
+  ok = 1;
+  for (int i = 0; i < FILLERS; i++)
+    ok = ok && owners_match(fillers[i]);
+  expect(ok, "owners after create");
+
+  ok = 1;
+  for (int i = 1; i < FILLERS; i += 2) {
+    uintptr_t entry = (*fillers[i]).entries[0];
+    ok = ok && delete_file(root, fillers[i]) == 0 && no_owner(entry);
+    fillers[i] = NULL;
+  }
+  expect(ok, "deleted files own no blocks");
+
+  ok = 1;
+  for (int i = 0; i < FRAGMENTED_FILES; i++) {
+    snprintf(name, sizeof(name), "fragmented-%d", i);
+    fragmented[i] = create_file(root, name, 0, FRAGMENTED_BYTES);
+    want[i] = malloc(FRAGMENTED_BYTES);
+    fill_pattern(want[i], FRAGMENTED_BYTES, i);
+    ok = ok && fragmented[i] != NULL && (*fragmented[i]).num_entries > 1 &&
+         write_file(fragmented[i], 0, want[i], FRAGMENTED_BYTES) ==
+             FRAGMENTED_BYTES;
+  }
+  expect(ok, "create fragmented files");
+  expect(files_intact(fillers, FILLERS, want, fragmented),
+         "owners after create and delete");
+
+  for (int i = FILLERS / 2; i < FILLERS; i += 2) {
+    delete_file(root, fillers[i]);
+    fillers[i] = NULL;
+  }
+
+  struct defrag_progress progress;
+  int result = defrag_start(root);
+  ok = result == FRAGMENTED_FILES;
+  while (ok && (result = defrag_step(STEP_BLOCKS)) == 1)
+    ;
+  defrag_progress(&progress);
+  expect(ok && result == 0, "defragment");
+  expect(progress.files_moved == FRAGMENTED_FILES &&
+             progress.entries_after == FRAGMENTED_FILES,
+         "every fragmented file is one extent");
+  expect(files_intact(fillers, FILLERS, want, fragmented),
+         "contents and owners after defragmenting");
+
+  /* Blocks written one at a time into a sparse file get entries of
+   * their own. The second block lands right after the first and its
+   * entry is merged into the one before, so the hole after it moves
+   * down; the other two split the hole.
+   */
+  struct inode *merged = create_sparse_file(root, "merged", 0, 4 * BLOCKSIZE);
+  const int order[4] = {0, 1, 3, 2};
+  ok = merged != NULL;
+  for (int i = 0; ok && i < 4; i++) {
+    ok = write_file(merged, order[i] * BLOCKSIZE, want[0], BLOCKSIZE) ==
+             BLOCKSIZE &&
+         owners_match(merged);
+    if (i == 1)
+      ok = ok && (*merged).num_entries == 2;
+  }
+  expect(ok, "owners after merging entries");
+
+  struct fsck_report report;
+  expect(fsck_tree(root, 1, stdout, &report) == 0,
+         "fsck_tree finds no errors");
+
+  save_inodes(mft_name, root);
+  fs_shutdown(root);
+  close_disk_data();
+  for (int i = 0; i < FRAGMENTED_FILES; i++)
+    free(want[i]);
+  return failures ? 1 : 0;
+}
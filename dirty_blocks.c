@@ -0,0 +1,98 @@
+#include "dirty_blocks.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t bucket(const struct dirty_blocks *blocks, uint64_t block) {
+  return (block * 0x9e3779b97f4a7c15ull >> 17) & (blocks->num_buckets - 1);
+}
+
+static int compare_blocks(const void *a, const void *b) {
+  uint64_t x = (*(struct dirty_block *const *)a)->block;
+  uint64_t y = (*(struct dirty_block *const *)b)->block;
+  return (x > y) - (x < y);
+}
+
+int dirty_blocks_init(struct dirty_blocks *blocks, uint64_t capacity,
+                      uint32_t block_size) {
+  memset(blocks, 0, sizeof(*blocks));
+  blocks->capacity = capacity;
+  blocks->block_size = block_size;
+  blocks->num_buckets = 1;
+  while (blocks->num_buckets < capacity)
+    blocks->num_buckets *= 2;
+
+  blocks->buckets = calloc(blocks->num_buckets, sizeof(struct dirty_block *));
+  if (capacity == 0 || blocks->buckets == NULL) {
+    free(blocks->buckets);
+    memset(blocks, 0, sizeof(*blocks));
+    return -1;
+  }
+  return 0;
+}
+
+void dirty_blocks_destroy(struct dirty_blocks *blocks) {
+  for (uint64_t i = 0; i < blocks->num_buckets; i++) {
+    struct dirty_block *b = blocks->buckets[i];
+    while (b != NULL) {
+      struct dirty_block *next = b->hash_next;
+      free(b);
+      b = next;
+    }
+  }
+  free(blocks->buckets);
+  memset(blocks, 0, sizeof(*blocks));
+}
+
+char *dirty_blocks_find(const struct dirty_blocks *blocks, uint64_t block) {
+  struct dirty_block *b = blocks->buckets[bucket(blocks, block)];
+  while (b != NULL && b->block != block)
+    b = b->hash_next;
+  return b != NULL ? b->data : NULL;
+}
+
+struct dirty_block *dirty_blocks_add(struct dirty_blocks *blocks,
+                                     uint64_t block) {
+  struct dirty_block *b = malloc(sizeof(struct dirty_block) +
+                                 blocks->block_size);
+  if (b == NULL)
+    return NULL;
+
+  uint64_t i = bucket(blocks, block);
+  b->block = block;
+  b->hash_next = blocks->buckets[i];
+  blocks->buckets[i] = b;
+  blocks->count++;
+  return b;
+}
+
+struct dirty_block **dirty_blocks_sorted(const struct dirty_blocks *blocks,
+                                         uint64_t *count) {
+  *count = 0;
+  if (blocks->count == 0)
+    return NULL;
+
+  struct dirty_block **sorted =
+      malloc(blocks->count * sizeof(struct dirty_block *));
+  if (sorted == NULL)
+    return NULL;
+
+  for (uint64_t i = 0; i < blocks->num_buckets; i++)
+    for (struct dirty_block *b = blocks->buckets[i]; b != NULL;
+         b = b->hash_next)
+      sorted[(*count)++] = b;
+  qsort(sorted, *count, sizeof(struct dirty_block *), compare_blocks);
+  return sorted;
+}
+
+void dirty_blocks_remove(struct dirty_blocks *blocks,
+                         struct dirty_block *block) {
+  struct dirty_block **p = &blocks->buckets[bucket(blocks, block->block)];
+
+  while (*p != block)
+    p = &(*p)->hash_next;
+  *p = block->hash_next;
+  blocks->count--;
+  free(block);
+}
@@ -0,0 +1,58 @@
+#ifndef DIRTY_BLOCKS_H
+#define DIRTY_BLOCKS_H
+
+#include <stdint.h>
+
+/* A block that was written and not yet written back, with its data. */
+struct dirty_block {
+  uint64_t block;
+  struct dirty_block *hash_next;
+  char data[];
+};
+
+/* A set of up to capacity dirty blocks of block_size bytes, keyed by
+ * block number. A set is not safe to use from several threads at
+ * once.
+ */
+struct dirty_blocks {
+  uint64_t capacity;
+  uint32_t block_size;
+  uint64_t count;
+
+  struct dirty_block **buckets;
+  uint64_t num_buckets;
+};
+
+/* Make blocks an empty set for capacity >= 1 blocks of block_size
+ * bytes.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+int dirty_blocks_init(struct dirty_blocks *blocks, uint64_t capacity,
+                      uint32_t block_size);
+
+/* Release all blocks in the set and the set itself. */
+void dirty_blocks_destroy(struct dirty_blocks *blocks);
+
+/* Return the data of block, or NULL if it is not in the set. */
+char *dirty_blocks_find(const struct dirty_blocks *blocks, uint64_t block);
+
+/* Add block, which is not in the set, and return it. The caller must
+ * fill its data, or take it out again with dirty_blocks_remove() if it
+ * cannot. The set must not be full.
+ * Returns NULL if memory allocation fails.
+ */
+struct dirty_block *dirty_blocks_add(struct dirty_blocks *blocks,
+                                     uint64_t block);
+
+/* Return an array of all blocks in the set, sorted by block number,
+ * which the caller must free, and store its length in *count.
+ * Returns NULL if the set is empty or memory allocation fails.
+ */
+struct dirty_block **dirty_blocks_sorted(const struct dirty_blocks *blocks,
+                                         uint64_t *count);
+
+/* Take block out of the set and release it. */
+void dirty_blocks_remove(struct dirty_blocks *blocks,
+                         struct dirty_block *block);
+
+#endif // DIRTY_BLOCKS_H
@@ -0,0 +1,1115 @@
+#include "disk_data.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) &&       \
+    defined(__NR_io_uring_register)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#include "block_allocation.h"
+#include "block_cache.h"
+#include "dirty_blocks.h"
+
+/* The descriptor of the data file, or -1. */
+static int data_fd = -1;
+
+/* The block cache, if disk_cache_enable() was called. All of it, and
+ * the dirty blocks below, are guarded by cache_lock, which is also
+ * held while missing blocks are read, so that a block is only read
+ * once.
+ */
+static struct block_cache cache;
+static int cache_on = 0;
+static uint64_t cache_budget;
+static enum block_cache_policy cache_policy;
+static char *miss_buffer = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A read that misses the cache reads up to this many blocks that are
+ * missing in one go, and adds them all.
+ */
+#define MISS_RUN 32
+
+/* The blocks that were written and not yet written back, if
+ * disk_write_back_enable() was called. flush_cursor is the block after
+ * the last one that was written back.
+ */
+static struct dirty_blocks dirty;
+static int write_back_on = 0;
+static uint64_t write_back_limit;
+static uint64_t flush_cursor = 0;
+static struct write_back_stats write_back_counts;
+
+/* A full set of dirty blocks writes back this share of them, so that
+ * a writer waits for a bounded batch only.
+ */
+#define FLUSH_SHARE 4
+
+/* The most blocks that are written back with one pwritev(). */
+#define FLUSH_IOVECS 1024
+
+static int flush_dirty(uint64_t max);
+
+/* disk_copy_blocks() moves the data through a buffer of at most this
+ * many bytes.
+ */
+#define COPY_BUFFER (1024 * 1024)
+
+int open_disk_data(const char *name) {
+  close_disk_data();
+
+  data_fd = open(name, O_RDWR | O_CREAT, 0644);
+  if (data_fd < 0) {
+    fprintf(stderr, "Failed to open data file %s\n", name);
+    perror("Reason:");
+    return -1;
+  }
+  return 0;
+}
+
+void close_disk_data() {
+  pthread_mutex_lock(&cache_lock);
+  if (write_back_on && data_fd >= 0 && flush_dirty(dirty.count) != 0)
+    fprintf(stderr, "Failed to write back the dirty blocks\n");
+  if (cache_on)
+    block_cache_clear(&cache);
+  pthread_mutex_unlock(&cache_lock);
+
+  if (data_fd >= 0)
+    close(data_fd);
+  data_fd = -1;
+}
+
+int disk_data_is_open() { return data_fd >= 0; }
+
+static int read_data(void *buf, size_t len, uint64_t off) {
+  char *p = buf;
+
+  if (data_fd < 0)
+    return -1;
+
+  while (len > 0) {
+    ssize_t n = pread(data_fd, p, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("Failed to read the data file");
+      return -1;
+    }
+    if (n == 0) {
+      /* Past the end of the file, the blocks were never written. */
+      memset(p, 0, len);
+      return 0;
+    }
+    p += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_data(const void *buf, size_t len, uint64_t off) {
+  const char *p = buf;
+
+  if (data_fd < 0)
+    return -1;
+
+  while (len > 0) {
+    ssize_t n = pwrite(data_fd, p, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("Failed to write the data file");
+      return -1;
+    }
+    p += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Releases the cache, with cache_lock held. */
+static void drop_cache() {
+  if (cache.capacity > 0)
+    block_cache_destroy(&cache);
+  free(miss_buffer);
+  miss_buffer = NULL;
+  cache_on = 0;
+}
+
+/* Sets up the cache for the current block size, which changes when the
+ * disk is formatted with another geometry. Must be called with
+ * cache_lock held. Returns 1 if the cache can be used and 0 if not.
+ */
+static int cache_ready() {
+  uint32_t block_size = disk_block_size();
+
+  if (!cache_on)
+    return 0;
+  if (cache.block_size == block_size)
+    return 1;
+
+  uint64_t capacity = cache_budget / block_size;
+  drop_cache();
+  miss_buffer = malloc((size_t)MISS_RUN * block_size);
+  if (capacity == 0 || miss_buffer == NULL ||
+      block_cache_init(&cache, capacity, block_size, cache_policy) != 0) {
+    drop_cache();
+    return 0;
+  }
+  cache_on = 1;
+  return 1;
+}
+
+/* Copies the part of the block at data that [*off, *off+*len) starts in
+ * to *buf, and moves past it.
+ */
+static void copy_out(const char *data, char **buf, uint64_t *off,
+                     size_t *len) {
+  uint64_t skip = *off % cache.block_size;
+  size_t n = cache.block_size - skip;
+
+  if (n > *len)
+    n = *len;
+  memcpy(*buf, data + skip, n);
+  *buf += n;
+  *off += n;
+  *len -= n;
+}
+
+/* Reads through the cache, with cache_lock held. The blocks that miss
+ * are read in runs of up to MISS_RUN blocks, or half the cache if that
+ * is less, with one pread() each.
+ */
+static int cached_read(char *buf, size_t len, uint64_t off) {
+  uint64_t block_size = cache.block_size;
+  uint64_t max_run = cache.capacity / 2;
+
+  if (max_run > MISS_RUN)
+    max_run = MISS_RUN;
+  if (max_run < 1)
+    max_run = 1;
+
+  while (len > 0) {
+    uint64_t block = off / block_size;
+    const char *data = block_cache_lookup(&cache, block);
+
+    if (data != NULL) {
+      copy_out(data, &buf, &off, &len);
+      continue;
+    }
+
+    uint64_t last = (off + len - 1) / block_size;
+    uint64_t run = 1;
+    while (run < max_run && block + run <= last &&
+           block_cache_peek(&cache, block + run) == NULL)
+      run++;
+    if (read_data(miss_buffer, run * block_size, block * block_size) != 0)
+      return -1;
+    for (uint64_t i = 0; i < run; i++) {
+      const char *from = miss_buffer + i * block_size;
+      memcpy(block_cache_insert(&cache, block + i), from, block_size);
+      copy_out(from, &buf, &off, &len);
+    }
+  }
+  return 0;
+}
+
+/* Copies what was written to [off, off+len) into the blocks of it that
+ * are in the cache, with cache_lock held.
+ */
+static void update_cache(const char *buf, size_t len, uint64_t off) {
+  uint64_t block_size = cache.block_size;
+
+  while (len > 0) {
+    uint64_t skip = off % block_size;
+    size_t n = block_size - skip;
+    if (n > len)
+      n = len;
+
+    char *data = block_cache_peek(&cache, off / block_size);
+    if (data != NULL)
+      memcpy(data + skip, buf, n);
+    buf += n;
+    off += n;
+    len -= n;
+  }
+}
+
+/* Sets up the dirty blocks for the current block size. Blocks that
+ * are dirty under another block size are written back first. Must be
+ * called with cache_lock held. Returns 1 if write-back can be used and
+ * 0 if not.
+ */
+static int write_back_ready() {
+  uint32_t block_size = disk_block_size();
+
+  if (!write_back_on)
+    return 0;
+  if (dirty.block_size == block_size)
+    return 1;
+
+  if (dirty.capacity > 0) {
+    if (flush_dirty(dirty.count) != 0)
+      return 0;
+    dirty_blocks_destroy(&dirty);
+  }
+  if (dirty_blocks_init(&dirty, write_back_limit / block_size, block_size)) {
+    write_back_on = 0;
+    return 0;
+  }
+  return 1;
+}
+
+/* Reads from the cache if there is one and from the data file if not,
+ * with cache_lock held.
+ */
+static int read_clean(char *buf, size_t len, uint64_t off) {
+  return cache_ready() ? cached_read(buf, len, off) : read_data(buf, len, off);
+}
+
+/* Reads with cache_lock held. Dirty blocks are copied from memory and
+ * the runs of blocks between them are read with read_clean().
+ */
+static int read_blocks(char *buf, size_t len, uint64_t off) {
+  if (!write_back_ready())
+    return read_clean(buf, len, off);
+
+  uint64_t block_size = dirty.block_size;
+  while (len > 0) {
+    const char *data = dirty_blocks_find(&dirty, off / block_size);
+    uint64_t skip = off % block_size;
+    size_t n = block_size - skip;
+
+    if (data != NULL) {
+      if (n > len)
+        n = len;
+      memcpy(buf, data + skip, n);
+    } else {
+      while (n < len &&
+             dirty_blocks_find(&dirty, (off + n) / block_size) == NULL)
+        n += block_size;
+      if (n > len)
+        n = len;
+      if (read_clean(buf, n, off) != 0)
+        return -1;
+    }
+    buf += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Writes run[0], ..., run[num_blocks-1], which follow each other on
+ * disk, with one pwritev() unless it writes less.
+ */
+static int write_run(struct dirty_block **run, int num_blocks) {
+  struct iovec iov[FLUSH_IOVECS];
+  uint64_t block_size = dirty.block_size;
+  uint64_t off = run[0]->block * block_size;
+  int first = 0;
+
+  for (int i = 0; i < num_blocks; i++) {
+    iov[i].iov_base = run[i]->data;
+    iov[i].iov_len = block_size;
+  }
+  write_back_counts.flush_writes++;
+
+  while (first < num_blocks) {
+    ssize_t n = pwritev(data_fd, iov + first, num_blocks - first, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      perror("Failed to write the data file");
+      return -1;
+    }
+    off += n;
+    while (first < num_blocks && (size_t)n >= iov[first].iov_len)
+      n -= iov[first++].iov_len;
+    if (first < num_blocks) {
+      iov[first].iov_base = (char *)iov[first].iov_base + n;
+      iov[first].iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/* Writes back up to max dirty blocks, with cache_lock held. The blocks
+ * are taken in the order of their numbers, from flush_cursor on and
+ * round to the start, and blocks that follow each other on disk are
+ * merged into one pwritev().
+ * Returns 0 on success and -1 on failure, in which case the blocks
+ * that were not written stay dirty.
+ */
+static int flush_dirty(uint64_t max) {
+  uint64_t count;
+  struct dirty_block **sorted = dirty_blocks_sorted(&dirty, &count);
+
+  if (sorted == NULL)
+    return count == 0 && dirty.count == 0 ? 0 : -1;
+  if (max > count)
+    max = count;
+
+  uint64_t start = 0;
+  while (start < count && sorted[start]->block < flush_cursor)
+    start++;
+
+  int result = 0;
+  for (uint64_t done = 0; done < max && result == 0;) {
+    uint64_t i = (start + done) % count;
+    int run = 1;
+    while (done + run < max && i + run < count && run < FLUSH_IOVECS &&
+           sorted[i + run]->block == sorted[i + run - 1]->block + 1)
+      run++;
+
+    result = write_run(sorted + i, run);
+    if (result == 0) {
+      flush_cursor = sorted[i + run - 1]->block + 1;
+      write_back_counts.blocks_flushed += run;
+      for (int j = 0; j < run; j++)
+        dirty_blocks_remove(&dirty, sorted[i + j]);
+    }
+    done += run;
+  }
+  free(sorted);
+  return result;
+}
+
+/* Writes into dirty blocks, with cache_lock held. A block that is only
+ * partly written is read first, and taken out of the set again if that
+ * fails, so that a buffer that was never filled is not written back.
+ * When the set is full, a share of it is written back.
+ */
+static int write_blocks(const char *buf, size_t len, uint64_t off) {
+  uint64_t block_size = dirty.block_size;
+  uint64_t batch = dirty.capacity / FLUSH_SHARE;
+
+  const char *from = buf;
+  size_t total = len;
+  uint64_t start = off;
+
+  if (batch < 1)
+    batch = 1;
+
+  while (len > 0) {
+    uint64_t block = off / block_size;
+    uint64_t skip = off % block_size;
+    size_t n = block_size - skip;
+    if (n > len)
+      n = len;
+
+    char *data = dirty_blocks_find(&dirty, block);
+    if (data == NULL) {
+      if (dirty.count == dirty.capacity && flush_dirty(batch) != 0)
+        return -1;
+      struct dirty_block *added = dirty_blocks_add(&dirty, block);
+      if (added == NULL)
+        return -1;
+      data = added->data;
+      if (n < block_size &&
+          read_clean(data, block_size, block * block_size) != 0) {
+        dirty_blocks_remove(&dirty, added);
+        return -1;
+      }
+      write_back_counts.blocks_dirtied++;
+    }
+    memcpy(data + skip, buf, n);
+    buf += n;
+    off += n;
+    len -= n;
+  }
+
+  if (cache_ready())
+    update_cache(from, total, start);
+  return 0;
+}
+
+int disk_read(void *buf, size_t len, uint64_t off) {
+  if (data_fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&cache_lock);
+  if (!write_back_ready() && !cache_ready()) {
+    pthread_mutex_unlock(&cache_lock);
+    return read_data(buf, len, off);
+  }
+  int result = read_blocks(buf, len, off);
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+int disk_write(const void *buf, size_t len, uint64_t off) {
+  if (data_fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&cache_lock);
+  if (write_back_ready()) {
+    int result = write_blocks(buf, len, off);
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (write_data(buf, len, off) != 0)
+    return -1;
+
+  pthread_mutex_lock(&cache_lock);
+  if (cache_ready())
+    update_cache(buf, len, off);
+  pthread_mutex_unlock(&cache_lock);
+  return 0;
+}
+
+int disk_write_back_enable(uint64_t limit) {
+  if (disk_write_back_disable() != 0)
+    return -1;
+
+  pthread_mutex_lock(&cache_lock);
+  write_back_limit = limit;
+  write_back_on = 1;
+  memset(&write_back_counts, 0, sizeof(write_back_counts));
+  int result = write_back_ready() ? 0 : -1;
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+int disk_write_back_disable() {
+  int result = 0;
+
+  pthread_mutex_lock(&cache_lock);
+  if (dirty.capacity > 0) {
+    if (data_fd >= 0)
+      result = flush_dirty(dirty.count);
+    if (result == 0)
+      dirty_blocks_destroy(&dirty);
+  }
+  if (result == 0)
+    write_back_on = 0;
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+void disk_write_back_stats(struct write_back_stats *stats) {
+  pthread_mutex_lock(&cache_lock);
+  *stats = write_back_counts;
+  stats->dirty_blocks = dirty.count;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int disk_sync() {
+  if (data_fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&cache_lock);
+  int result = write_back_ready() ? flush_dirty(dirty.count) : 0;
+  pthread_mutex_unlock(&cache_lock);
+
+  if (result == 0 && fdatasync(data_fd) != 0) {
+    perror("Failed to sync the data file");
+    result = -1;
+  }
+  return result;
+}
+
+int disk_cache_enable(uint64_t budget, enum block_cache_policy policy) {
+  pthread_mutex_lock(&cache_lock);
+  drop_cache();
+  cache_budget = budget;
+  cache_policy = policy;
+  cache_on = 1;
+  int result = cache_ready() ? 0 : -1;
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+void disk_cache_disable() {
+  pthread_mutex_lock(&cache_lock);
+  drop_cache();
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void disk_cache_stats(struct block_cache_stats *stats) {
+  pthread_mutex_lock(&cache_lock);
+  if (cache_on)
+    *stats = cache.stats;
+  else
+    memset(stats, 0, sizeof(*stats));
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int disk_prefetch(uint64_t off, uint64_t len) {
+  if (data_fd < 0)
+    return -1;
+
+  int error = posix_fadvise(data_fd, off, len, POSIX_FADV_WILLNEED);
+  if (error != 0) {
+    errno = error;
+    perror("Failed to prefetch the data file");
+    return -1;
+  }
+  return 0;
+}
+
+int disk_drop_page_cache() {
+  if (data_fd < 0)
+    return -1;
+
+  int error = fdatasync(data_fd) != 0 ? errno : 0;
+  if (error == 0)
+    error = posix_fadvise(data_fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (error != 0) {
+    errno = error;
+    perror("Failed to drop the data file from the page cache");
+    return -1;
+  }
+  return 0;
+}
+
+int disk_copy_blocks(uint64_t from, uint64_t to, uint64_t nblocks) {
+  uint64_t block_size = disk_block_size();
+  uint64_t step = COPY_BUFFER / block_size;
+
+  if (nblocks == 0)
+    return 0;
+  if (step == 0)
+    step = 1;
+  if (step > nblocks)
+    step = nblocks;
+
+  /* The blocks are read from the data file, so it must be up to date. */
+  pthread_mutex_lock(&cache_lock);
+  int flushed = write_back_ready() ? flush_dirty(dirty.count) : 0;
+  pthread_mutex_unlock(&cache_lock);
+  if (flushed != 0)
+    return -1;
+
+  char *buffer = malloc(step * block_size);
+  if (buffer == NULL)
+    return -1;
+
+  for (uint64_t done = 0; done < nblocks; done += step) {
+    uint64_t n = (nblocks - done < step) ? nblocks - done : step;
+    if (read_data(buffer, n * block_size, (from + done) * block_size) != 0 ||
+        disk_write(buffer, n * block_size, (to + done) * block_size) != 0) {
+      free(buffer);
+      return -1;
+    }
+  }
+  free(buffer);
+  return 0;
+}
+
+/* The ways disk_submit() can do a batch of transfers. */
+struct engine {
+  const char *name;
+  int (*submit)(struct disk_io *ios, int num_ios);
+};
+
+static int submit_sync(struct disk_io *ios, int num_ios) {
+  for (int i = 0; i < num_ios; i++) {
+    struct disk_io *io = &ios[i];
+    if (io->write ? write_data(io->buf, io->len, io->off)
+                  : read_data(io->buf, io->len, io->off))
+      return -1;
+  }
+  return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+/* The number of entries of a ring. Longer batches are submitted in
+ * parts of this many transfers.
+ */
+#define RING_ENTRIES 64
+
+/* An io_uring, set up with the raw system calls: the submission and
+ * completion rings and the array of submission entries, all mapped
+ * from the ring descriptor.
+ */
+struct ring {
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+/* A submission ring must only be filled by one thread at a time, so
+ * every thread gets its own ring when it first submits, and it is
+ * released when the thread ends.
+ */
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void release_ring(void *arg) {
+  struct ring *r = arg;
+
+  if (r->sqes != NULL && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring != NULL && r->cq_ring != MAP_FAILED &&
+      r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  if (r->sq_ring != NULL && r->sq_ring != MAP_FAILED)
+    munmap(r->sq_ring, r->sq_ring_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r);
+}
+
+static void create_ring_key() { pthread_key_create(&ring_key, release_ring); }
+
+/* The number of opcodes that probe_ring() asks about. */
+#define PROBE_OPS 256
+
+/* Returns 1 if the kernel can read and write with r. Kernels 5.1 to
+ * 5.5 have io_uring, but neither IORING_OP_READ and IORING_OP_WRITE
+ * nor IORING_REGISTER_PROBE, so a ring that cannot be probed is taken
+ * to be one that cannot read or write.
+ */
+static int probe_ring(struct ring *r) {
+  struct io_uring_probe *probe =
+      calloc(1, sizeof(*probe) + PROBE_OPS * sizeof(probe->ops[0]));
+  int ok = 0;
+
+  if (probe != NULL &&
+      syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe,
+              PROBE_OPS) == 0)
+    ok = IORING_OP_READ < probe->ops_len &&
+         IORING_OP_WRITE < probe->ops_len &&
+         (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+         (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+static struct ring *setup_ring() {
+  struct io_uring_params p;
+  struct ring *r = calloc(1, sizeof(struct ring));
+
+  if (r == NULL)
+    return NULL;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+  if (r->fd < 0) {
+    free(r);
+    return NULL;
+  }
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_size > r->sq_ring_size)
+      r->sq_ring_size = r->cq_ring_size;
+    r->cq_ring_size = r->sq_ring_size;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    release_ring(r);
+    return NULL;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+    release_ring(r);
+    return NULL;
+  }
+
+  char *sq = r->sq_ring;
+  char *cq = r->cq_ring;
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  if (!probe_ring(r)) {
+    release_ring(r);
+    return NULL;
+  }
+  return r;
+}
+
+/* Returns the ring of the calling thread, or NULL if it cannot be set
+ * up.
+ */
+static struct ring *thread_ring() {
+  pthread_once(&ring_key_once, create_ring_key);
+
+  struct ring *r = pthread_getspecific(ring_key);
+  if (r == NULL) {
+    r = setup_ring();
+    if (r != NULL && pthread_setspecific(ring_key, r) != 0) {
+      release_ring(r);
+      r = NULL;
+    }
+  }
+  return r;
+}
+
+static int ring_enter(struct ring *r, unsigned to_submit,
+                      unsigned min_complete) {
+  for (;;) {
+    long n = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n >= 0 || errno != EINTR)
+      return n;
+  }
+}
+
+/* Queues ios[0..num_ios), at most RING_ENTRIES of them, submits them
+ * and waits for their completions with one io_uring_enter(), and only
+ * enters again if they are not all complete by then. A transfer that
+ * ends short, at the end of the file or because the kernel split it,
+ * is finished with pread() or pwrite().
+ * The kernel uses the buffers until a transfer completes, so this
+ * never returns before every submitted transfer has completed, even
+ * if waiting for them fails.
+ */
+static int submit_ring_part(struct ring *r, struct disk_io *ios,
+                            int num_ios) {
+  unsigned first = *r->sq_tail;
+  unsigned tail = first;
+  unsigned mask = *r->sq_mask;
+
+  for (int i = 0; i < num_ios; i++) {
+    unsigned index = tail & mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ios[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = data_fd;
+    sqe->addr = (uintptr_t)ios[i].buf;
+    sqe->len = ios[i].len;
+    sqe->off = ios[i].off;
+    sqe->user_data = i;
+    r->sq_array[index] = index;
+    tail++;
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  long submitted = ring_enter(r, num_ios, num_ios);
+  if (submitted < 0)
+    submitted = 0;
+  if (submitted < num_ios) {
+    /* Take back the entries the kernel did not consume, they are done
+     * with pread() or pwrite() below.
+     */
+    __atomic_store_n(r->sq_tail, first + submitted, __ATOMIC_RELEASE);
+  }
+
+  int result = 0;
+  int wait_failed = 0;
+  for (long done = 0; done < submitted;) {
+    unsigned head = *r->cq_head;
+    unsigned cq_tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == cq_tail) {
+      /* If the kernel cannot wait for us, poll the completion ring. */
+      if (!wait_failed && ring_enter(r, 0, 1) < 0) {
+        perror("Failed to wait for the io_uring");
+        wait_failed = 1;
+        result = -1;
+      }
+      if (wait_failed)
+        sched_yield();
+      continue;
+    }
+    for (; head != cq_tail; head++, done++) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      struct disk_io *io = &ios[cqe->user_data];
+      int res = cqe->res;
+
+      if (res < 0 && res != -EAGAIN && res != -EINTR) {
+        errno = -res;
+        perror(io->write ? "Failed to write the data file"
+                         : "Failed to read the data file");
+        result = -1;
+      } else if ((size_t)(res < 0 ? 0 : res) < io->len) {
+        size_t n = (res < 0) ? 0 : res;
+        char *buf = (char *)io->buf + n;
+        if (io->write ? write_data(buf, io->len - n, io->off + n)
+                      : read_data(buf, io->len - n, io->off + n))
+          result = -1;
+      }
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  if (submitted < num_ios &&
+      submit_sync(ios + submitted, num_ios - submitted) != 0)
+    result = -1;
+  return result;
+}
+
+static int submit_uring(struct disk_io *ios, int num_ios) {
+  struct ring *r = thread_ring();
+
+  if (r == NULL)
+    return submit_sync(ios, num_ios);
+
+  int result = 0;
+  for (int i = 0; i < num_ios; i += RING_ENTRIES) {
+    int n = (num_ios - i < RING_ENTRIES) ? num_ios - i : RING_ENTRIES;
+    if (submit_ring_part(r, ios + i, n) != 0)
+      result = -1;
+  }
+  return result;
+}
+
+#endif
+
+static const struct engine engines[] = {
+    [DISK_IO_SYNC] = {"sync", submit_sync},
+#ifdef HAVE_IO_URING
+    [DISK_IO_URING] = {"io_uring", submit_uring},
+#endif
+};
+
+static const struct engine *current = NULL;
+
+static int supported(enum disk_io_engine engine) {
+  switch (engine) {
+  case DISK_IO_SYNC:
+    return 1;
+#ifdef HAVE_IO_URING
+  case DISK_IO_URING:
+    return thread_ring() != NULL;
+#endif
+  default:
+    return 0;
+  }
+}
+
+int disk_io_select(enum disk_io_engine engine) {
+  if (engine == DISK_IO_AUTO)
+    engine = supported(DISK_IO_URING) ? DISK_IO_URING : DISK_IO_SYNC;
+  if (!supported(engine))
+    return -1;
+
+  __atomic_store_n(&current, &engines[engine], __ATOMIC_RELEASE);
+  return 0;
+}
+
+static const struct engine *engine() {
+  const struct engine *e = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  if (e == NULL) {
+    disk_io_select(DISK_IO_AUTO);
+    e = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  }
+  return e;
+}
+
+const char *disk_io_engine_name() { return engine()->name; }
+
+/* A transfer of a batch in submit_cached() that goes to the data file.
+ * A run of num_blocks blocks that is read into buffer for the cache is
+ * copied to the len bytes at dest from byte skip of buffer afterwards.
+ * buffer is NULL for transfers into or out of the buffer of the
+ * caller.
+ */
+struct miss {
+  char *buffer;
+  uint64_t block;
+  uint64_t num_blocks;
+  char *dest;
+  uint64_t skip;
+  size_t len;
+};
+
+/* The transfers of a batch, with a struct miss for each of them. */
+struct batch {
+  struct disk_io *ios;
+  struct miss *misses;
+  int count;
+  int capacity;
+};
+
+static int batch_add(struct batch *b, struct disk_io io, struct miss miss) {
+  if (b->count == b->capacity) {
+    int capacity = b->capacity ? 2 * b->capacity : 16;
+    struct disk_io *ios = realloc(b->ios, capacity * sizeof(*ios));
+    if (ios == NULL)
+      return -1;
+    b->ios = ios;
+    struct miss *misses = realloc(b->misses, capacity * sizeof(*misses));
+    if (misses == NULL)
+      return -1;
+    b->misses = misses;
+    b->capacity = capacity;
+  }
+  b->ios[b->count] = io;
+  b->misses[b->count++] = miss;
+  return 0;
+}
+
+/* Queues the read io for submit_cached(), with cache_lock held. The
+ * bytes in dirty blocks and in the cache are copied at once. The runs
+ * of other blocks are added to b, of up to MISS_RUN whole blocks if
+ * they go into the cache and straight into the buffer of io if not.
+ */
+static int queue_read(struct batch *b, struct disk_io *io, int write_back,
+                      int cached) {
+  uint64_t block_size = disk_block_size();
+  char *buf = io->buf;
+  uint64_t off = io->off;
+  size_t len = io->len;
+
+  while (len > 0) {
+    uint64_t block = off / block_size;
+    uint64_t skip = off % block_size;
+    size_t n = block_size - skip;
+    const char *data = write_back ? dirty_blocks_find(&dirty, block) : NULL;
+
+    if (data == NULL && cached)
+      data = block_cache_lookup(&cache, block);
+    if (data != NULL) {
+      if (n > len)
+        n = len;
+      memcpy(buf, data + skip, n);
+      buf += n;
+      off += n;
+      len -= n;
+      continue;
+    }
+
+    uint64_t last = (off + len - 1) / block_size;
+    uint64_t run = 1;
+    while ((!cached || run < MISS_RUN) && block + run <= last &&
+           !(write_back && dirty_blocks_find(&dirty, block + run)) &&
+           !(cached && block_cache_peek(&cache, block + run)))
+      run++;
+    n = (block + run) * block_size - off;
+    if (n > len)
+      n = len;
+
+    int error;
+    if (!cached) {
+      error = batch_add(b, (struct disk_io){.buf = buf, .len = n, .off = off},
+                        (struct miss){0});
+    } else {
+      char *buffer = malloc(run * block_size);
+      error = buffer == NULL ||
+              batch_add(b,
+                        (struct disk_io){.buf = buffer,
+                                         .len = run * block_size,
+                                         .off = block * block_size},
+                        (struct miss){.buffer = buffer,
+                                      .block = block,
+                                      .num_blocks = run,
+                                      .dest = buf,
+                                      .skip = skip,
+                                      .len = n});
+      if (error)
+        free(buffer);
+    }
+    if (error)
+      return -1;
+    buf += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* disk_submit() with the cache or write-back on, with cache_lock held.
+ * Reads are served from the dirty blocks and the cache where they can
+ * be, and writes go to dirty blocks with write-back. All the rest is
+ * done with one batch of the engine, and the blocks that were read
+ * are added to the cache after it.
+ */
+static int submit_cached(struct disk_io *ios, int num_ios, int write_back,
+                         int cached) {
+  struct batch b = {0};
+  uint64_t block_size = disk_block_size();
+  int result = 0;
+
+  for (int i = 0; i < num_ios && result == 0; i++) {
+    if (!ios[i].write)
+      result = queue_read(&b, &ios[i], write_back, cached);
+    else if (write_back)
+      result = write_blocks(ios[i].buf, ios[i].len, ios[i].off);
+    else
+      result = batch_add(&b, ios[i], (struct miss){0});
+  }
+
+  if (result == 0 && b.count == 1)
+    result = submit_sync(b.ios, 1);
+  else if (result == 0 && b.count > 1)
+    result = engine()->submit(b.ios, b.count);
+
+  for (int i = 0; i < b.count; i++) {
+    struct miss *m = &b.misses[i];
+
+    if (result == 0 && b.ios[i].write)
+      update_cache(b.ios[i].buf, b.ios[i].len, b.ios[i].off);
+    if (result == 0 && m->buffer != NULL) {
+      /* A block that two transfers missed is only added once. */
+      for (uint64_t k = 0; k < m->num_blocks; k++) {
+        char *data = block_cache_peek(&cache, m->block + k);
+        if (data == NULL)
+          data = block_cache_insert(&cache, m->block + k);
+        memcpy(data, m->buffer + k * block_size, block_size);
+      }
+      memcpy(m->dest, m->buffer + m->skip, m->len);
+    }
+    free(m->buffer);
+  }
+  free(b.ios);
+  free(b.misses);
+  return result;
+}
+
+int disk_submit(struct disk_io *ios, int num_ios) {
+  if (num_ios == 0)
+    return 0;
+  if (data_fd < 0)
+    return -1;
+
+  pthread_mutex_lock(&cache_lock);
+  int write_back = write_back_ready();
+  int cached = cache_ready();
+  if (write_back || cached) {
+    int result = submit_cached(ios, num_ios, write_back, cached);
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (num_ios == 1)
+    return submit_sync(ios, 1);
+  return engine()->submit(ios, num_ios);
+}
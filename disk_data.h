@@ -0,0 +1,162 @@
+#ifndef DISK_DATA_H
+#define DISK_DATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "block_cache.h"
+
+/* The contents of the simulated disk are kept in a data file of their
+ * own, next to the block allocation table: block N is stored at byte
+ * N * disk_block_size() of the file. The file grows as blocks are
+ * written, and blocks that were never written read as zeros.
+ * Formatting the disk does not clear the data file, and the data of a
+ * freed block stays there until the block is written again.
+ */
+
+/* Open or create the data file with the given name. A data file that
+ * is open already is closed first.
+ * This function returns 0 in case of success and -1 if the file cannot
+ * be opened.
+ */
+int open_disk_data(const char *name);
+
+/* Close the data file. */
+void close_disk_data();
+
+/* Return 1 if a data file is open and 0 otherwise. */
+int disk_data_is_open();
+
+/* Read len bytes at byte offset off of the disk into buf, with one
+ * pread() unless it returns less. Bytes past the end of the file are
+ * zero. With the block cache enabled, the blocks that are in the cache
+ * are copied from it, and the others are read and added to it.
+ * This function returns 0 in case of success and -1 if no data file is
+ * open or it cannot be read.
+ */
+int disk_read(void *buf, size_t len, uint64_t off);
+
+/* Write len bytes from buf at byte offset off of the disk, with one
+ * pwrite() unless it writes less. Blocks that are in the block cache
+ * are updated as well. With write-back, the bytes go to dirty blocks
+ * in memory instead.
+ * This function returns 0 in case of success and -1 if no data file is
+ * open or it cannot be written.
+ */
+int disk_write(const void *buf, size_t len, uint64_t off);
+
+/* One transfer of disk_submit(): len bytes between buf and byte off of
+ * the disk, written if write is set and read otherwise.
+ */
+struct disk_io {
+  void *buf;
+  size_t len;
+  uint64_t off;
+  int write;
+};
+
+/* The ways disk_submit() can do its transfers. DISK_IO_URING queues
+ * them all on an io_uring of the calling thread and waits for them
+ * with a single io_uring_enter() call, DISK_IO_SYNC does one pread()
+ * or pwrite() per transfer. A batch of one transfer costs one system
+ * call either way and is always done with pread() or pwrite().
+ */
+enum disk_io_engine { DISK_IO_AUTO, DISK_IO_SYNC, DISK_IO_URING };
+
+/* Use engine for all following transfers. DISK_IO_AUTO picks io_uring
+ * if the kernel can read and write with it, which takes Linux 5.6, and
+ * the sync engine otherwise.
+ * Returns 0 on success and -1 if the engine is not supported.
+ */
+int disk_io_select(enum disk_io_engine engine);
+
+/* Return the name of the engine in use. */
+const char *disk_io_engine_name();
+
+/* Do the num_ios transfers in ios, in any order, like disk_read() and
+ * disk_write() do. They must not overlap if one of them writes. With
+ * the block cache or write-back enabled, the blocks that are dirty or
+ * cached are copied, and only the runs of the others that are read,
+ * and the writes that do not go to dirty blocks, are done with one
+ * batch of the engine.
+ * This function returns 0 in case of success, also for an empty batch
+ * with no data file open, and -1 if any of them fails.
+ */
+int disk_submit(struct disk_io *ios, int num_ios);
+
+/* Keep the most valuable blocks of the disk in memory, as many as fit
+ * in budget bytes, and pick the block to evict with policy. The data
+ * file is always written as well, so the cache never holds the only
+ * copy of a block. Closing the data file empties the cache.
+ * This function returns 0 in case of success and -1 if the budget is
+ * less than a block or memory allocation fails.
+ */
+int disk_cache_enable(uint64_t budget, enum block_cache_policy policy);
+
+/* Release the block cache. */
+void disk_cache_disable();
+
+/* Store the counters of the block cache in stats, or zeros if it is
+ * not enabled.
+ */
+void disk_cache_stats(struct block_cache_stats *stats);
+
+/* The counters of write-back: the blocks that were made dirty, the
+ * ones that were written back, the pwritev() calls that wrote them and
+ * the blocks that are dirty now.
+ */
+struct write_back_stats {
+  uint64_t blocks_dirtied;
+  uint64_t blocks_flushed;
+  uint64_t flush_writes;
+  uint64_t dirty_blocks;
+};
+
+/* Keep written blocks in memory, up to limit bytes of them, instead of
+ * writing them to the data file at once. Reads see the dirty blocks.
+ * When the limit is reached, a quarter of the dirty blocks are sorted
+ * by number and written back, going round the disk from where the
+ * last batch ended, and blocks that follow each other on disk are
+ * merged into one pwritev(). Many small writes become a few large
+ * ones, but they are only durable after disk_sync().
+ * This function returns 0 in case of success and -1 if the limit is
+ * less than a block, memory allocation fails or the blocks that were
+ * dirty already cannot be written back.
+ */
+int disk_write_back_enable(uint64_t limit);
+
+/* Write back all dirty blocks and write directly from now on.
+ * This function returns 0 in case of success and -1 if the blocks
+ * cannot be written back, in which case write-back stays on.
+ */
+int disk_write_back_disable();
+
+/* Store the counters of write-back in stats. */
+void disk_write_back_stats(struct write_back_stats *stats);
+
+/* Write back all dirty blocks and wait until the data file is on the
+ * device. Closing the data file writes back the dirty blocks too, but
+ * does not wait.
+ * This function returns 0 in case of success and -1 on failure.
+ */
+int disk_sync();
+
+/* Ask the kernel to start reading the bytes [off, off+len) of the disk
+ * into the page cache, and return without waiting for them.
+ * This function returns 0 in case of success and -1 on failure.
+ */
+int disk_prefetch(uint64_t off, uint64_t len);
+
+/* Write the data file back and drop it from the page cache, so that
+ * the next reads come from the device. This is for benchmarks.
+ * This function returns 0 in case of success and -1 on failure.
+ */
+int disk_drop_page_cache();
+
+/* Copy nblocks blocks from block from to block to. The two runs must
+ * not overlap.
+ * This function returns 0 in case of success and -1 on failure.
+ */
+int disk_copy_blocks(uint64_t from, uint64_t to, uint64_t nblocks);
+
+#endif // DISK_DATA_H
@@ -0,0 +1,310 @@
+#include "extent_index.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The treap priorities only have to look random, a xorshift generator
+ * with a fixed seed keeps the tree shapes reproducible between runs.
+ * Every thread has its own generator, since indexes of different
+ * allocation groups are updated in parallel.
+ */
+static __thread uint32_t priority_state = 2463534242u;
+
+static uint32_t next_priority() {
+  priority_state ^= priority_state << 13;
+  priority_state ^= priority_state >> 17;
+  priority_state ^= priority_state << 5;
+  return priority_state;
+}
+
+static uint64_t max_len_of(const struct free_extent *e) {
+  return e ? e->max_len : 0;
+}
+
+/* Recomputes the longest run in the address subtree of e. */
+static void update(struct free_extent *e) {
+  uint64_t m = e->len;
+  if (max_len_of(e->addr_left) > m)
+    m = max_len_of(e->addr_left);
+  if (max_len_of(e->addr_right) > m)
+    m = max_len_of(e->addr_right);
+  e->max_len = m;
+}
+
+/* Splits the address tree t into the runs that start before key (l)
+ * and the runs that start at or after key (r).
+ */
+static void addr_split(struct free_extent *t, uint64_t key,
+                       struct free_extent **l, struct free_extent **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  if (t->start < key) {
+    addr_split(t->addr_right, key, &t->addr_right, r);
+    *l = t;
+  } else {
+    addr_split(t->addr_left, key, l, &t->addr_left);
+    *r = t;
+  }
+  update(t);
+}
+
+/* Joins two address trees where all runs in a come before those in b. */
+static struct free_extent *addr_merge(struct free_extent *a,
+                                      struct free_extent *b) {
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (a->priority > b->priority) {
+    a->addr_right = addr_merge(a->addr_right, b);
+    update(a);
+    return a;
+  }
+  b->addr_left = addr_merge(a, b->addr_left);
+  update(b);
+  return b;
+}
+
+/* Orders the length tree by (len, start). */
+static int len_less(const struct free_extent *e, uint64_t len,
+                    uint64_t start) {
+  return e->len < len || (e->len == len && e->start < start);
+}
+
+static void len_split(struct free_extent *t, uint64_t len, uint64_t start,
+                      struct free_extent **l, struct free_extent **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  if (len_less(t, len, start)) {
+    len_split(t->len_right, len, start, &t->len_right, r);
+    *l = t;
+  } else {
+    len_split(t->len_left, len, start, l, &t->len_left);
+    *r = t;
+  }
+}
+
+static struct free_extent *len_merge(struct free_extent *a,
+                                     struct free_extent *b) {
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (a->priority > b->priority) {
+    a->len_right = len_merge(a->len_right, b);
+    return a;
+  }
+  b->len_left = len_merge(a, b->len_left);
+  return b;
+}
+
+unsigned extent_histogram_bucket(uint64_t len) {
+  return 63 - __builtin_clzll(len);
+}
+
+static void count_run(struct extent_index *index, uint64_t len, int64_t n) {
+  if (index->histogram)
+    __atomic_add_fetch(&index->histogram->runs[extent_histogram_bucket(len)],
+                       n, __ATOMIC_RELAXED);
+}
+
+/* Puts e into both trees. */
+static void index_link(struct extent_index *index, struct free_extent *e) {
+  struct free_extent *l, *r;
+
+  e->addr_left = e->addr_right = NULL;
+  e->len_left = e->len_right = NULL;
+  e->max_len = e->len;
+
+  addr_split(index->by_addr, e->start, &l, &r);
+  index->by_addr = addr_merge(addr_merge(l, e), r);
+
+  len_split(index->by_len, e->len, e->start, &l, &r);
+  index->by_len = len_merge(len_merge(l, e), r);
+
+  index->num_extents++;
+  index->free_blocks += e->len;
+  count_run(index, e->len, 1);
+}
+
+/* Takes e out of both trees without releasing it. */
+static void index_unlink(struct extent_index *index, struct free_extent *e) {
+  struct free_extent *l, *m, *r;
+
+  addr_split(index->by_addr, e->start, &l, &r);
+  addr_split(r, e->start + 1, &m, &r);
+  index->by_addr = addr_merge(l, r);
+
+  len_split(index->by_len, e->len, e->start, &l, &r);
+  len_split(r, e->len, e->start + 1, &m, &r);
+  index->by_len = len_merge(l, r);
+
+  index->num_extents--;
+  index->free_blocks -= e->len;
+  count_run(index, e->len, -1);
+}
+
+static struct free_extent *new_extent(uint64_t start, uint64_t len) {
+  struct free_extent *e = malloc(sizeof(struct free_extent));
+  if (e == NULL)
+    return NULL;
+  e->start = start;
+  e->len = len;
+  e->priority = next_priority();
+  return e;
+}
+
+static void free_tree(struct free_extent *t) {
+  if (t == NULL)
+    return;
+  free_tree(t->addr_left);
+  free_tree(t->addr_right);
+  free(t);
+}
+
+void extent_index_init(struct extent_index *index) {
+  *index = (struct extent_index){0};
+}
+
+void extent_index_clear(struct extent_index *index) {
+  free_tree(index->by_addr);
+  extent_index_init(index);
+}
+
+struct free_extent *extent_index_find(const struct extent_index *index,
+                                      uint64_t block) {
+  struct free_extent *t = index->by_addr;
+  struct free_extent *candidate = NULL;
+
+  /* Find the last run that starts at or before block. */
+  while (t) {
+    if (t->start <= block) {
+      candidate = t;
+      t = t->addr_right;
+    } else {
+      t = t->addr_left;
+    }
+  }
+  if (candidate && block - candidate->start < candidate->len)
+    return candidate;
+  return NULL;
+}
+
+int extent_index_insert(struct extent_index *index, uint64_t start,
+                        uint64_t len) {
+  if (len == 0)
+    return 0;
+
+  struct free_extent *prev =
+      (start > 0) ? extent_index_find(index, start - 1) : NULL;
+  struct free_extent *next = extent_index_find(index, start + len);
+  struct free_extent *e;
+
+  if (prev) {
+    index_unlink(index, prev);
+    len += start - prev->start;
+    start = prev->start;
+    e = prev;
+  }
+  if (next) {
+    index_unlink(index, next);
+    len += next->len;
+    if (prev)
+      free(next);
+    else
+      e = next;
+  }
+  if (!prev && !next) {
+    e = new_extent(start, len);
+    if (e == NULL)
+      return -1;
+  }
+
+  e->start = start;
+  e->len = len;
+  index_link(index, e);
+  return 0;
+}
+
+int extent_index_remove(struct extent_index *index, uint64_t start,
+                        uint64_t len) {
+  struct free_extent *e = extent_index_find(index, start);
+  if (e == NULL || len > e->len - (start - e->start))
+    return -1;
+
+  uint64_t end = e->start + e->len;
+  struct free_extent *tail = NULL;
+
+  /* Allocate the second piece first, so that a failure leaves the
+   * index untouched.
+   */
+  if (start > e->start && start + len < end) {
+    tail = new_extent(start + len, end - start - len);
+    if (tail == NULL)
+      return -1;
+  }
+
+  index_unlink(index, e);
+
+  if (start > e->start) {
+    e->len = start - e->start;
+    index_link(index, e);
+    if (tail)
+      index_link(index, tail);
+  } else if (start + len < end) {
+    e->start = start + len;
+    e->len = end - e->start;
+    index_link(index, e);
+  } else {
+    free(e);
+  }
+  return 0;
+}
+
+static struct free_extent *first_fit(struct free_extent *t, uint64_t from,
+                                     uint64_t len) {
+  if (t == NULL || t->max_len < len)
+    return NULL;
+
+  if (t->start >= from) {
+    struct free_extent *e = first_fit(t->addr_left, from, len);
+    if (e)
+      return e;
+    if (t->len >= len)
+      return t;
+  }
+  return first_fit(t->addr_right, from, len);
+}
+
+struct free_extent *extent_index_first_fit(const struct extent_index *index,
+                                           uint64_t from, uint64_t len) {
+  return first_fit(index->by_addr, from, len);
+}
+
+struct free_extent *extent_index_best_fit(const struct extent_index *index,
+                                          uint64_t len) {
+  struct free_extent *t = index->by_len;
+  struct free_extent *best = NULL;
+
+  while (t) {
+    if (t->len >= len) {
+      best = t;
+      t = t->len_left;
+    } else {
+      t = t->len_right;
+    }
+  }
+  return best;
+}
+
+struct free_extent *extent_index_largest(const struct extent_index *index) {
+  struct free_extent *t = index->by_len;
+
+  while (t && t->len_right)
+    t = t->len_right;
+  return t;
+}
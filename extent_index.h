@@ -0,0 +1,99 @@
+#ifndef EXTENT_INDEX_H
+#define EXTENT_INDEX_H
+
+#include <stdint.h>
+
+/* A run of free blocks [start, start+len).
+ * Every run is a node in two treaps that share the priority: one
+ * ordered by start block and one ordered by (len, start). In the
+ * address tree every node also records the longest run in its
+ * subtree, so that the lowest-addressed run of a given length can be
+ * found without visiting shorter runs.
+ */
+struct free_extent {
+  uint64_t start;
+  uint64_t len;
+  uint32_t priority;
+
+  struct free_extent *addr_left;
+  struct free_extent *addr_right;
+  uint64_t max_len;
+
+  struct free_extent *len_left;
+  struct free_extent *len_right;
+};
+
+/* Counts of free runs by length. Bucket k counts the runs of 2^k to
+ * 2^(k+1)-1 blocks. Several indexes can share one histogram, it is
+ * updated with atomic operations.
+ */
+#define EXTENT_HISTOGRAM_BUCKETS 64
+
+struct extent_histogram {
+  uint64_t runs[EXTENT_HISTOGRAM_BUCKETS];
+};
+
+/* The free runs of a disk. Runs in the index never touch each other,
+ * neighbours are merged when they are inserted.
+ * If histogram is not NULL, every run that is added to or removed from
+ * the index is counted there.
+ */
+struct extent_index {
+  struct free_extent *by_addr;
+  struct free_extent *by_len;
+  uint64_t num_extents;
+  uint64_t free_blocks;
+  struct extent_histogram *histogram;
+};
+
+/* Return the histogram bucket for runs of len blocks, len >= 1. */
+unsigned extent_histogram_bucket(uint64_t len);
+
+/* Make index empty, without a histogram. It must not contain any
+ * runs.
+ */
+void extent_index_init(struct extent_index *index);
+
+/* Release all runs in the index and make it empty. The runs are not
+ * taken out of the histogram.
+ */
+void extent_index_clear(struct extent_index *index);
+
+/* Add the free blocks [start, start+len) to the index and merge them
+ * with the runs directly before and after.
+ * The blocks must not be in the index already.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+int extent_index_insert(struct extent_index *index, uint64_t start,
+                        uint64_t len);
+
+/* Remove the blocks [start, start+len) from the index. They must all
+ * lie inside one run, which is split if needed.
+ * Returns 0 on success and -1 if the blocks are not free or memory
+ * allocation fails.
+ */
+int extent_index_remove(struct extent_index *index, uint64_t start,
+                        uint64_t len);
+
+/* Return the run that contains block, or NULL. */
+struct free_extent *extent_index_find(const struct extent_index *index,
+                                      uint64_t block);
+
+/* Return the lowest-addressed run that starts at or after from and
+ * has at least len blocks, or NULL.
+ */
+struct free_extent *extent_index_first_fit(const struct extent_index *index,
+                                           uint64_t from, uint64_t len);
+
+/* Return the shortest run with at least len blocks, the lowest one
+ * if there are several, or NULL.
+ */
+struct free_extent *extent_index_best_fit(const struct extent_index *index,
+                                          uint64_t len);
+
+/* Return the longest run, the highest one if there are several, or
+ * NULL if the index is empty.
+ */
+struct free_extent *extent_index_largest(const struct extent_index *index);
+
+#endif // EXTENT_INDEX_H
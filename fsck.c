@@ -0,0 +1,307 @@
+#include "fsck.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "block_allocation.h"
+#include "run_search.h"
+
+#define BITS_PER_WORD 64
+#define WORDS_FOR(n) (((n) + BITS_PER_WORD - 1) / BITS_PER_WORD)
+#define ALL_ONES (~(uint64_t)0)
+
+/* The tree is cut into at least this many subtrees per thread, which
+ * the threads take from a shared list one at a time, so that a few
+ * large subtrees do not leave the other threads idle.
+ */
+#define SUBTREES_PER_THREAD 16
+
+/* The state that the threads of one check share. seen has a bit for
+ * every block that is in a file, and twice for every block that was
+ * found in a file more than once.
+ */
+struct scan {
+  struct inode **subtrees;
+  uint64_t num_subtrees;
+  uint64_t next_subtree;
+
+  uint64_t num_blocks;
+  uint64_t *seen;
+  uint64_t *twice;
+
+  uint64_t files;
+  uint64_t directories;
+  uint64_t out_of_range;
+};
+
+/* The counts of one thread, added to the scan when it is done. */
+struct counts {
+  uint64_t files;
+  uint64_t directories;
+  uint64_t out_of_range;
+};
+
+/* Marks the blocks [start, start+len) in seen, and the blocks that
+ * were marked already in twice.
+ */
+static void mark_run(struct scan *scan, struct counts *counts, uint64_t start,
+                     uint64_t len) {
+  uint64_t end = start + len;
+
+  if (end > scan->num_blocks) {
+    uint64_t first = (start > scan->num_blocks) ? start : scan->num_blocks;
+    counts->out_of_range += end - first;
+    end = scan->num_blocks;
+  }
+
+  while (start < end) {
+    uint64_t w = start / BITS_PER_WORD;
+    unsigned lo = start % BITS_PER_WORD;
+    uint64_t n = BITS_PER_WORD - lo;
+    if (n > end - start)
+      n = end - start;
+
+    uint64_t mask = (n == BITS_PER_WORD) ? ALL_ONES
+                                         : (((uint64_t)1 << n) - 1) << lo;
+    uint64_t old = __atomic_fetch_or(&scan->seen[w], mask, __ATOMIC_RELAXED);
+    if (old & mask)
+      __atomic_fetch_or(&scan->twice[w], old & mask, __ATOMIC_RELAXED);
+    start += n;
+  }
+}
+
+static void walk(struct scan *scan, struct counts *counts, struct inode *node) {
+  if (node->is_directory) {
+    counts->directories++;
+    for (uint32_t i = 0; i < node->num_entries; i++)
+      walk(scan, counts, (struct inode *)node->entries[i]);
+    return;
+  }
+
+  /* Entries hold the block number in the low and the length in the
+   * high 32 bits. Holes have no blocks.
+   */
+  counts->files++;
+  for (uint32_t i = 0; i < node->num_entries; i++) {
+    uint64_t entry = node->entries[i];
+    if (entry >> 32 && (uint32_t)entry != HOLE_BLOCKNO)
+      mark_run(scan, counts, (uint32_t)entry, entry >> 32);
+  }
+}
+
+static void *scan_thread(void *arg) {
+  struct scan *scan = arg;
+  struct counts counts = {0};
+
+  for (;;) {
+    uint64_t i = __atomic_fetch_add(&scan->next_subtree, 1, __ATOMIC_RELAXED);
+    if (i >= scan->num_subtrees)
+      break;
+    walk(scan, &counts, scan->subtrees[i]);
+  }
+
+  __atomic_add_fetch(&scan->files, counts.files, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&scan->directories, counts.directories,
+                     __ATOMIC_RELAXED);
+  __atomic_add_fetch(&scan->out_of_range, counts.out_of_range,
+                     __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* Cuts the tree below root into subtrees, one level at a time, until
+ * there are at least target of them or only files are left. The
+ * directories above the subtrees are counted in *directories.
+ * Returns 0 on success and -1 if memory allocation fails.
+ */
+static int split_tree(struct scan *scan, struct inode *root, uint64_t target,
+                      uint64_t *directories) {
+  struct inode **level = malloc(sizeof(struct inode *));
+  uint64_t count = 1;
+  int has_dirs = root->is_directory;
+
+  if (level == NULL)
+    return -1;
+  level[0] = root;
+
+  while (has_dirs && count < target) {
+    uint64_t next_count = 0;
+    for (uint64_t i = 0; i < count; i++)
+      next_count += level[i]->is_directory ? level[i]->num_entries : 1;
+
+    struct inode **next = malloc(sizeof(struct inode *) * (next_count + 1));
+    if (next == NULL) {
+      free(level);
+      return -1;
+    }
+
+    next_count = 0;
+    has_dirs = 0;
+    for (uint64_t i = 0; i < count; i++) {
+      if (!level[i]->is_directory) {
+        next[next_count++] = level[i];
+        continue;
+      }
+      (*directories)++;
+      for (uint32_t j = 0; j < level[i]->num_entries; j++) {
+        next[next_count] = (struct inode *)level[i]->entries[j];
+        has_dirs |= next[next_count]->is_directory;
+        next_count++;
+      }
+    }
+    free(level);
+    level = next;
+    count = next_count;
+  }
+
+  scan->subtrees = level;
+  scan->num_subtrees = count;
+  return 0;
+}
+
+/* Collects the blocks with one kind of problem into runs for the log. */
+struct run_log {
+  FILE *log;
+  const char *problem;
+  uint64_t start;
+  uint64_t end;
+};
+
+static void flush_run(struct run_log *runs) {
+  if (runs->log && runs->end > runs->start)
+    fprintf(runs->log, "Blocks %" PRIu64 "-%" PRIu64 " are %s\n", runs->start,
+            runs->end - 1, runs->problem);
+  runs->start = runs->end = 0;
+}
+
+/* Adds the blocks of word w whose bits are set in bits. */
+static void log_bits(struct run_log *runs, uint64_t w, uint64_t bits) {
+  while (bits) {
+    unsigned lo = __builtin_ctzll(bits);
+    uint64_t rest = ~bits & (ALL_ONES << lo);
+    unsigned hi = rest ? __builtin_ctzll(rest) : BITS_PER_WORD;
+    uint64_t start = w * BITS_PER_WORD + lo;
+
+    if (start != runs->end) {
+      flush_run(runs);
+      runs->start = start;
+    }
+    runs->end = w * BITS_PER_WORD + hi;
+    bits = (hi == BITS_PER_WORD) ? 0 : bits & (ALL_ONES << hi);
+  }
+}
+
+/* Compares the blocks in the files with the table, skipping the words
+ * where they agree with the vector kernels of run_search.
+ */
+static void compare(struct scan *scan, const uint64_t *table, FILE *log,
+                    struct fsck_report *report) {
+  uint64_t num_words = WORDS_FOR(scan->num_blocks);
+  struct run_log leaked = {.log = log, .problem = "leaked"};
+  struct run_log unallocated = {.log = log,
+                                .problem = "in a file but not allocated"};
+  struct run_log twice = {.log = log,
+                          .problem = "in more than one file entry"};
+
+  for (uint64_t w = 0; w < num_words; w++)
+    report->referenced_blocks += __builtin_popcountll(scan->seen[w]);
+
+  uint64_t w = bitmap_next_difference(table, scan->seen, 0, num_words);
+  while (w < num_words) {
+    uint64_t only_table = table[w] & ~scan->seen[w];
+    uint64_t only_files = scan->seen[w] & ~table[w];
+    report->leaked_blocks += __builtin_popcountll(only_table);
+    report->unallocated_blocks += __builtin_popcountll(only_files);
+    log_bits(&leaked, w, only_table);
+    log_bits(&unallocated, w, only_files);
+    w = bitmap_next_difference(table, scan->seen, w + 1, num_words);
+  }
+
+  w = bitmap_skip_words(scan->twice, 0, num_words, 0);
+  while (w < num_words) {
+    report->double_allocated_blocks += __builtin_popcountll(scan->twice[w]);
+    log_bits(&twice, w, scan->twice[w]);
+    w = bitmap_skip_words(scan->twice, w + 1, num_words, 0);
+  }
+
+  flush_run(&leaked);
+  flush_run(&unallocated);
+  flush_run(&twice);
+}
+
+static int has_problems(const struct fsck_report *report) {
+  return report->leaked_blocks || report->unallocated_blocks ||
+         report->double_allocated_blocks || report->out_of_range_blocks ||
+         report->dangling_references;
+}
+
+int fsck_tree(struct inode *root, int num_threads, FILE *log,
+              struct fsck_report *report) {
+  struct scan scan = {.num_blocks = disk_num_blocks()};
+  uint64_t num_words = WORDS_FOR(scan.num_blocks);
+  pthread_t threads[FSCK_MAX_THREADS];
+  int started = 0;
+
+  *report = (struct fsck_report){0};
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > FSCK_MAX_THREADS)
+    num_threads = FSCK_MAX_THREADS;
+
+  uint64_t *table = malloc(num_words * sizeof(uint64_t));
+  scan.seen = calloc(num_words, sizeof(uint64_t));
+  scan.twice = calloc(num_words, sizeof(uint64_t));
+  if (table == NULL || scan.seen == NULL || scan.twice == NULL ||
+      read_disk_bitmap(table) != 0 ||
+      split_tree(&scan, root, (uint64_t)num_threads * SUBTREES_PER_THREAD,
+                 &report->directories) != 0) {
+    fprintf(stderr, "Failed to prepare the file system check\n");
+    free(scan.seen);
+    free(scan.twice);
+    free(table);
+    return -1;
+  }
+
+  /* The calling thread takes part in the walk. */
+  while (started < num_threads - 1 &&
+         pthread_create(&threads[started], NULL, scan_thread, &scan) == 0)
+    started++;
+  scan_thread(&scan);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  report->files = scan.files;
+  report->directories += scan.directories;
+  report->out_of_range_blocks = scan.out_of_range;
+  compare(&scan, table, log, report);
+
+  free(scan.subtrees);
+  free(scan.seen);
+  free(scan.twice);
+  free(table);
+  return has_problems(report);
+}
+
+int fsck_image(const char *master_file_table, int num_threads, FILE *log,
+               struct fsck_report *report) {
+  uint64_t dangling;
+  struct inode *root = load_inodes_lenient(master_file_table, &dangling);
+
+  if (root == NULL) {
+    *report = (struct fsck_report){0};
+    return -1;
+  }
+
+  int result = fsck_tree(root, num_threads, log, report);
+  fs_shutdown(root);
+  if (result < 0)
+    return -1;
+
+  report->dangling_references = dangling;
+  if (log && dangling)
+    fprintf(log, "%" PRIu64 " directory references are dangling\n",
+            dangling);
+  return has_problems(report);
+}
@@ -0,0 +1,50 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "inode.h"
+
+/* What a check found. referenced_blocks counts the blocks that belong
+ * to at least one file. The problems are
+ * leaked_blocks: used in the block allocation table, but in no file,
+ * unallocated_blocks: in a file, but free in the table,
+ * double_allocated_blocks: in more than one entry of the files,
+ * out_of_range_blocks: in an entry, but past the end of the disk,
+ * dangling_references: directory entries that name an inode that is
+ * not in the master file table, the root, or an inode that another
+ * directory holds already.
+ */
+struct fsck_report {
+  uint64_t files;
+  uint64_t directories;
+  uint64_t referenced_blocks;
+  uint64_t leaked_blocks;
+  uint64_t unallocated_blocks;
+  uint64_t double_allocated_blocks;
+  uint64_t out_of_range_blocks;
+  uint64_t dangling_references;
+};
+
+#define FSCK_MAX_THREADS 64
+
+/* Check the files below root against the block allocation table.
+ * The tree is split into subtrees that num_threads threads walk in
+ * parallel, marking the blocks of every file in a shared bitmap, which
+ * is then compared with the table. If log is not NULL, every run of
+ * blocks with a problem is printed there.
+ * This function returns 0 if the file system is consistent, 1 if
+ * problems were found and -1 if the check could not be done.
+ */
+int fsck_tree(struct inode *root, int num_threads, FILE *log,
+              struct fsck_report *report);
+
+/* Like fsck_tree(), for the master file table in the given file. It is
+ * loaded with load_inodes_lenient(), so that dangling references are
+ * counted instead of ending the program, and released again.
+ */
+int fsck_image(const char *master_file_table, int num_threads, FILE *log,
+               struct fsck_report *report);
+
+#endif // FSCK_H
@@ -0,0 +1,56 @@
+#include "block_allocation.h"
+#include "fsck.h"
+#include "inode.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr,
+            "Usage: %s MFT BAT [THREADS]\n"
+            "       where\n"
+            "       MFT is the name of the master_file_table\n"
+            "       BAT is the name of the block allocation table\n"
+            "       THREADS is the number of threads, by default one per "
+            "CPU\n",
+            argv[0]);
+    exit(-1);
+  }
+
+  char *mft_name = argv[1];
+  char *bat_name = argv[2];
+  int threads = (argc == 4) ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  set_block_allocation_table_name(bat_name);
+
+  struct timespec start, end;
+  struct fsck_report report;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int result = fsck_image(mft_name, threads, stdout, &report);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (result < 0) {
+    fprintf(stderr, "Failed to check %s against %s\n", mft_name, bat_name);
+    return 2;
+  }
+
+  printf("files:                   %" PRIu64 "\n", report.files);
+  printf("directories:             %" PRIu64 "\n", report.directories);
+  printf("referenced blocks:       %" PRIu64 "\n", report.referenced_blocks);
+  printf("leaked blocks:           %" PRIu64 "\n", report.leaked_blocks);
+  printf("unallocated blocks:      %" PRIu64 "\n", report.unallocated_blocks);
+  printf("double-allocated blocks: %" PRIu64 "\n",
+         report.double_allocated_blocks);
+  printf("out-of-range blocks:     %" PRIu64 "\n", report.out_of_range_blocks);
+  printf("dangling references:     %" PRIu64 "\n", report.dangling_references);
+  fprintf(stderr, "checked in %.3f s\n",
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  printf("%s\n", result ? "The file system has errors"
+                        : "The file system is clean");
+
+  return result;
+}
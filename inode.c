@@ -1,11 +1,14 @@
 #include "inode.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "block_allocation.h"
+#include "disk_data.h"
+#include "reverse_map.h"
 
 // Function that gets a new inode id incrementally.
 int max_id = -1;
@@ -15,16 +18,18 @@ uint32_t get_new_id() {
 }
 
 // Function that combines blockno and extent into a single 64-bit variable.
+// blockno is kept in the low half, which is the layout of the entries that
+// load_inodes reads from the master file table.
 // Returns: The entry made from blockno and extent.
 uintptr_t create_entry(uint32_t blockno, uint32_t extent) {
-  return ((uintptr_t)blockno << 32) | extent;
+  return ((uintptr_t)extent << 32) | blockno;
 }
 
 // Function that stores the blockno and extent in an entry to blockno and extent
 // pointers. Is NULL-safe.
 void unpack_entry(uintptr_t entry, uint32_t *blockno, uint32_t *extent) {
-  if (blockno != NULL) *blockno = (uint32_t)(entry >> 32);
-  if (extent != NULL) *extent = (uint32_t)entry;
+  if (blockno != NULL) *blockno = (uint32_t)entry;
+  if (extent != NULL) *extent = (uint32_t)(entry >> 32);
 }
 
 // Function that copies a string to heap and returns pointer to the new string
@@ -42,7 +47,7 @@ void free_file(struct inode *file, uintptr_t *entries, char *name,
     uint32_t blockno;
     uint32_t extent;
     unpack_entry(entries[i], &blockno, &extent);
-    for (uint32_t j = 0; j < extent; j++) free_block(blockno + j);
+    if (blockno != HOLE_BLOCKNO) free_extent(blockno, extent);
   }
   free(file);
   free(entries);
@@ -57,7 +62,7 @@ void free_file(struct inode *file, uintptr_t *entries, char *name,
 int delete_inode(struct inode *parent, struct inode *node) {
   // Overwrite the pointer to the inode to delete with the one in the last
   // position. If the order of the entries is relevant, just bubble it up.
-  for (int i = 0; i < (*parent).num_entries; i++) {
+  for (uint32_t i = 0; i < (*parent).num_entries; i++) {
     struct inode *entry = (struct inode *)((*parent).entries[i]);
     if ((*entry).id == (*node).id) {
       (*parent).entries[i] = (*parent).entries[(*parent).num_entries - 1];
@@ -108,95 +113,238 @@ int add_inode(struct inode *parent, struct inode *new) {
   return 0;
 }
 
-// Function to allocate the blocks needed for a file. Entries must have room for
-// ceil(filesize/BLOCKSIZE) entries.
-// IMPORTANT: Does not free allocated blocks if it fails. Does, however, keep
-// track of the number of entries so they can be freed by free_file.
-// Returns pointer to the last added entry on success, NULL on failure.
-uintptr_t *allocate_blocks(uintptr_t *entries, uint32_t *num_entries,
-                           uint32_t blocks_to_allocate) {
-  uint32_t blockno;
-  uint32_t extent = (blocks_to_allocate <= 4) ? blocks_to_allocate : 4;
+// With delayed allocation, create_file only reserves the blocks of a file and
+// adds the file to pending_files. flush_files allocates the blocks of all
+// pending files at once, in the order they were created.
+static int delayed_allocation = 0;
+static struct inode **pending_files = NULL;
+static uint32_t num_pending = 0;
+
+// Function that calculates ceil(size_in_bytes/block_size), the number of
+// blocks a file of size_in_bytes bytes needs.
+uint32_t blocks_for_size(uint64_t size_in_bytes) {
+  uint32_t block_size = disk_block_size();
+  return (size_in_bytes + block_size - 1) / block_size;
+}
+
+// Function that makes room for one more file in pending_files.
+// Returns 0 on success and -1 on failure.
+int grow_pending_files() {
+  struct inode **new_pending;
+  if ((new_pending = realloc(pending_files, (num_pending + 1) *
+                                                sizeof(pending_files[0]))) ==
+      NULL)
+    return -1;
 
-  // If successfully allocating extent blocks, add to entries
-  if ((blockno = allocate_block(extent)) != -1) {
-    *entries = create_entry(blockno, extent);
-    entries++;
-    (*num_entries)++;
+  pending_files = new_pending;
+  return 0;
+}
+
+// Function that takes file out of pending_files and gives back the blocks
+// that were reserved for it. Does nothing if file is not pending.
+void drop_pending_file(struct inode *file) {
+  for (uint32_t i = 0; i < num_pending; i++) {
+    if (pending_files[i] == file) {
+      // Keep the order of creation for flush_files
+      memmove(&pending_files[i], &pending_files[i + 1],
+              (num_pending - i - 1) * sizeof(pending_files[0]));
+      num_pending--;
+      unreserve_blocks(blocks_for_size((*file).filesize));
+      return;
+    }
   }
-  // If allocating one block has failed, there is no more room on the disk or
-  // other failure, return failure value
-  else if (extent == 1) {
-    return NULL;
+}
+
+// The owner of every block that belongs to a file, kept up to date by every
+// function that changes the entries of a file.
+static struct reverse_map block_owners;
+
+// Function that removes the entries of the file with id id from
+// block_owners.
+void unmap_entries(uint32_t id, const uintptr_t *entries,
+                   uint32_t num_entries) {
+  for (uint32_t i = 0; i < num_entries; i++) {
+    uint32_t blockno;
+    unpack_entry(entries[i], &blockno, NULL);
+    if (blockno == HOLE_BLOCKNO) continue;
+
+    struct owner_run *run = reverse_map_find(&block_owners, blockno);
+    if (run != NULL && (*run).start == blockno && (*run).inode_id == id)
+      reverse_map_remove(&block_owners, blockno);
   }
-  // If allocating extent > 1 blocks fails, allocate twice with extents 1 and
-  // extent-1.
-  else {
-    // If allocating one block fails, return failure
-    if ((blockno = allocate_block(1))) return NULL;
+}
 
-    // Adding allocated block to entries
-    *entries = create_entry(blockno, 1);
-    (*num_entries)++;
-    entries++;
+// Function that adds the entries of the file with id id to block_owners.
+// Blocks that have an owner already are reported and left out.
+// Returns 0 on success and -1 on failure, in which case nothing is added.
+int map_entries(uint32_t id, const uintptr_t *entries, uint32_t num_entries) {
+  for (uint32_t i = 0; i < num_entries; i++) {
+    uint32_t blockno;
+    uint32_t extent;
+    unpack_entry(entries[i], &blockno, &extent);
+    if (!extent || blockno == HOLE_BLOCKNO) continue;
 
-    // Allocating the rest of the blocks by this function. If it fails, return
-    // failure.
-    if ((entries = allocate_blocks(entries, num_entries, extent - 1)) == NULL)
-      return NULL;
+    int result = reverse_map_insert(&block_owners, blockno, extent, id, i);
+    if (result < 0) {
+      unmap_entries(id, entries, i);
+      return -1;
+    }
+    if (result > 0)
+      fprintf(stderr, "Blocks %u-%u of inode %u have another owner\n",
+              blockno, blockno + extent - 1, id);
+  }
+  return 0;
+}
+
+int find_block_owner(uint64_t block, uint32_t *inode_id, uint32_t *entry) {
+  struct owner_run *run = reverse_map_find(&block_owners, block);
+  if (run == NULL) return -1;
+
+  if (inode_id != NULL) *inode_id = (*run).inode_id;
+  if (entry != NULL) *entry = (*run).entry;
+  return 0;
+}
 
-    entries++;
+// A defragmentation pass keeps the files it still has to look at in
+// defrag_files, in the order defrag_start found them, and next_defrag_file
+// is the first one that is left. The slot of a file that is deleted is set to
+// NULL by drop_defrag_file.
+static struct inode **defrag_files = NULL;
+static uint32_t num_defrag_files = 0;
+static uint32_t next_defrag_file = 0;
+static struct defrag_progress defrag_state;
+
+// Function that forgets file in the current defragmentation pass. Does
+// nothing if file is not queued.
+void drop_defrag_file(struct inode *file) {
+  for (uint32_t i = next_defrag_file; i < num_defrag_files; i++) {
+    if (defrag_files[i] == file) {
+      defrag_files[i] = NULL;
+      return;
+    }
   }
+}
+
+// Function that finds the block after the last block of the newest file in
+// directory parent that has blocks, so that files in the same directory can
+// be placed next to each other.
+// Returns the block, or NO_GOAL if there is no such file.
+uint64_t sibling_goal(struct inode *parent) {
+  if (parent == NULL) return NO_GOAL;
 
-  // If there are more blocks to allocate, continue recursively
-  if ((blocks_to_allocate - extent)) {
-    return allocate_blocks(entries, num_entries, blocks_to_allocate - extent);
+  for (int i = (int)(*parent).num_entries - 1; i >= 0; i--) {
+    struct inode *sibling = (struct inode *)(*parent).entries[i];
+    if ((*sibling).is_directory) continue;
+
+    for (int j = (int)(*sibling).num_entries - 1; j >= 0; j--) {
+      uint32_t blockno;
+      uint32_t extent;
+      unpack_entry((*sibling).entries[j], &blockno, &extent);
+      if (blockno != HOLE_BLOCKNO) return (uint64_t)blockno + extent;
+    }
   }
+  return NO_GOAL;
+}
 
-  // If there are no more blocks to allocate, return success.
-  return entries - 1;
+// Function that allocates nblocks blocks, from the reservation if reserved
+// and else as close after block goal as possible, and stores the runs in a new
+// array in *extents. The array starts small and is doubled as long as the
+// blocks need more runs than it has room for, so it grows with the number of
+// runs and not of blocks. If block allocation fails, nothing has been
+// allocated and there is nothing to undo.
+// Returns the number of runs on success and -1 on failure.
+int allocate_extent_array(uint64_t nblocks, uint64_t goal, int reserved,
+                          struct Extent **extents) {
+  uint64_t most = nblocks < INT32_MAX ? nblocks : INT32_MAX;
+  uint64_t max_extents = most < 16 ? most : 16;
+  struct Extent *grown;
+  int num_extents;
+
+  *extents = NULL;
+  if (most == 0) return -1;
+
+  for (;;) {
+    if ((grown = realloc(*extents, sizeof(struct Extent) * max_extents)) ==
+        NULL)
+      break;
+    *extents = grown;
+
+    num_extents =
+        reserved ? allocate_reserved_extents(nblocks, *extents, max_extents)
+                 : allocate_extents_near(goal, nblocks, *extents, max_extents);
+    if (num_extents >= 0) return num_extents;
+    if (max_extents == most) break;
+    max_extents = 2 * max_extents < most ? 2 * max_extents : most;
+  }
+  free(*extents);
+  *extents = NULL;
+  return -1;
+}
+
+// Function that allocates nblocks blocks as close after block goal as
+// possible and stores them as entries.
+// Returns the number of entries on success and -1 on failure.
+int allocate_entries(uint32_t nblocks, uint64_t goal, uintptr_t **entries) {
+  struct Extent *extents;
+  int num_entries;
+
+  // Allocate all the blocks at once
+  if ((num_entries = allocate_extent_array(nblocks, goal, 0, &extents)) < 0)
+    return -1;
+
+  if ((*entries = malloc(sizeof(uintptr_t) * num_entries)) == NULL) {
+    free_extents(extents, num_entries);
+    free(extents);
+    return -1;
+  }
+  for (int i = 0; i < num_entries; i++)
+    (*entries)[i] = create_entry(extents[i].blockno, extents[i].extent);
+  free(extents);
+
+  return num_entries;
 }
 
 // Function that creates a new file in folder parent, with name name, is
-// readonly if readonly with size size_in_bytes.
+// readonly if readonly with size size_in_bytes. A sparse file gets no blocks,
+// all of it is a hole.
 // Returns NULL upon failure and the new file upon success.
-struct inode *create_file(struct inode *parent, const char *name, char readonly,
-                          int size_in_bytes) {
+struct inode *make_file(struct inode *parent, const char *name, char readonly,
+                        int size_in_bytes, int sparse) {
   struct inode *new_file = NULL;
-  uint32_t num_entries = 0;
+  int num_entries = 0;
   uintptr_t *entries = NULL;
-  uintptr_t *realloc_entries;
   char *name_pointer = NULL;
-  // Calculates ceil(size_in_bytes/BLOCKSIZE)
-  uint32_t entire_file_blockno = (size_in_bytes + BLOCKSIZE - 1) / BLOCKSIZE;
+  uint32_t entire_file_blockno = blocks_for_size(size_in_bytes);
+  // Blocks that only are reserved, and must be given back on failure
+  uint32_t reserved = 0;
 
   // If file already exists or size is 0, do nothing
   if (find_inode_by_name(parent, name) != NULL || !size_in_bytes) {
     return NULL;
   }
 
-  if ((entries = malloc(sizeof(uintptr_t) * entire_file_blockno)) == NULL) {
+  if (sparse) {
+    // A file of at most 2 GiB is a single hole
+    if ((entries = malloc(sizeof(uintptr_t))) == NULL) return NULL;
+    entries[0] = create_entry(HOLE_BLOCKNO, entire_file_blockno);
+    num_entries = 1;
+  } else if (disk_free_blocks() < entire_file_blockno) {
+    // Fail before allocating anything if the file cannot fit
     return NULL;
-  }
-  // If block allocation fails, do nothing
-  if (allocate_blocks(entries, &num_entries, entire_file_blockno) == NULL) {
-    free_file(new_file, entries, name_pointer, num_entries);
-    return NULL;
-  }
-
-  // Reallocate entries array to be only the used size.
-  if ((realloc_entries = realloc(entries, sizeof(uintptr_t) * num_entries)) ==
-      NULL) {
-    free_file(new_file, entries, name_pointer, num_entries);
+  } else if (delayed_allocation) {
+    // The blocks are chosen by flush_files, only set them aside here
+    if (grow_pending_files() || reserve_blocks(entire_file_blockno))
+      return NULL;
+    reserved = entire_file_blockno;
+  } else if ((num_entries = allocate_entries(
+                  entire_file_blockno, sibling_goal(parent), &entries)) < 0) {
     return NULL;
   }
 
   // If memory allocation fails, do nothing
-  if ((name_pointer = copy_string(name)) == NULL) {
-    free_file(new_file, entries, name_pointer, num_entries);
-    return NULL;
-  }
-  if ((new_file = malloc(sizeof(struct inode))) == NULL) {
+  if ((name_pointer = copy_string(name)) == NULL ||
+      (new_file = malloc(sizeof(struct inode))) == NULL) {
+    unreserve_blocks(reserved);
     free_file(new_file, entries, name_pointer, num_entries);
     return NULL;
   }
@@ -207,16 +355,36 @@ struct inode *create_file(struct inode *parent, const char *name, char readonly,
                              .is_readonly = readonly,
                              .filesize = (uint32_t)size_in_bytes,
                              .num_entries = num_entries,
-                             .entries = realloc_entries};
+                             .entries = entries};
+
+  if (map_entries((*new_file).id, entries, num_entries)) {
+    unreserve_blocks(reserved);
+    free_file(new_file, entries, name_pointer, num_entries);
+    return NULL;
+  }
 
   if (add_inode(parent, new_file)) {
+    unmap_entries((*new_file).id, entries, num_entries);
+    unreserve_blocks(reserved);
     free_file(new_file, entries, name_pointer, num_entries);
     return NULL;
   }
 
+  if (reserved) pending_files[num_pending++] = new_file;
+
   return new_file;
 }
 
+struct inode *create_file(struct inode *parent, const char *name, char readonly,
+                          int size_in_bytes) {
+  return make_file(parent, name, readonly, size_in_bytes, 0);
+}
+
+struct inode *create_sparse_file(struct inode *parent, const char *name,
+                                 char readonly, int size_in_bytes) {
+  return make_file(parent, name, readonly, size_in_bytes, 1);
+}
+
 // Function that creates a new directory in directory parent with name name.
 // Returns NULL upon failure and the new directory upon success.
 struct inode *create_dir(struct inode *parent, const char *name) {
@@ -259,7 +427,7 @@ struct inode *find_inode_by_name(struct inode *parent, const char *name) {
   }
 
   if ((*parent).is_directory) {
-    for (int entry = 0; entry < (*parent).num_entries; entry++) {
+    for (uint32_t entry = 0; entry < (*parent).num_entries; entry++) {
       if (strcmp((*(struct inode *)(*parent).entries[entry]).name, name) == 0) {
         return (struct inode *)(*parent).entries[entry];
       }
@@ -278,6 +446,9 @@ int delete_file(struct inode *parent, struct inode *node) {
 
   if (delete_inode(parent, node)) return -1;
 
+  drop_pending_file(node);
+  drop_defrag_file(node);
+  unmap_entries((*node).id, (*node).entries, (*node).num_entries);
   free_file(node, (*node).entries, (*node).name, (*node).num_entries);
 
   return 0;
@@ -310,7 +481,10 @@ void write(FILE *f, uint32_t bytes) {
   fwrite(&writer, 1, 4, f);
 }
 
-// Function that writes inode and all its children to writer
+// Function that writes inode and all its children to writer. The inode is
+// written with all its entries first, the ids of the children for a
+// directory, and then the children one after the other, which is the order
+// load_inodes reads them in.
 void save_inodes_recursive(FILE *f, struct inode *root) {
   // Write the id
   write(f, (*root).id);
@@ -326,14 +500,20 @@ void save_inodes_recursive(FILE *f, struct inode *root) {
   // Write rdonly-flag
   fwrite(&(*root).is_readonly, 1, 1, f);
 
+  // Only files have a size
+  if (!(*root).is_directory) write(f, (*root).filesize);
+
+  write(f, (*root).num_entries);
+
   if ((*root).is_directory) {
-    for (int i = 0; i < (*root).num_entries; i++) {
+    for (uint32_t i = 0; i < (*root).num_entries; i++) {
       write(f, (*(struct inode *)(*root).entries[i]).id);
       write(f, 0);
-      save_inodes_recursive(f, (struct inode *)(*root).entries[i]);
     }
+    for (uint32_t i = 0; i < (*root).num_entries; i++)
+      save_inodes_recursive(f, (struct inode *)(*root).entries[i]);
   } else {
-    for (int i = 0; i < (*root).num_entries; i++) {
+    for (uint32_t i = 0; i < (*root).num_entries; i++) {
       uint32_t blockno;
       uint32_t extent;
 
@@ -344,14 +524,655 @@ void save_inodes_recursive(FILE *f, struct inode *root) {
   }
 }
 
+void set_delayed_allocation(int on) { delayed_allocation = on; }
+
+// Function that places a file of nblocks blocks in extents, starting at block
+// offset of extent *first, and stores its entries in entries unless it is
+// NULL. Moves *first and *offset past the blocks of the file.
+// Returns the number of entries.
+uint32_t place_file(const struct Extent *extents, int *first, uint32_t *offset,
+                    uint32_t nblocks, uintptr_t *entries) {
+  uint32_t count = 0;
+
+  while (nblocks > 0) {
+    uint32_t take = extents[*first].extent - *offset;
+    if (take > nblocks) take = nblocks;
+
+    if (entries != NULL)
+      entries[count] = create_entry(extents[*first].blockno + *offset, take);
+    count++;
+    nblocks -= take;
+    *offset += take;
+    if (*offset == extents[*first].extent) {
+      (*first)++;
+      *offset = 0;
+    }
+  }
+  return count;
+}
+
+int flush_files() {
+  uint64_t total_blocks = 0;
+  struct Extent *extents;
+  int num_extents;
+
+  if (num_pending == 0) return 0;
+
+  for (uint32_t i = 0; i < num_pending; i++)
+    total_blocks += blocks_for_size((*pending_files[i]).filesize);
+
+  // Allocate the blocks of all pending files together, so that they are
+  // placed one after the other in as few runs as possible
+  if ((num_extents =
+           allocate_extent_array(total_blocks, NO_GOAL, 1, &extents)) < 0)
+    return -1;
+
+  // Place every file and add its blocks to the reverse map before changing
+  // any file, so that a failure can give back the blocks and leave the files
+  // pending
+  uintptr_t **entries = calloc(num_pending, sizeof(uintptr_t *));
+  uint32_t *counts = calloc(num_pending, sizeof(uint32_t));
+  int first = 0;
+  uint32_t offset = 0;
+  uint32_t placed = 0;
+  for (; entries != NULL && counts != NULL && placed < num_pending; placed++) {
+    struct inode *file = pending_files[placed];
+    uint32_t nblocks = blocks_for_size((*file).filesize);
+    int file_first = first;
+    uint32_t file_offset = offset;
+
+    counts[placed] = place_file(extents, &first, &offset, nblocks, NULL);
+    if ((entries[placed] = malloc(sizeof(uintptr_t) * counts[placed])) ==
+        NULL)
+      break;
+    place_file(extents, &file_first, &file_offset, nblocks, entries[placed]);
+    if (map_entries((*file).id, entries[placed], counts[placed])) {
+      free(entries[placed]);
+      break;
+    }
+  }
+  if (entries == NULL || counts == NULL || placed < num_pending) {
+    for (uint32_t i = 0; entries != NULL && i < placed; i++) {
+      unmap_entries((*pending_files[i]).id, entries[i], counts[i]);
+      free(entries[i]);
+    }
+    free(entries);
+    free(counts);
+    // The blocks go straight back into the reservation of the pending files
+    if (free_reserved_extents(extents, num_extents))
+      fprintf(stderr, "Failed to give back the blocks of the pending files\n");
+    free(extents);
+    return -1;
+  }
+
+  for (uint32_t i = 0; i < num_pending; i++) {
+    (*pending_files[i]).entries = entries[i];
+    (*pending_files[i]).num_entries = counts[i];
+  }
+
+  free(entries);
+  free(counts);
+  free(extents);
+  free(pending_files);
+  pending_files = NULL;
+  num_pending = 0;
+  return 0;
+}
+
+// Function that adds every file below node with more than one entry to
+// defrag_files, which has room for *capacity files.
+// Returns 0 on success and -1 on failure.
+int queue_fragmented_files(struct inode *node, uint32_t *capacity) {
+  if ((*node).is_directory) {
+    for (uint32_t i = 0; i < (*node).num_entries; i++)
+      if (queue_fragmented_files((struct inode *)(*node).entries[i], capacity))
+        return -1;
+    return 0;
+  }
+
+  if ((*node).num_entries < 2) return 0;
+
+  if (num_defrag_files == *capacity) {
+    uint32_t new_capacity = *capacity ? 2 * *capacity : 64;
+    struct inode **new_files;
+    if ((new_files = realloc(defrag_files,
+                             new_capacity * sizeof(defrag_files[0]))) == NULL)
+      return -1;
+    defrag_files = new_files;
+    *capacity = new_capacity;
+  }
+  defrag_files[num_defrag_files++] = node;
+  return 0;
+}
+
+void defrag_stop() {
+  free(defrag_files);
+  defrag_files = NULL;
+  num_defrag_files = 0;
+  next_defrag_file = 0;
+}
+
+int defrag_start(struct inode *root) {
+  uint32_t capacity = 0;
+
+  defrag_stop();
+  defrag_state = (struct defrag_progress){0};
+  if (queue_fragmented_files(root, &capacity)) {
+    defrag_stop();
+    return -1;
+  }
+  defrag_state.files_total = num_defrag_files;
+  return num_defrag_files;
+}
+
+void defrag_progress(struct defrag_progress *progress) {
+  *progress = defrag_state;
+}
+
+// Function that merges the entries of file that follow each other on disk,
+// and holes that follow each other, as long as the merged extent fits in an
+// entry. The runs in block_owners are changed in place, so this cannot fail.
+void merge_entries(struct inode *file) {
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < (*file).num_entries; i++) {
+    uint32_t blockno, extent, last_blockno, last_extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    if (count > 0) {
+      unpack_entry((*file).entries[count - 1], &last_blockno, &last_extent);
+      if (blockno == HOLE_BLOCKNO || last_blockno == HOLE_BLOCKNO) {
+        if (blockno == last_blockno &&
+            (uint64_t)last_extent + extent <= MAX_EXTENT_LEN) {
+          (*file).entries[count - 1] =
+              create_entry(HOLE_BLOCKNO, last_extent + extent);
+          continue;
+        }
+      } else if ((uint64_t)last_blockno + last_extent == blockno &&
+                 (uint64_t)last_extent + extent <= MAX_EXTENT_LEN) {
+        (*file).entries[count - 1] =
+            create_entry(last_blockno, last_extent + extent);
+        unmap_entries((*file).id, &(*file).entries[i], 1);
+        struct owner_run *run = reverse_map_find(&block_owners, last_blockno);
+        if (run != NULL && (*run).inode_id == (*file).id)
+          (*run).len = last_extent + extent;
+        continue;
+      }
+    }
+    if (blockno != HOLE_BLOCKNO) {
+      struct owner_run *run = reverse_map_find(&block_owners, blockno);
+      if (run != NULL && (*run).inode_id == (*file).id) (*run).entry = count;
+    }
+    (*file).entries[count++] = (*file).entries[i];
+  }
+  (*file).num_entries = count;
+}
+
+// Function that moves the nblocks blocks of file to one free run, as close
+// after its first block as possible.
+// Returns 1 if the file was moved, 0 if there is no free run that is long
+// enough and -1 on failure.
+int move_file(struct inode *file, uint64_t nblocks) {
+  struct Extent run;
+  uintptr_t *entries;
+  uint32_t blockno;
+
+  unpack_entry((*file).entries[0], &blockno, NULL);
+  if (allocate_extents_near(blockno, nblocks, &run, 1) != 1) return 0;
+
+  if ((entries = malloc(sizeof(uintptr_t))) == NULL) {
+    free_extent(run.blockno, run.extent);
+    return -1;
+  }
+  entries[0] = create_entry(run.blockno, run.extent);
+
+  // Copy the data, if the disk has any, one extent at a time
+  uint64_t copied = 0;
+  for (uint32_t i = 0; disk_data_is_open() && i < (*file).num_entries; i++) {
+    uint32_t extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    if (disk_copy_blocks(blockno, run.blockno + copied, extent)) {
+      free_extent(run.blockno, run.extent);
+      free(entries);
+      return -1;
+    }
+    copied += extent;
+  }
+
+  if (map_entries((*file).id, entries, 1)) {
+    free_extent(run.blockno, run.extent);
+    free(entries);
+    return -1;
+  }
+
+  // Point the file at the new run and give back the old blocks
+  unmap_entries((*file).id, (*file).entries, (*file).num_entries);
+  for (uint32_t i = 0; i < (*file).num_entries; i++) {
+    uint32_t extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    free_extent(blockno, extent);
+  }
+  free((*file).entries);
+  (*file).entries = entries;
+  (*file).num_entries = 1;
+  return 1;
+}
+
+int defrag_step(uint64_t max_blocks) {
+  uint64_t moved = 0;
+
+  while (next_defrag_file < num_defrag_files) {
+    struct inode *file = defrag_files[next_defrag_file];
+    uint64_t nblocks = 0;
+
+    if (file == NULL) {
+      // Deleted since the pass started
+      next_defrag_file++;
+      defrag_state.files_done++;
+      continue;
+    }
+
+    // A sparse file keeps its holes, and is only merged
+    int sparse = 0;
+    for (uint32_t i = 0; i < (*file).num_entries; i++) {
+      uint32_t blockno;
+      uint32_t extent;
+      unpack_entry((*file).entries[i], &blockno, &extent);
+      if (blockno == HOLE_BLOCKNO)
+        sparse = 1;
+      else
+        nblocks += extent;
+    }
+    if (moved > 0 && moved + nblocks > max_blocks) return 1;
+
+    uint32_t entries_before = (*file).num_entries;
+    merge_entries(file);
+
+    int result = 0;
+    if ((*file).num_entries > 1 && !sparse &&
+        (result = move_file(file, nblocks)) < 0)
+      return -1;
+
+    if (result) {
+      moved += nblocks;
+      defrag_state.files_moved++;
+      defrag_state.blocks_moved += nblocks;
+    } else if ((*file).num_entries > 1) {
+      defrag_state.files_skipped++;
+    }
+    defrag_state.entries_before += entries_before;
+    defrag_state.entries_after += (*file).num_entries;
+    defrag_state.files_done++;
+    next_defrag_file++;
+  }
+
+  defrag_stop();
+  return 0;
+}
+
+// The transfers of read_file(), write_file() and read_files() are collected
+// in batches of up to IO_BATCH and handed to disk_submit() together, which
+// can do a whole batch with a single system call.
+#define IO_BATCH 64
+
+struct io_batch {
+  struct disk_io ios[IO_BATCH];
+  int num_ios;
+};
+
+// Function that submits the transfers collected in batch.
+// Returns 0 on success and -1 on failure.
+int submit_io_batch(struct io_batch *batch) {
+  int result = disk_submit((*batch).ios, (*batch).num_ios);
+  (*batch).num_ios = 0;
+  return result;
+}
+
+// Function that adds the transfers for the bytes [off, off+len) of file to
+// batch, one for every extent they touch, reading into buf (write == 0) or
+// writing from it. Full batches are submitted on the way. Holes are read as
+// zeros and skipped by writes, so bytes that must be kept need fill_holes()
+// first.
+// Returns 0 on success and -1 on failure.
+int file_io(struct io_batch *batch, struct inode *file, uint64_t off,
+            char *buf, uint64_t len, int write) {
+  uint64_t block_size = disk_block_size();
+  uint64_t extent_off = 0;
+
+  for (uint32_t i = 0; i < (*file).num_entries && len > 0; i++) {
+    uint32_t blockno;
+    uint32_t extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    uint64_t extent_bytes = (uint64_t)extent * block_size;
+
+    if (off < extent_off + extent_bytes) {
+      uint64_t skip = off - extent_off;
+      uint64_t n = extent_bytes - skip;
+      if (n > len) n = len;
+
+      if (blockno == HOLE_BLOCKNO) {
+        if (!write) memset(buf, 0, n);
+      } else {
+        if ((*batch).num_ios == IO_BATCH && submit_io_batch(batch)) return -1;
+        (*batch).ios[(*batch).num_ios++] = (struct disk_io){
+            .buf = buf,
+            .len = n,
+            .off = (uint64_t)blockno * block_size + skip,
+            .write = write,
+        };
+      }
+      buf += n;
+      off += n;
+      len -= n;
+    }
+    extent_off += extent_bytes;
+  }
+  return 0;
+}
+
+// Function that limits [off, off+*len) to the size of file and makes sure
+// the file has its blocks, allocating them if it is still pending.
+// Returns 0 on success and -1 on failure.
+int prepare_file_io(struct inode *file, uint64_t off, uint64_t *len) {
+  if ((*file).is_directory) return -1;
+
+  if (off >= (*file).filesize)
+    *len = 0;
+  else if (*len > (*file).filesize - off)
+    *len = (*file).filesize - off;
+
+  if (!(*file).num_entries && *len > 0 && flush_files()) return -1;
+  return 0;
+}
+
+// Function that replaces the blocks [first, first+nblocks) of file, counted
+// from its start, with the num_with entries in with, which must hold as many
+// blocks. Entries that the range only partly covers are split, and the blocks
+// on disk that it covers are freed.
+// Returns 0 on success and -1 on failure, in which case file is unchanged.
+int replace_blocks(struct inode *file, uint64_t first, uint64_t nblocks,
+                   const uintptr_t *with, uint32_t num_with) {
+  uint64_t end = first + nblocks;
+  uint32_t count = 0;
+  uint64_t pos = 0;
+  uintptr_t *entries;
+
+  // Only the entry that holds both ends of the range can give two pieces
+  if ((entries = malloc(sizeof(uintptr_t) *
+                        ((*file).num_entries + num_with + 1))) == NULL)
+    return -1;
+
+  for (uint32_t i = 0; i < (*file).num_entries; i++) {
+    uint32_t blockno;
+    uint32_t extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    uint64_t entry_end = pos + extent;
+
+    if (pos < first)
+      entries[count++] =
+          create_entry(blockno, (entry_end < first ? entry_end : first) - pos);
+    if (entry_end > first && pos <= first) {
+      memcpy(&entries[count], with, sizeof(uintptr_t) * num_with);
+      count += num_with;
+    }
+    if (entry_end > end) {
+      uint64_t from = pos > end ? pos : end;
+      uint32_t from_blockno =
+          blockno == HOLE_BLOCKNO ? HOLE_BLOCKNO : blockno + (from - pos);
+      entries[count++] = create_entry(from_blockno, entry_end - from);
+    }
+    pos = entry_end;
+  }
+
+  unmap_entries((*file).id, (*file).entries, (*file).num_entries);
+  if (map_entries((*file).id, entries, count)) {
+    map_entries((*file).id, (*file).entries, (*file).num_entries);
+    free(entries);
+    return -1;
+  }
+
+  // Give back the blocks the range covered
+  pos = 0;
+  for (uint32_t i = 0; i < (*file).num_entries; i++) {
+    uint32_t blockno;
+    uint32_t extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    uint64_t from = pos > first ? pos : first;
+    uint64_t to = pos + extent < end ? pos + extent : end;
+
+    if (blockno != HOLE_BLOCKNO && from < to)
+      free_extent(blockno + (from - pos), to - from);
+    pos += extent;
+  }
+
+  free((*file).entries);
+  (*file).entries = entries;
+  (*file).num_entries = count;
+  merge_entries(file);
+  return 0;
+}
+
+// Function that writes zeros to the disk block blockno.
+// Returns 0 on success and -1 on failure.
+int zero_block(uint32_t blockno) {
+  uint64_t block_size = disk_block_size();
+  char *zeros = calloc(1, block_size);
+
+  if (zeros == NULL) return -1;
+  int result = disk_write(zeros, block_size, blockno * block_size);
+  free(zeros);
+  return result;
+}
+
+// Function that gives blocks to the holes of file that the bytes
+// [off, off+len) touch, as close after the blocks before them as possible.
+// The parts of new blocks that the bytes do not cover are zeroed, since the
+// disk still has the data of the files that had them before.
+// Returns 0 on success and -1 on failure.
+int fill_holes(struct inode *file, uint64_t off, uint64_t len) {
+  uint64_t block_size = disk_block_size();
+  uint64_t first = off / block_size;
+  uint64_t end = (off + len + block_size - 1) / block_size;
+  uint64_t goal = NO_GOAL;
+  uint64_t pos = 0;
+
+  if (len == 0) return 0;
+
+  for (uint32_t i = 0; i < (*file).num_entries && pos < end; i++) {
+    uint32_t blockno;
+    uint32_t extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    uint64_t from = pos > first ? pos : first;
+    uint64_t to = pos + extent < end ? pos + extent : end;
+    pos += extent;
+
+    if (blockno != HOLE_BLOCKNO) {
+      goal = (uint64_t)blockno + extent;
+      continue;
+    }
+    if (from >= to) continue;
+
+    uintptr_t *entries;
+    int num_entries = allocate_entries(to - from, goal, &entries);
+    if (num_entries < 0) return -1;
+
+    uint32_t head, last, last_extent;
+    unpack_entry(entries[0], &head, NULL);
+    unpack_entry(entries[num_entries - 1], &last, &last_extent);
+    if ((disk_data_is_open() && from * block_size < off && zero_block(head)) ||
+        (disk_data_is_open() && to * block_size > off + len &&
+         zero_block(last + last_extent - 1)) ||
+        replace_blocks(file, from, to - from, entries, num_entries)) {
+      free_file(NULL, entries, NULL, num_entries);
+      return -1;
+    }
+    free(entries);
+
+    // The entries have changed, go on after the blocks that were filled
+    if (to == end) return 0;
+    return fill_holes(file, to * block_size, off + len - to * block_size);
+  }
+  return 0;
+}
+
+int punch_hole(struct inode *file, uint64_t off, uint64_t len) {
+  uint64_t block_size = disk_block_size();
+  struct io_batch batch = {.num_ios = 0};
+
+  if ((*file).is_readonly || prepare_file_io(file, off, &len)) return -1;
+  if (len == 0) return 0;
+
+  // Whole blocks become a hole. The last block of the file is whole when
+  // the range runs to the end of the file.
+  uint64_t end = off + len;
+  uint64_t first = (off + block_size - 1) / block_size;
+  uint64_t last = end == (*file).filesize ? blocks_for_size(end)
+                                          : end / block_size;
+
+  // The bytes in the blocks that are only partly punched are zeroed, when
+  // there is a data file to zero them in
+  if (disk_data_is_open()) {
+    char *zeros = calloc(1, block_size);
+    if (zeros == NULL) return -1;
+    uint64_t head_end = first * block_size < end ? first * block_size : end;
+    int result = file_io(&batch, file, off, zeros, head_end - off, 1);
+    if (last >= first && last * block_size < end)
+      result = result || file_io(&batch, file, last * block_size, zeros,
+                                 end - last * block_size, 1);
+    result = result || submit_io_batch(&batch);
+    free(zeros);
+    if (result) return -1;
+  }
+
+  if (first >= last) return 0;
+  uintptr_t hole = create_entry(HOLE_BLOCKNO, last - first);
+  return replace_blocks(file, first, last - first, &hole, 1);
+}
+
+ssize_t read_file(struct inode *file, uint64_t off, void *buf, uint64_t len) {
+  struct io_batch batch = {.num_ios = 0};
+
+  if (prepare_file_io(file, off, &len) ||
+      file_io(&batch, file, off, buf, len, 0) || submit_io_batch(&batch))
+    return -1;
+  return len;
+}
+
+ssize_t write_file(struct inode *file, uint64_t off, const void *buf,
+                   uint64_t len) {
+  struct io_batch batch = {.num_ios = 0};
+
+  if ((*file).is_readonly || prepare_file_io(file, off, &len) ||
+      fill_holes(file, off, len) ||
+      file_io(&batch, file, off, (char *)buf, len, 1) ||
+      submit_io_batch(&batch))
+    return -1;
+  return len;
+}
+
+int read_files(struct inode **files, int num_files, void **bufs) {
+  struct io_batch batch = {.num_ios = 0};
+
+  for (int i = 0; i < num_files; i++) {
+    uint64_t len = (*files[i]).filesize;
+    if (prepare_file_io(files[i], 0, &len) ||
+        file_io(&batch, files[i], 0, bufs[i], len, 0))
+      return -1;
+  }
+  return submit_io_batch(&batch);
+}
+
+int fs_sync() {
+  if (flush_files()) return -1;
+  return disk_data_is_open() ? disk_sync() : 0;
+}
+
+// The readahead window of a file_reader, see file_reader_read().
+#define READAHEAD_MIN (128 * 1024)
+#define READAHEAD_MAX (8 * 1024 * 1024)
+
+// Function that asks for the bytes [off, off+len) of file to be read into
+// the page cache, with one disk_prefetch() for every extent they touch.
+// Returns 0 on success and -1 on failure.
+int prefetch_file(struct inode *file, uint64_t off, uint64_t len) {
+  uint64_t block_size = disk_block_size();
+  uint64_t extent_off = 0;
+
+  for (uint32_t i = 0; i < (*file).num_entries && len > 0; i++) {
+    uint32_t blockno;
+    uint32_t extent;
+    unpack_entry((*file).entries[i], &blockno, &extent);
+    uint64_t extent_bytes = (uint64_t)extent * block_size;
+
+    if (off < extent_off + extent_bytes) {
+      uint64_t skip = off - extent_off;
+      uint64_t n = extent_bytes - skip;
+      if (n > len) n = len;
+
+      if (blockno != HOLE_BLOCKNO &&
+          disk_prefetch((uint64_t)blockno * block_size + skip, n))
+        return -1;
+      off += n;
+      len -= n;
+    }
+    extent_off += extent_bytes;
+  }
+  return 0;
+}
+
+void file_reader_open(struct file_reader *reader, struct inode *file) {
+  (*reader).file = file;
+  (*reader).next_off = 0;
+  (*reader).window = 0;
+  (*reader).ahead = 0;
+}
+
+ssize_t file_reader_read(struct file_reader *reader, uint64_t off, void *buf,
+                         uint64_t len) {
+  struct inode *file = (*reader).file;
+  struct io_batch batch = {.num_ios = 0};
+
+  if (prepare_file_io(file, off, &len)) return -1;
+  uint64_t end = off + len;
+
+  if (off != (*reader).next_off) {
+    (*reader).window = 0;
+    (*reader).ahead = end;
+  } else if ((*reader).window == 0) {
+    (*reader).window = READAHEAD_MIN;
+  } else if ((*reader).window < READAHEAD_MAX) {
+    (*reader).window *= 2;
+  }
+  (*reader).next_off = end;
+
+  // Ask for the next window once less than half of it is left ahead of
+  // the read, so that the prefetches are few and large.
+  if ((*reader).window > 0 && (*reader).ahead < end + (*reader).window / 2 &&
+      (*reader).ahead < (*file).filesize) {
+    uint64_t from = (*reader).ahead > end ? (*reader).ahead : end;
+    uint64_t to = end + (*reader).window;
+    if (to > (*file).filesize) to = (*file).filesize;
+    if (from < to && prefetch_file(file, from, to - from)) return -1;
+    (*reader).ahead = to;
+  }
+
+  if (file_io(&batch, file, off, buf, len, 0) || submit_io_batch(&batch))
+    return -1;
+  return len;
+}
+
 void save_inodes(const char *master_file_table, struct inode *root) {
+  if (flush_files()) {
+    fprintf(stderr, "Failed to allocate the blocks of pending files\n");
+    return;
+  }
+
   FILE *f = fopen(master_file_table, "w");
   save_inodes_recursive(f, root);
   fclose(f);
 }
 
 void safe_fread(void *buffer, size_t size, size_t count, FILE *stream) {
-  int rc = fread(buffer, size, count, stream);
+  size_t rc = fread(buffer, size, count, stream);
 
   if (rc != count) {
     fprintf(stderr, "Failed to read from file\n");
@@ -408,33 +1229,125 @@ long get_file_size(FILE *f) {
   return end_pos;
 }
 
+// Function that compares two inode pointers by the id of the inodes, for
+// qsort and bsearch.
+int compare_inode_ids(const void *a, const void *b) {
+  uint32_t id_a = (**(struct inode *const *)a).id;
+  uint32_t id_b = (**(struct inode *const *)b).id;
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+// Function that finds the inode with id id in inodes, which is sorted by id.
+// Returns its index, or -1 if there is no such inode.
+int find_inode_index(uint32_t id, struct inode **inodes, int total_inodes) {
+  struct inode key = {.id = id};
+  struct inode *key_pointer = &key;
+  struct inode **found = bsearch(&key_pointer, inodes, total_inodes,
+                                 sizeof(inodes[0]), compare_inode_ids);
+  return found ? (int)(found - inodes) : -1;
+}
+
 struct inode *resolve_inode_reference(uint32_t id, struct inode **inodes,
                                       int total_inodes) {
-  for (int node = 0; node < total_inodes; node++) {
-    if ((*inodes[node]).id == id) {
-      return inodes[node];
+  int index = find_inode_index(id, inodes, total_inodes);
+  return index < 0 ? NULL : inodes[index];
+}
+
+// Function that releases the inodes that cannot be reached from root, after
+// a lenient load. Every other inode has been linked to at most one directory,
+// so the inodes that are reached are marked by a walk from root.
+// Returns 0 on success and -1 on failure.
+int release_unreached(struct inode *root, struct inode **inodes,
+                      int total_inodes) {
+  char *reached = calloc(total_inodes, 1);
+  struct inode **stack = malloc(sizeof(stack[0]) * total_inodes);
+  int depth = 0;
+
+  if (reached == NULL || stack == NULL) {
+    free(reached);
+    free(stack);
+    return -1;
+  }
+
+  reached[find_inode_index((*root).id, inodes, total_inodes)] = 1;
+  stack[depth++] = root;
+  while (depth > 0) {
+    struct inode *node = stack[--depth];
+    if (!(*node).is_directory) continue;
+
+    for (uint32_t i = 0; i < (*node).num_entries; i++) {
+      struct inode *child = (struct inode *)(*node).entries[i];
+      reached[find_inode_index((*child).id, inodes, total_inodes)] = 1;
+      stack[depth++] = child;
     }
   }
 
-  return NULL;
+  for (int node = 0; node < total_inodes; node++) {
+    if (reached[node]) continue;
+
+    if (!(*inodes[node]).is_directory)
+      unmap_entries((*inodes[node]).id, (*inodes[node]).entries,
+                    (*inodes[node]).num_entries);
+    free((*inodes[node]).name);
+    free((*inodes[node]).entries);
+    free(inodes[node]);
+  }
+
+  free(reached);
+  free(stack);
+  return 0;
 }
 
-struct inode *load_inodes(const char *master_file_table) {
+// Function that reads the master file table and links the inodes. If
+// dangling is NULL, a reference to an inode that is not in the file ends
+// the program. Otherwise such references, and references to the root or to
+// an inode that another directory holds already, are dropped from their
+// directory and counted in *dangling, and the inodes that cannot be reached
+// from the root are released.
+// Returns the root, or NULL on failure.
+struct inode *read_inodes(const char *master_file_table, uint64_t *dangling) {
   FILE *f = fopen(master_file_table, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open %s\n", master_file_table);
+    return NULL;
+  }
   long end_pos = get_file_size(f);
 
   int total_inodes = 0;
+  int capacity = 0;
   struct inode **inodes = NULL;
 
   while (ftell(f) != end_pos) {
-    if ((inodes = realloc(inodes, (total_inodes + 1) *
-                                      sizeof(struct inode *))) == NULL) {
-      fprintf(stderr, "Failed to reallocate inodes list");
-    };
+    // Grow the list by doubling, images can hold millions of inodes
+    if (total_inodes == capacity) {
+      capacity = capacity ? 2 * capacity : 64;
+      if ((inodes = realloc(inodes, capacity * sizeof(struct inode *))) ==
+          NULL) {
+        fprintf(stderr, "Failed to reallocate inodes list");
+        exit(1);
+      }
+    }
 
     inodes[total_inodes] = read_next_inode(f);
     total_inodes++;
   }
+  fclose(f);
+
+  if (total_inodes == 0) {
+    free(inodes);
+    return NULL;
+  }
+
+  // The root is the first inode in the file. The others are sorted by id,
+  // so that references are resolved by binary search
+  struct inode *root = inodes[0];
+  qsort(inodes, total_inodes, sizeof(inodes[0]), compare_inode_ids);
+
+  char *linked = NULL;
+  if (dangling != NULL && (linked = calloc(total_inodes, 1)) == NULL) {
+    fprintf(stderr, "Failed to allocate memory for %s\n", master_file_table);
+    exit(1);
+  }
 
   for (int node = 0; node < total_inodes; node++) {
     int id = (*inodes[node]).id;
@@ -443,37 +1356,70 @@ struct inode *load_inodes(const char *master_file_table) {
     }
 
     if ((*inodes[node]).is_directory != 0x01) {
+      if (map_entries(id, (*inodes[node]).entries,
+                      (*inodes[node]).num_entries)) {
+        fprintf(stderr, "Failed to map the blocks of file %s",
+                (*inodes[node]).name);
+        exit(1);
+      }
       continue;
     }
 
-    for (int entry = 0; entry < (*inodes[node]).num_entries; entry++) {
-      struct inode *entry_ref = resolve_inode_reference(
-          (*inodes[node]).entries[entry], inodes, total_inodes);
-
-      if (entry_ref == NULL) {
-        fprintf(stderr,
-                "Failed to resolve inode reference #%d for directory %s", entry,
-                (*inodes[node]).name);
-        exit(1);
+    uint32_t kept = 0;
+    for (uint32_t entry = 0; entry < (*inodes[node]).num_entries; entry++) {
+      int index = find_inode_index((*inodes[node]).entries[entry], inodes,
+                                   total_inodes);
+
+      if (dangling == NULL) {
+        if (index < 0) {
+          fprintf(stderr,
+                  "Failed to resolve inode reference #%d for directory %s",
+                  entry, (*inodes[node]).name);
+          exit(1);
+        }
+      } else if (index < 0 || inodes[index] == root || linked[index]) {
+        (*dangling)++;
+        continue;
+      } else {
+        linked[index] = 1;
       }
 
-      (*inodes[node]).entries[entry] = (uintptr_t)entry_ref;
+      (*inodes[node]).entries[kept++] = (uintptr_t)inodes[index];
     }
+    (*inodes[node]).num_entries = kept;
   }
 
-  struct inode *root = inodes[0];
+  if (dangling != NULL && release_unreached(root, inodes, total_inodes)) {
+    fprintf(stderr, "Failed to allocate memory for %s\n", master_file_table);
+    exit(1);
+  }
 
+  free(linked);
   free(inodes);
-  fclose(f);
 
   return root;
 }
 
+struct inode *load_inodes(const char *master_file_table) {
+  return read_inodes(master_file_table, NULL);
+}
+
+struct inode *load_inodes_lenient(const char *master_file_table,
+                                  uint64_t *dangling) {
+  *dangling = 0;
+  return read_inodes(master_file_table, dangling);
+}
+
 void fs_shutdown(struct inode *inode) {
   if ((*inode).is_directory)
-    for (int i = 0; i < (*inode).num_entries; i++) {
+    for (uint32_t i = 0; i < (*inode).num_entries; i++) {
       fs_shutdown((struct inode *)(*inode).entries[i]);
     }
+  else {
+    drop_pending_file(inode);
+    drop_defrag_file(inode);
+    unmap_entries((*inode).id, (*inode).entries, (*inode).num_entries);
+  }
 
   free((*inode).name);
   free((*inode).entries);
@@ -490,7 +1436,7 @@ static void debug_fs_print_table(const char *table);
 static void debug_fs_tree_walk(struct inode *node, char *table);
 
 void debug_fs(struct inode *node) {
-  char *table = calloc(NUM_BLOCKS, 1);
+  char *table = calloc(disk_num_blocks(), 1);
   debug_fs_tree_walk(node, table);
   debug_fs_print_table(table);
   free(table);
@@ -502,7 +1448,7 @@ static void debug_fs_tree_walk(struct inode *node, char *table) {
   if (node->is_directory) {
     printf("%s (id %d)\n", node->name, node->id);
     indent++;
-    for (int i = 0; i < node->num_entries; i++) {
+    for (uint32_t i = 0; i < node->num_entries; i++) {
       struct inode *child = (struct inode *)node->entries[i];
       debug_fs_tree_walk(child, table);
     }
@@ -516,8 +1462,9 @@ static void debug_fs_tree_walk(struct inode *node, char *table) {
      */
     uint32_t *extents = (uint32_t *)node->entries;
 
-    for (int i = 0; i < node->num_entries; i++) {
-      for (int j = 0; j < extents[2 * i + 1]; j++) {
+    for (uint32_t i = 0; i < node->num_entries; i++) {
+      if (extents[2 * i] == HOLE_BLOCKNO) continue;
+      for (uint32_t j = 0; j < extents[2 * i + 1]; j++) {
         table[extents[2 * i] + j] = 1;
       }
     }
@@ -526,8 +1473,8 @@ static void debug_fs_tree_walk(struct inode *node, char *table) {
 
 static void debug_fs_print_table(const char *table) {
   printf("Blocks recorded in master file table:");
-  for (int i = 0; i < NUM_BLOCKS; i++) {
-    if (i % 20 == 0) printf("\n%03d: ", i);
+  for (uint64_t i = 0; i < disk_num_blocks(); i++) {
+    if (i % 20 == 0) printf("\n%03" PRIu64 ": ", i);
     printf("%d", table[i]);
   }
   printf("\n\n");
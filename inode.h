@@ -10,9 +10,45 @@
  * BEGIN: ADD YOUR OWN STRUCT AND MACROS BELOW HERE
  ******************************************************************************/
 
-struct Extent {
-  uint32_t blockno;
-  uint32_t extent;
+#include <sys/types.h>
+
+#include "block_allocation.h"
+
+/* The block number of an entry that is a hole: extent blocks of a
+ * sparse file that have no blocks on disk yet and read as zeros. No
+ * disk has a block with this number, MAX_NUM_BLOCKS stops one short
+ * of it, so holes are saved and loaded like any other entry.
+ */
+#define HOLE_BLOCKNO UINT32_MAX
+
+/* The progress of the defragmentation pass started by defrag_start().
+ * files_total is the number of fragmented files the pass found, and
+ * files_done how many of them it has looked at. Of those, files_moved
+ * got one new run of blocks and files_skipped found no free run that
+ * is long enough; the rest only needed their entries merged or were
+ * deleted in between. The entries of the files that were looked at
+ * are counted before and after.
+ */
+struct defrag_progress {
+  uint32_t files_total;
+  uint32_t files_done;
+  uint32_t files_moved;
+  uint32_t files_skipped;
+  uint64_t blocks_moved;
+  uint64_t entries_before;
+  uint64_t entries_after;
+};
+
+/* A file that is read with file_reader_read(). next_off is where a
+ * sequential read would go on, window the number of bytes to read
+ * ahead of it, or 0 for random reads, and ahead the end of the bytes
+ * that readahead has asked for.
+ */
+struct file_reader {
+  struct inode *file;
+  uint64_t next_off;
+  uint64_t window;
+  uint64_t ahead;
 };
 
 /*******************************************************************************
@@ -41,7 +77,11 @@ struct inode {
  * be a directory. The size of the file is size_in_bytes,
  * and create_file calls the allocate_block() function
  * enough number of times to reserve blocks in the simulated
- * disk to store all of these bytes.
+ * disk to store all of these bytes. The blocks are placed
+ * after the last block of the newest file in parent where
+ * there is room, so that a directory is kept together.
+ * With delayed allocation, the blocks are only reserved
+ * here and allocated later by flush_files().
  * Returns a pointer to file's inodes.
  */
 struct inode *create_file(struct inode *parent, const char *name, char readonly,
@@ -77,7 +117,8 @@ int delete_dir(struct inode *parent, struct inode *node);
 
 /* Write the given inode root and all inodes referenced by it
  * to the master file table, following the oblig instructions.
- * No inodes are changed.
+ * Files that are still waiting for their blocks get them from
+ * flush_files() first; apart from that, no inodes are changed.
  */
 void save_inodes(const char *master_file_table, struct inode *root);
 
@@ -111,6 +152,138 @@ void debug_fs(struct inode *node);
  * BEGIN: ADD YOUR OWN FUNCTION DECLARATIONS BELOW HERE
  ******************************************************************************/
 
+/* Turn delayed allocation on (on != 0) or off. With delayed
+ * allocation, create_file() only reserves the blocks of a file
+ * with reserve_blocks(), and the blocks of all such files are
+ * chosen together by the next flush_files().
+ */
+void set_delayed_allocation(int on);
+
+/* Allocate the blocks of every file that create_file() has only
+ * reserved blocks for, in one run where possible, with the files
+ * placed one after the other in the order they were created.
+ * Returns 0 on success and -1 on failure, in which case the files
+ * keep their reservations and wait for the next call.
+ */
+int flush_files();
+
+/* Start a defragmentation pass over the files below root. Every file
+ * with more than one entry is queued, and defrag_step() moves them one
+ * after the other. A pass that is still running is dropped.
+ * Returns the number of queued files, or -1 on failure.
+ */
+int defrag_start(struct inode *root);
+
+/* Defragment the next queued files, moving at most max_blocks blocks,
+ * or one file if that file alone is longer. Entries of a file that
+ * follow each other on disk are merged first; if more than one is
+ * left, the blocks are moved to a single free run near the first one,
+ * with their data if a data file is open, the entries replaced and
+ * the old blocks freed. Files that are deleted in between are
+ * skipped, so the pass can run a few steps at a time between other
+ * calls, with max_blocks as the throttle.
+ * Returns 1 if files are left, 0 when the pass is done and -1 if
+ * memory allocation or copying the data fails, in which case the file
+ * stays as it was.
+ */
+int defrag_step(uint64_t max_blocks);
+
+/* Store the progress of the current or last pass in progress. */
+void defrag_progress(struct defrag_progress *progress);
+
+/* Drop the rest of the current pass. */
+void defrag_stop();
+
+/* Find the file that owns block, from a map of the blocks of all files
+ * that create_file(), delete_file(), load_inodes() and the other
+ * functions that change entries keep up to date, in O(log n) steps.
+ * Stores the id of the file in *inode_id and the index of the entry
+ * that holds the block in *entry, unless they are NULL.
+ * Returns 0 on success and -1 if no file owns the block.
+ */
+int find_block_owner(uint64_t block, uint32_t *inode_id, uint32_t *entry);
+
+/* Like load_inodes(), for a master file table that may be damaged.
+ * References from a directory to an inode that is not in the file, to
+ * the root or to an inode that another directory holds already are
+ * dropped from the directory and counted in *dangling instead of
+ * ending the program. Inodes that cannot be reached from the root are
+ * released, so their blocks belong to no file.
+ * Returns the root, or NULL if the file cannot be read.
+ */
+struct inode *load_inodes_lenient(const char *master_file_table,
+                                  uint64_t *dangling);
+
+/* Read up to len bytes of file, from byte off on, into buf. The bytes
+ * are read from the data file opened with open_disk_data(), with one
+ * transfer for every extent they touch rather than one per block, and
+ * the transfers are submitted together with disk_submit(). Holes read
+ * as zeros. A file that is still waiting for its blocks gets them
+ * first.
+ * Returns the number of bytes read, which is less than len at the end
+ * of the file, or -1 on failure.
+ */
+ssize_t read_file(struct inode *file, uint64_t off, void *buf, uint64_t len);
+
+/* Like read_file(), but writes the bytes from buf. Files do not grow,
+ * bytes past their size are not written, and read-only files cannot be
+ * written at all. Holes that the bytes touch get their blocks first,
+ * as close after the blocks before them as possible.
+ * Returns the number of bytes written, or -1 on failure.
+ */
+ssize_t write_file(struct inode *file, uint64_t off, const void *buf,
+                   uint64_t len);
+
+/* Read all of files[0], ..., files[num_files-1] into bufs[0], ...,
+ * bufs[num_files-1], which must hold filesize bytes each. The extents
+ * of all the files are submitted together, so that many small files
+ * cost a single system call with the io_uring engine.
+ * Returns 0 on success and -1 on failure.
+ */
+int read_files(struct inode **files, int num_files, void **bufs);
+
+/* Like create_file(), but the file is sparse: it gets no blocks, and
+ * all of it is a hole, an entry with block number HOLE_BLOCKNO. Blocks
+ * are allocated by write_file() for the parts that are written, and
+ * punch_hole() gives them back.
+ * Returns a pointer to the file, or NULL on failure.
+ */
+struct inode *create_sparse_file(struct inode *parent, const char *name,
+                                 char readonly, int size_in_bytes);
+
+/* Give back the blocks of the bytes [off, off+len) of file and make
+ * them a hole, which reads as zeros. Only whole blocks are freed, the
+ * bytes of the range in the blocks at its ends are written with zeros
+ * if a data file is open, except that a range that runs to the end of
+ * the file frees its last block. The size of the file does not change.
+ * Returns 0 on success and -1 on failure.
+ */
+int punch_hole(struct inode *file, uint64_t off, uint64_t len);
+
+/* Make everything that was written so far durable: the files that
+ * wait for their blocks get them, and the dirty blocks of write-back
+ * are written to the data file, which is synced to the device. The
+ * master file table is still only written by save_inodes().
+ * Returns 0 on success and -1 on failure.
+ */
+int fs_sync();
+
+/* Start reading file with reader. */
+void file_reader_open(struct file_reader *reader, struct inode *file);
+
+/* Like read_file(), with readahead. A read that starts where the last
+ * one ended is sequential. Once a file is read sequentially, the
+ * extents that follow the read in the entries of the file are
+ * prefetched with disk_prefetch() before the read itself, so the
+ * kernel reads them while the caller uses the data. This follows the
+ * entries wherever they lie on disk, which block order readahead
+ * cannot do. The window starts at 128 KiB and doubles with every
+ * sequential read up to 8 MiB; a read elsewhere turns it off.
+ * Returns the number of bytes read, or -1 on failure.
+ */
+ssize_t file_reader_read(struct file_reader *reader, uint64_t off, void *buf,
+                         uint64_t len);
+
 /*******************************************************************************
  * END: ADD YOUR OWN FUNCTION DECLARATIONS ABOVE HERE
  ******************************************************************************/
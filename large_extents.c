@@ -0,0 +1,83 @@
+#include "block_allocation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Several allocation groups of 32768 blocks, and runs that are longer
+ * than one of them.
+ */
+#define LARGE_BLOCKS 262144
+#define FIRST_RUN 100000
+
+static int failures = 0;
+
+static void expect(int ok, const char *what) {
+  printf("%-45s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok)
+    failures++;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr,
+            "Usage: %s BAT MODE\n"
+            "       where\n"
+            "       BAT is the name of the block allocation table\n"
+            "       MODE is locked, lock-free or buddy\n",
+            argv[0]);
+    exit(-1);
+  }
+
+  char *bat_name = argv[1];
+  char *mode = argv[2];
+  int flags = 0;
+  enum bat_backend backend = BAT_BACKEND_BITMAP;
+
+  if (strcmp(mode, "locked") == 0) {
+    flags = 0;
+  } else if (strcmp(mode, "lock-free") == 0) {
+    flags = BAT_LOCK_FREE;
+  } else if (strcmp(mode, "buddy") == 0) {
+    backend = BAT_BACKEND_BUDDY;
+  } else {
+    fprintf(stderr, "Unknown mode %s\n", mode);
+    exit(-1);
+  }
+
+  set_block_allocation_table_name_with_flags(bat_name, flags);
+  if (format_disk_with_backend(LARGE_BLOCKS, BLOCKSIZE, backend) != 0)
+    exit(-1);
+
+  struct disk_stats stats;
+  disk_stats(&stats);
+  expect(stats.free_extents == 1 && stats.largest_free_extent == LARGE_BLOCKS,
+         "fresh disk is one free run");
+
+  int first = allocate_block(FIRST_RUN);
+  expect(first >= 0, "allocate 100000 blocks in one call");
+
+  /* The buddy system rounds up to a power of two, so the rest is only
+   * known for the bitmap.
+   */
+  if (backend == BAT_BACKEND_BITMAP) {
+    int rest = allocate_block(LARGE_BLOCKS - FIRST_RUN);
+    expect(rest >= 0, "allocate the other 162144 blocks in one call");
+    expect(disk_free_blocks() == 0, "disk is full");
+    if (rest >= 0)
+      free_extent(rest, LARGE_BLOCKS - FIRST_RUN);
+  }
+  if (first >= 0)
+    free_extent(first, FIRST_RUN);
+
+  int whole = allocate_block(LARGE_BLOCKS);
+  expect(whole == 0, "allocate the whole disk in one call");
+  if (whole >= 0)
+    free_extent(whole, LARGE_BLOCKS);
+
+  disk_stats(&stats);
+  expect(stats.free_extents == 1 && stats.free_blocks == LARGE_BLOCKS,
+         "disk is one free run again");
+
+  return failures ? 1 : 0;
+}
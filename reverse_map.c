@@ -0,0 +1,139 @@
+#include "reverse_map.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* The same xorshift generator as the extent index uses, with a fixed
+ * seed so that tree shapes are reproducible between runs.
+ */
+static uint32_t priority_state = 2463534242u;
+
+static uint32_t next_priority() {
+  priority_state ^= priority_state << 13;
+  priority_state ^= priority_state >> 17;
+  priority_state ^= priority_state << 5;
+  return priority_state;
+}
+
+/* Splits t into the runs that start before key (l) and the runs that
+ * start at or after key (r).
+ */
+static void split(struct owner_run *t, uint64_t key, struct owner_run **l,
+                  struct owner_run **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+  if (t->start < key) {
+    split(t->right, key, &t->right, r);
+    *l = t;
+  } else {
+    split(t->left, key, l, &t->left);
+    *r = t;
+  }
+}
+
+/* Joins two trees where all runs in a come before those in b. */
+static struct owner_run *merge(struct owner_run *a, struct owner_run *b) {
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (a->priority > b->priority) {
+    a->right = merge(a->right, b);
+    return a;
+  }
+  b->left = merge(a, b->left);
+  return b;
+}
+
+static void release(struct owner_run *t) {
+  if (t == NULL)
+    return;
+  release(t->left);
+  release(t->right);
+  free(t);
+}
+
+/* Returns the run with the highest start that is at most block. */
+static struct owner_run *floor_run(struct owner_run *t, uint64_t block) {
+  struct owner_run *best = NULL;
+
+  while (t != NULL) {
+    if (t->start <= block) {
+      best = t;
+      t = t->right;
+    } else {
+      t = t->left;
+    }
+  }
+  return best;
+}
+
+/* Returns the run with the lowest start that is at least block. */
+static struct owner_run *ceiling_run(struct owner_run *t, uint64_t block) {
+  struct owner_run *best = NULL;
+
+  while (t != NULL) {
+    if (t->start >= block) {
+      best = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return best;
+}
+
+void reverse_map_init(struct reverse_map *map) {
+  *map = (struct reverse_map){0};
+}
+
+void reverse_map_clear(struct reverse_map *map) {
+  release(map->root);
+  reverse_map_init(map);
+}
+
+int reverse_map_insert(struct reverse_map *map, uint64_t start, uint64_t len,
+                       uint32_t inode_id, uint32_t entry) {
+  struct owner_run *before = floor_run(map->root, start);
+  struct owner_run *after = ceiling_run(map->root, start);
+  if ((before && before->start + before->len > start) ||
+      (after && after->start < start + len))
+    return 1;
+
+  struct owner_run *run = malloc(sizeof(struct owner_run));
+  if (run == NULL)
+    return -1;
+  *run = (struct owner_run){.start = start,
+                            .len = len,
+                            .inode_id = inode_id,
+                            .entry = entry,
+                            .priority = next_priority()};
+
+  struct owner_run *l, *r;
+  split(map->root, start, &l, &r);
+  map->root = merge(merge(l, run), r);
+  map->num_runs++;
+  return 0;
+}
+
+int reverse_map_remove(struct reverse_map *map, uint64_t start) {
+  struct owner_run *l, *m, *r;
+
+  split(map->root, start, &l, &r);
+  split(r, start + 1, &m, &r);
+  map->root = merge(l, r);
+  if (m == NULL)
+    return -1;
+
+  free(m);
+  map->num_runs--;
+  return 0;
+}
+
+struct owner_run *reverse_map_find(const struct reverse_map *map,
+                                   uint64_t block) {
+  struct owner_run *run = floor_run(map->root, block);
+  return (run && block - run->start < run->len) ? run : NULL;
+}
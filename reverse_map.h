@@ -0,0 +1,56 @@
+#ifndef REVERSE_MAP_H
+#define REVERSE_MAP_H
+
+#include <stdint.h>
+
+/* The blocks [start, start+len) that are entry number entry of the
+ * file with inode id inode_id. The runs of a reverse map are the
+ * nodes of a treap ordered by start block.
+ */
+struct owner_run {
+  uint64_t start;
+  uint64_t len;
+  uint32_t inode_id;
+  uint32_t entry;
+  uint32_t priority;
+
+  struct owner_run *left;
+  struct owner_run *right;
+};
+
+/* The runs of blocks that belong to files, so that the owner of a
+ * block is found in O(log n) steps. Runs in the map never overlap.
+ */
+struct reverse_map {
+  struct owner_run *root;
+  uint64_t num_runs;
+};
+
+/* Make map empty. It must not contain any runs. */
+void reverse_map_init(struct reverse_map *map);
+
+/* Release all runs in the map and make it empty. */
+void reverse_map_clear(struct reverse_map *map);
+
+/* Add the blocks [start, start+len), len >= 1, as entry entry of inode
+ * inode_id.
+ * Returns 0 on success, 1 if some of the blocks are in the map already
+ * and -1 if memory allocation fails. The map is unchanged unless 0 is
+ * returned.
+ */
+int reverse_map_insert(struct reverse_map *map, uint64_t start, uint64_t len,
+                       uint32_t inode_id, uint32_t entry);
+
+/* Remove the run that starts at block start and release it.
+ * Returns 0 on success and -1 if no run starts there.
+ */
+int reverse_map_remove(struct reverse_map *map, uint64_t start);
+
+/* Return the run that contains block, or NULL. The len and entry of
+ * the run may be changed in place, as long as it does not grow over
+ * another run.
+ */
+struct owner_run *reverse_map_find(const struct reverse_map *map,
+                                   uint64_t block);
+
+#endif // REVERSE_MAP_H
@@ -0,0 +1,392 @@
+#include "run_search.h"
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define BITS_PER_WORD 64
+#define ALL_ONES (~(uint64_t)0)
+
+/* The operations that are done many entries at a time. */
+struct kernel {
+  const char *name;
+
+  /* bitmap_skip_words() */
+  uint64_t (*skip_words)(const uint64_t *words, uint64_t from,
+                         uint64_t num_words, uint64_t value);
+
+  /* Returns a mask with bit i set if bytes[i] is 0, for 64 bytes. */
+  uint64_t (*zero_bytes)(const unsigned char *bytes);
+
+  /* bitmap_next_difference() */
+  uint64_t (*next_difference)(const uint64_t *a, const uint64_t *b,
+                              uint64_t from, uint64_t num_words);
+};
+
+static uint64_t skip_words_scalar(const uint64_t *words, uint64_t from,
+                                  uint64_t num_words, uint64_t value) {
+  uint64_t i = from;
+  while (i < num_words && __atomic_load_n(&words[i], __ATOMIC_RELAXED) == value)
+    i++;
+  return i;
+}
+
+static uint64_t zero_bytes_scalar(const unsigned char *bytes) {
+  uint64_t mask = 0;
+  for (unsigned i = 0; i < BITS_PER_WORD; i++)
+    if (bytes[i] == 0)
+      mask |= (uint64_t)1 << i;
+  return mask;
+}
+
+static uint64_t next_difference_scalar(const uint64_t *a, const uint64_t *b,
+                                       uint64_t from, uint64_t num_words) {
+  uint64_t i = from;
+  while (i < num_words && a[i] == b[i])
+    i++;
+  return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* 2 words or 64 bytes per step. */
+__attribute__((target("sse4.2"))) static uint64_t
+skip_words_sse42(const uint64_t *words, uint64_t from, uint64_t num_words,
+                 uint64_t value) {
+  __m128i v = _mm_set1_epi64x(value);
+  uint64_t i = from;
+
+  for (; i + 2 <= num_words; i += 2) {
+    __m128i eq =
+        _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i *)&words[i]), v);
+    unsigned differ = ~_mm_movemask_pd(_mm_castsi128_pd(eq)) & 0x3;
+    if (differ)
+      return i + __builtin_ctz(differ);
+  }
+  return skip_words_scalar(words, i, num_words, value);
+}
+
+__attribute__((target("sse4.2"))) static uint64_t
+zero_bytes_sse42(const unsigned char *bytes) {
+  __m128i zero = _mm_setzero_si128();
+  uint64_t mask = 0;
+
+  for (unsigned i = 0; i < 4; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&bytes[16 * i]);
+    uint64_t m = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+    mask |= m << (16 * i);
+  }
+  return mask;
+}
+
+__attribute__((target("sse4.2"))) static uint64_t
+next_difference_sse42(const uint64_t *a, const uint64_t *b, uint64_t from,
+                      uint64_t num_words) {
+  uint64_t i = from;
+
+  for (; i + 2 <= num_words; i += 2) {
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&a[i]),
+                              _mm_loadu_si128((const __m128i *)&b[i]));
+    if (!_mm_testz_si128(x, x))
+      break;
+  }
+  return next_difference_scalar(a, b, i, num_words);
+}
+
+/* 4 words or 64 bytes per step. */
+__attribute__((target("avx2"))) static uint64_t
+skip_words_avx2(const uint64_t *words, uint64_t from, uint64_t num_words,
+                uint64_t value) {
+  __m256i v = _mm256_set1_epi64x(value);
+  uint64_t i = from;
+
+  for (; i + 4 <= num_words; i += 4) {
+    __m256i eq =
+        _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)&words[i]), v);
+    unsigned differ = ~_mm256_movemask_pd(_mm256_castsi256_pd(eq)) & 0xf;
+    if (differ)
+      return i + __builtin_ctz(differ);
+  }
+  return skip_words_scalar(words, i, num_words, value);
+}
+
+__attribute__((target("avx2"))) static uint64_t
+zero_bytes_avx2(const unsigned char *bytes) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lo = _mm256_loadu_si256((const __m256i *)&bytes[0]);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)&bytes[32]);
+  uint32_t lo_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero));
+  uint32_t hi_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero));
+  return lo_mask | ((uint64_t)hi_mask << 32);
+}
+
+/* 16 words per step, the tables being compared are mostly equal. */
+__attribute__((target("avx2"))) static uint64_t
+next_difference_avx2(const uint64_t *a, const uint64_t *b, uint64_t from,
+                     uint64_t num_words) {
+  uint64_t i = from;
+
+  for (; i + 16 <= num_words; i += 16) {
+    __m256i x = _mm256_setzero_si256();
+    for (unsigned j = 0; j < 16; j += 4)
+      x = _mm256_or_si256(
+          x, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&a[i + j]),
+                              _mm256_loadu_si256((const __m256i *)&b[i + j])));
+    if (!_mm256_testz_si256(x, x))
+      break;
+  }
+  return next_difference_scalar(a, b, i, num_words);
+}
+
+#endif
+
+static const struct kernel kernels[] = {
+    [RUN_SEARCH_SCALAR] = {"scalar", skip_words_scalar, zero_bytes_scalar,
+                           next_difference_scalar},
+#ifdef HAVE_X86_KERNELS
+    [RUN_SEARCH_SSE42] = {"sse4.2", skip_words_sse42, zero_bytes_sse42,
+                          next_difference_sse42},
+    [RUN_SEARCH_AVX2] = {"avx2", skip_words_avx2, zero_bytes_avx2,
+                         next_difference_avx2},
+#endif
+};
+
+static const struct kernel *current = NULL;
+
+static int supported(enum run_search_kernel kernel) {
+  switch (kernel) {
+  case RUN_SEARCH_SCALAR:
+    return 1;
+#ifdef HAVE_X86_KERNELS
+  case RUN_SEARCH_SSE42:
+    return __builtin_cpu_supports("sse4.2");
+  case RUN_SEARCH_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return 0;
+  }
+}
+
+int run_search_select(enum run_search_kernel kernel) {
+  if (kernel == RUN_SEARCH_AUTO) {
+    kernel = RUN_SEARCH_SCALAR;
+    if (supported(RUN_SEARCH_SSE42))
+      kernel = RUN_SEARCH_SSE42;
+    if (supported(RUN_SEARCH_AVX2))
+      kernel = RUN_SEARCH_AVX2;
+  }
+  if (!supported(kernel))
+    return -1;
+
+  __atomic_store_n(&current, &kernels[kernel], __ATOMIC_RELEASE);
+  return 0;
+}
+
+static const struct kernel *kernel() {
+  const struct kernel *k = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  if (k == NULL) {
+    run_search_select(RUN_SEARCH_AUTO);
+    k = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+  }
+  return k;
+}
+
+const char *run_search_kernel_name() { return kernel()->name; }
+
+/* Most skips in a fragmented table are short. The first few words
+ * are checked here, the kernel only pays off for longer ones.
+ */
+#define SHORT_SKIP 4
+
+uint64_t bitmap_skip_words(const uint64_t *words, uint64_t from,
+                           uint64_t num_words, uint64_t value) {
+  for (unsigned i = 0; i < SHORT_SKIP; i++, from++)
+    if (from >= num_words ||
+        __atomic_load_n(&words[from], __ATOMIC_RELAXED) != value)
+      return (from < num_words) ? from : num_words;
+  return kernel()->skip_words(words, from, num_words, value);
+}
+
+uint64_t bitmap_next_difference(const uint64_t *a, const uint64_t *b,
+                                uint64_t from, uint64_t num_words) {
+  return kernel()->next_difference(a, b, from, num_words);
+}
+
+uint64_t summary_next_word(const uint64_t *summary, uint64_t from,
+                           uint64_t num_words) {
+  if (from >= num_words)
+    return num_words;
+
+  uint64_t num_summary = (num_words + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  uint64_t s = from / BITS_PER_WORD;
+  uint64_t bits = __atomic_load_n(&summary[s], __ATOMIC_RELAXED) &
+                  (ALL_ONES << (from % BITS_PER_WORD));
+
+  while (bits == 0) {
+    s = bitmap_skip_words(summary, s + 1, num_summary, 0);
+    if (s >= num_summary)
+      return num_words;
+    bits = __atomic_load_n(&summary[s], __ATOMIC_RELAXED);
+  }
+
+  uint64_t w = s * BITS_PER_WORD + __builtin_ctzll(bits);
+  return (w < num_words) ? w : num_words;
+}
+
+/* A table in either layout, seen as chunks of 64 blocks. */
+struct table {
+  const uint64_t *words;
+  const uint64_t *summary;
+  const unsigned char *bytes;
+  uint64_t num_blocks;
+  uint64_t num_chunks;
+};
+
+/* Returns a mask with bit i set if block 64*chunk+i is free. Blocks
+ * after the last one are not free.
+ */
+static uint64_t free_mask(const struct table *t, uint64_t chunk) {
+  uint64_t first = chunk * BITS_PER_WORD;
+  uint64_t mask;
+
+  if (t->words) {
+    mask = ~__atomic_load_n(&t->words[chunk], __ATOMIC_RELAXED);
+  } else if (t->num_blocks - first >= BITS_PER_WORD) {
+    return kernel()->zero_bytes(&t->bytes[first]);
+  } else {
+    mask = 0;
+    for (uint64_t b = first; b < t->num_blocks; b++)
+      if (t->bytes[b] == 0)
+        mask |= (uint64_t)1 << (b - first);
+  }
+
+  if (t->num_blocks - first < BITS_PER_WORD)
+    mask &= ((uint64_t)1 << (t->num_blocks - first)) - 1;
+  return mask;
+}
+
+/* Returns the first chunk in [from, to) whose free mask is not
+ * value, or to. Only used with value 0 or ALL_ONES.
+ */
+static uint64_t skip_chunks(const struct table *t, uint64_t from, uint64_t to,
+                            uint64_t value) {
+  if (t->words) {
+    /* Padding in the last word may make it stop one chunk early,
+     * free_mask() sorts that out.
+     */
+    if (t->summary && value == 0) {
+      uint64_t w = summary_next_word(t->summary, from, t->num_chunks);
+      return (w < to) ? w : to;
+    }
+    return bitmap_skip_words(t->words, from, to, ~value);
+  }
+
+  while (from < to && free_mask(t, from) == value)
+    from++;
+  return from;
+}
+
+/* Returns a mask of the blocks in a chunk where a run of len free
+ * blocks starts, 1 <= len <= 64. free is the free mask of the chunk
+ * and next that of the chunk after it.
+ */
+static uint64_t run_starts(uint64_t free, uint64_t next, uint64_t len) {
+  unsigned __int128 runs = free | ((unsigned __int128)next << BITS_PER_WORD);
+  uint64_t k = 1;
+
+  /* After this, bit i is set if blocks [i, i+k) are free. */
+  while (k * 2 <= len) {
+    runs &= runs >> k;
+    k *= 2;
+  }
+  /* [i, i+k) and [i+len-k, i+len) cover [i, i+len) since len < 2k. */
+  if (len > k)
+    runs &= runs >> (len - k);
+  return (uint64_t)runs;
+}
+
+/* Returns the end of the free run that starts at block start, or
+ * start+len if it is at least len blocks long.
+ */
+static uint64_t run_end(const struct table *t, uint64_t start, uint64_t len) {
+  uint64_t limit = (len < t->num_blocks - start) ? start + len : t->num_blocks;
+  uint64_t last_chunk = (limit + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  uint64_t chunk = start / BITS_PER_WORD;
+  uint64_t used = ~free_mask(t, chunk) & (ALL_ONES << (start % BITS_PER_WORD));
+
+  while (used == 0) {
+    chunk = skip_chunks(t, chunk + 1, last_chunk, ALL_ONES);
+    if (chunk >= last_chunk)
+      return limit;
+    used = ~free_mask(t, chunk);
+  }
+
+  uint64_t end = chunk * BITS_PER_WORD + __builtin_ctzll(used);
+  return (end < limit) ? end : limit;
+}
+
+static uint64_t find_run(const struct table *t, uint64_t from, uint64_t len) {
+  if (len == 0 || from >= t->num_blocks)
+    return t->num_blocks;
+
+  uint64_t chunk = from / BITS_PER_WORD;
+  uint64_t free = free_mask(t, chunk) & (ALL_ONES << (from % BITS_PER_WORD));
+
+  for (;;) {
+    if (free == 0) {
+      chunk = skip_chunks(t, chunk + 1, t->num_chunks, 0);
+      if (chunk >= t->num_chunks)
+        return t->num_blocks;
+      free = free_mask(t, chunk);
+      continue;
+    }
+
+    /* Short runs start in this chunk and end in the next at the
+     * latest, they are found with a few shifts.
+     */
+    if (len <= BITS_PER_WORD) {
+      uint64_t next =
+          (chunk + 1 < t->num_chunks) ? free_mask(t, chunk + 1) : 0;
+      uint64_t starts = run_starts(free, next, len);
+      if (starts)
+        return chunk * BITS_PER_WORD + __builtin_ctzll(starts);
+      if (++chunk >= t->num_chunks)
+        return t->num_blocks;
+      free = next;
+      continue;
+    }
+
+    /* Long runs are followed from their first block. */
+    uint64_t start = chunk * BITS_PER_WORD + __builtin_ctzll(free);
+    uint64_t end = run_end(t, start, len);
+    if (end - start >= len)
+      return start;
+    if (end >= t->num_blocks)
+      return t->num_blocks;
+    chunk = end / BITS_PER_WORD;
+    free = free_mask(t, chunk) & (ALL_ONES << (end % BITS_PER_WORD));
+  }
+}
+
+uint64_t bitmap_find_run(const uint64_t *words, const uint64_t *summary,
+                         uint64_t num_blocks, uint64_t from, uint64_t len) {
+  struct table t = {.words = words,
+                    .summary = summary,
+                    .num_blocks = num_blocks,
+                    .num_chunks =
+                        (num_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD};
+  return find_run(&t, from, len);
+}
+
+uint64_t bytes_find_run(const unsigned char *bytes, uint64_t num_blocks,
+                        uint64_t from, uint64_t len) {
+  struct table t = {.bytes = bytes,
+                    .num_blocks = num_blocks,
+                    .num_chunks =
+                        (num_blocks + BITS_PER_WORD - 1) / BITS_PER_WORD};
+  return find_run(&t, from, len);
+}
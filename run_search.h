@@ -0,0 +1,66 @@
+#ifndef RUN_SEARCH_H
+#define RUN_SEARCH_H
+
+#include <stdint.h>
+
+/* Searches for runs of free blocks in the two table layouts: the
+ * bitmap, where bit i%64 of word i/64 is set if block i is used, and
+ * the old layout with one byte per block that is 0 if the block is
+ * free.
+ * The tables are examined 64 blocks at a time, with a kernel that is
+ * picked for the CPU at the first search: AVX2, SSE4.2 or plain C.
+ * The kernels read the table with plain vector loads. If other threads
+ * change it meanwhile, a result is only a candidate that the caller
+ * has to check when it claims the blocks.
+ */
+
+/* The kernels that run_search_select() can pick. */
+enum run_search_kernel {
+  RUN_SEARCH_AUTO,
+  RUN_SEARCH_SCALAR,
+  RUN_SEARCH_SSE42,
+  RUN_SEARCH_AVX2
+};
+
+/* Use kernel for all following searches. RUN_SEARCH_AUTO picks the
+ * best one the CPU supports.
+ * Returns 0 on success and -1 if the CPU does not support kernel.
+ */
+int run_search_select(enum run_search_kernel kernel);
+
+/* Return the name of the kernel in use. */
+const char *run_search_kernel_name();
+
+/* Return the index of the first of words[from], ..., words[num_words-1]
+ * that is not equal to value, or num_words if they all are.
+ */
+uint64_t bitmap_skip_words(const uint64_t *words, uint64_t from,
+                           uint64_t num_words, uint64_t value);
+
+/* Return the index of the first word w >= from where a[w] and b[w]
+ * differ, or num_words if there is none.
+ */
+uint64_t bitmap_next_difference(const uint64_t *a, const uint64_t *b,
+                                uint64_t from, uint64_t num_words);
+
+/* Return the index of the first word w >= from whose bit w%64 in
+ * summary[w/64] is set, or num_words if there is none.
+ */
+uint64_t summary_next_word(const uint64_t *summary, uint64_t from,
+                           uint64_t num_words);
+
+/* Return the first block b >= from such that the blocks [b, b+len)
+ * are all free, or num_blocks if there is none. len must be at least
+ * 1. Bits after the last block are taken to be used.
+ * summary can be NULL, or have bit w%64 of summary[w/64] set for every
+ * word w of the bitmap with a free block. Words with a clear bit are
+ * then skipped without looking at them.
+ */
+uint64_t bitmap_find_run(const uint64_t *words, const uint64_t *summary,
+                         uint64_t num_blocks, uint64_t from, uint64_t len);
+
+/* Like bitmap_find_run(), for a table with one byte per block. */
+uint64_t bytes_find_run(const unsigned char *bytes, uint64_t num_blocks,
+                        uint64_t from, uint64_t len);
+
+#endif // RUN_SEARCH_H
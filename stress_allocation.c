@@ -0,0 +1,142 @@
+#include "block_allocation.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRESS_BLOCKS 100000
+#define NUM_THREADS 16
+#define ROUNDS 20000
+#define MAX_LIVE 128
+
+/* owner[b] is the thread that holds block b plus one, or 0 if it is
+ * free. Every thread sets it with an atomic exchange for the blocks it
+ * was given, so any block that is handed out twice is seen.
+ */
+static unsigned char owner[STRESS_BLOCKS];
+static long double_allocations = 0;
+static long failed_frees = 0;
+
+struct live_run {
+  uint32_t start;
+  uint32_t len;
+};
+
+static void take(int id, uint32_t start, uint32_t len) {
+  for (uint32_t b = start; b < start + len; b++) {
+    unsigned char prev =
+        __atomic_exchange_n(&owner[b], id + 1, __ATOMIC_RELAXED);
+    if (prev != 0) {
+      fprintf(stderr, "Block %u given to thread %d and thread %d\n", b,
+              prev - 1, id);
+      __atomic_fetch_add(&double_allocations, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void give(struct live_run run) {
+  for (uint32_t b = run.start; b < run.start + run.len; b++)
+    __atomic_store_n(&owner[b], 0, __ATOMIC_RELAXED);
+
+  int error = (run.len == 1) ? free_block(run.start)
+                             : free_extent(run.start, run.len);
+  if (error)
+    __atomic_fetch_add(&failed_frees, 1, __ATOMIC_RELAXED);
+}
+
+/* Allocates single blocks, short runs and multi-extent files in
+ * random order and frees them again, always keeping a few of them.
+ */
+static void *stress(void *arg) {
+  int id = (int)(long)arg;
+  unsigned seed = id * 7919 + 1;
+  struct live_run live[MAX_LIVE];
+  int num_live = 0;
+
+  for (int i = 0; i < ROUNDS; i++) {
+    int r = rand_r(&seed);
+
+    if (num_live > 0 && (num_live == MAX_LIVE || r % 3 == 0)) {
+      int k = r % num_live;
+      give(live[k]);
+      live[k] = live[--num_live];
+      continue;
+    }
+
+    if (r % 2) {
+      int len = 1 + r % 8;
+      int block = allocate_block(len);
+      if (block != -1) {
+        take(id, block, len);
+        live[num_live++] = (struct live_run){block, len};
+      }
+      continue;
+    }
+
+    struct Extent extents[16];
+    int n = allocate_extents(1 + r % 40, extents, MAX_LIVE - num_live < 16
+                                                      ? MAX_LIVE - num_live
+                                                      : 16);
+    for (int e = 0; e < n; e++) {
+      take(id, extents[e].blockno, extents[e].extent);
+      live[num_live++] =
+          (struct live_run){extents[e].blockno, extents[e].extent};
+    }
+  }
+
+  while (num_live > 0)
+    give(live[--num_live]);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr,
+            "Usage: %s BAT MODE\n"
+            "       where\n"
+            "       BAT is the name of the block allocation table\n"
+            "       MODE is locked, lock-free or buddy\n",
+            argv[0]);
+    exit(-1);
+  }
+
+  char *bat_name = argv[1];
+  char *mode = argv[2];
+  int flags = 0;
+  enum bat_backend backend = BAT_BACKEND_BITMAP;
+
+  if (strcmp(mode, "locked") == 0) {
+    flags = 0;
+  } else if (strcmp(mode, "lock-free") == 0) {
+    flags = BAT_LOCK_FREE;
+  } else if (strcmp(mode, "buddy") == 0) {
+    backend = BAT_BACKEND_BUDDY;
+  } else {
+    fprintf(stderr, "Unknown mode %s\n", mode);
+    exit(-1);
+  }
+
+  set_block_allocation_table_name_with_flags(bat_name, flags);
+  if (format_disk_with_backend(STRESS_BLOCKS, BLOCKSIZE, backend) != 0)
+    exit(-1);
+
+  pthread_t threads[NUM_THREADS];
+  for (long t = 0; t < NUM_THREADS; t++)
+    pthread_create(&threads[t], NULL, stress, (void *)t);
+  for (int t = 0; t < NUM_THREADS; t++)
+    pthread_join(threads[t], NULL);
+
+  /* Everything was freed, so the whole disk must come back as one
+   * extent.
+   */
+  struct Extent whole;
+  int n = allocate_extents(STRESS_BLOCKS, &whole, 1);
+
+  printf("%d threads, %d rounds each\n", NUM_THREADS, ROUNDS);
+  printf("double allocations: %ld\n", double_allocations);
+  printf("failed frees:       %ld\n", failed_frees);
+  printf("disk empty at end:  %s\n", n > 0 ? "yes" : "no");
+
+  return (double_allocations == 0 && failed_frees == 0 && n > 0) ? 0 : 1;
+}